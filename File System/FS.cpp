@@ -1,52 +1,428 @@
 #include "FS.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <climits>
 #include <cstring>
 #include <iostream>
+#include <unordered_map>
+#include <vector>
 
+#include "bitmap.h"
+#include "cache.h"
+#include "dcache.h"
 #include "disk.h"
+#include "journal.h"
+#include "instance.h"
+#include "lock.h"
+#include "lz.h"
+#include "stats.h"
+
+#if (THREAD_SAFE)
+#include <thread>
+#endif
 
 #ifndef DEBUG
 #define DEBUG 0
 #endif
 
-#define MAX_FILE_NAME_LEN 4
-
 #define BLK_STS_FREE 0
 #define BLK_STS_OCCUPIED 1
 
-#define DESCRIPTOR_BLOCKS 6
-#define DESCRIPTOR_MAX_BLOCKS 3
+#define DESCRIPTOR_BLOCKS 6  // minimum number of descriptor blocks
+#define DESCRIPTOR_MAX_BLOCKS 3  // direct blocks
+#define INDIRECT_LEVELS 3        // single, double and triple indirect blocks
+#define BLOCKS_PER_DESCRIPTOR 4  // disk blocks per descriptor on large disks
+
+#define OFTS 64  // OFTs allocated at a time, the table grows on demand
+#define MAX_OFTS (1 << FH_INDEX_BITS)
+#define OFT_CHUNKS (MAX_OFTS / OFTS)
+#define FH_GENERATIONS (1 << (31 - FH_INDEX_BITS))
+
+#define DESC_LOCKS 256  // descriptor lock stripes, a power of two
+
+#define JOURNAL_FRACTION 128  // the journal takes 1/128 of a large disk
+
+#define SUPER_BLOCK 0
+#define SUPER_MAGIC "FSSUPER5"
+
+#define FILE_TYPE_REGULAR 0
+#define FILE_TYPE_DIRECTORY 1
+#define FILE_INLINE 0x100      // flag of a regular file: the data is inline
+#define FILE_COMPRESSED 0x200  // and its clusters are compressed
+
+#define CLUSTER_BLOCKS 16  // blocks of a compressed file compressed together
 
-#define BUFFER_BLOCKS (1 + DESCRIPTOR_BLOCKS)
+#define MAP_BATCH 64  // blocks mapped at a time by the whole block path
 
-#define OFTS 4  // number of OFTs
+// bmap() alloc flags besides 1
+#define BMAP_UNSHARE 2  // give the file its own copy of a shared block
+#define BMAP_NOCOPY 4   // without copying it, the caller overwrites it
+#define BMAP_SLOTS 8    // get or, with 1, set the pointers as they are
+#define BMAP_BAD -2     // bmap(): an indirect block failed its checksum
+
+#define MAX_REFS 255  // most pointers to a block past the first
+
+#define DEDUP_SPAN 4  // data blocks per entry of the dedup index
+
+#define RA_MIN_BLOCKS 4    // first readahead window
+#define RA_MAX_BLOCKS 256  // largest readahead window
 
 struct DESCRIPTOR_T {
     int file_size;
+    // FILE_TYPE_REGULAR or FILE_TYPE_DIRECTORY, and the FILE_ flags
+    int type;
     int block[DESCRIPTOR_MAX_BLOCKS];
+    // indirect[i] is the root of a tree of indirect blocks of height i + 1,
+    // each indirect block holds ptrs_each_block block numbers.
+    int indirect[INDIRECT_LEVELS];
+};
+
+// An inline file keeps its data in place of block and indirect, so a tiny
+// file takes no block and is read along with its descriptor.
+#define INLINE_BYTES \
+    ((DESCRIPTOR_MAX_BLOCKS + INDIRECT_LEVELS) * (int)sizeof(int))
+
+// A compressed file is mapped in clusters of CLUSTER_BLOCKS blocks. A
+// cluster which shrinks by a block or more is compressed as a whole into
+// the first blocks of its pointers, and its last pointer holds -2 - the
+// compressed length; any other cluster is stored as is, and a cluster of
+// zeros is a hole. The bytes of a cluster past the end of the file are
+// zeros. A cluster is always written to new blocks, so the blocks the
+// committed map points to stay intact until the next commit.
+static inline int packed_length(int last_slot) {
+    return last_slot < -1 ? -2 - last_slot : 0;
+}
+
+// An entry of the dedup index: the high half of the block_hash() of a data
+// block, and the block, -1 if the entry is free. The low half picks the
+// index block holding the entry. The index holds a reference to each of its
+// blocks, so they are shared and never written in place.
+struct DEDUP_ENTRY_T {
+    unsigned int hash;
+    int block;
+};
+
+// Block SUPER_BLOCK, it describes the disk so it is mounted as it is.
+struct SUPERBLOCK_T {
+    char magic[8];
+    int block_size, total_blocks;
+    int bitmap_blocks, refcount_blocks, dedup_blocks, descriptor_blocks;
+    int journal_blocks;
+    int clean;  // unmounted by FS_close(), the metadata needs no check
+};
+
+// A directory is a run of blocks. A block starts with a DIR_BLOCK_T and its
+// entries, the names are packed at the end of the block and grow down
+// towards them. An entry is 16 bytes so it never straddles a cache line, and
+// a lookup reads a name only when the hash and length match. A block of
+// zeros is an empty block.
+struct DIR_BLOCK_T {
+    int entries;     // entries in the block, free ones included
+    int names;       // bytes at the end of the block holding names
+    int live;        // entries in use
+    int live_names;  // bytes of their names
 };
 
 struct DIRECTORY_ENTRY_T {
-    char file_name[MAX_FILE_NAME_LEN];
-    int descriptor;
+    unsigned int hash;  // of the name
+    int descriptor;     // -1 if the entry is free
+    int name;           // offset of the name in the block
+    int len;            // of the name, which has no terminating NUL
 };
 
+// Open files share the block cache instead of buffering their own blocks,
+// the size is kept in the descriptor only. lock guards pos, descriptor and
+// generation, so each handle has its own position; next_free belongs to
+// oft_lock.
 struct OFT_T {
-    byte buffer[BLOCK_SIZE];
-    int pos, size, descriptor;
+    MUTEX_T lock;
+    int pos, descriptor;  // descriptor is -1 if the entry is free
+    int generation;       // bumped by close(), so stale handles are rejected
+    int next_free;        // next entry of the free list
+    // Readahead: a read at ra_next goes on from the last one. While reads
+    // are sequential the blocks before ra_end are being prefetched and the
+    // window grows, a read elsewhere closes the window.
+    int ra_next, ra_end;
+    int ra_window;  // in blocks, 0 if reads are not sequential
+};
+
+// A view of FS_mmap(), of the file blocks [first, first + blocks) from
+// which the range [off, off + len) of the file is seen. A direct view is
+// the disk blocks from block; a cached view is a copy of the blocks, with
+// the block_hash() of each as it was last written back in hashes.
+struct VIEW_T {
+    int fh, descriptor;
+    int off, len;
+    int first, blocks;
+    int block;  // -1 for a cached view
+    std::vector<byte> data;
+    std::vector<uint64_t> hashes;
+};
+
+// State of FS_fsck(), shared by its threads. The bitmaps have a bit per
+// block or per descriptor, they are the memory a check needs besides the
+// list of directory blocks.
+struct FSCK_T {
+    uint64_t *used;    // blocks the files use
+    uint64_t *shared;  // blocks more than one pointer points to
+    uint64_t *in_use;  // descriptors of files
+    uint64_t *dirs;    // descriptors of directories
+    uint64_t *named;   // descriptors named by a directory entry
+    byte *refs;        // reference counts on the disk
+    uint16_t *pointers;  // pointers to each data block
+    // Blocks of the directories reached from the root, breadth first. A
+    // pass checks the blocks from level_begin, one level of the tree.
+    std::vector<int> dir_blocks;  // -1 for a hole or a bad pointer
+    int level_begin;
+    std::vector<int> subdirs;  // directories of the next level
+    int threads;
+    std::atomic<int> next;  // next piece of work of a pass
+    MUTEX_T lock;           // guards found and subdirs
+    FS_FSCK_T found;
+    std::atomic<long long> damaged;  // metadata blocks failing checksums
 };
 
 //////////////////////////////////////////////////////////////////////////////
 
 // GLOBAL VARS
 
-static byte D_COPY[BUFFER_BLOCKS][BLOCK_SIZE];
-static OFT_T OFT[OFTS];
-static int ROOT;
+// Blocks reserved by write() with alloc_run(), handed out first by
+// get_free_block() of the same thread.
+static thread_local int reserved_next, reserved_end;
+// The last cluster of a compressed file each thread decompressed, valid
+// while the cluster_gen of its instance is unchanged; every change to a
+// compressed file bumps it. packed holds compressed data on the way.
+struct CLUSTER_BUF_T {
+    // The FS_T::id of the instance of descriptor: an instance created
+    // where a deleted one was has another id
+    unsigned long long fs_id = 0;
+    int descriptor = -1, cluster;
+    unsigned int gen;
+    std::vector<byte> data, packed;
+};
+static thread_local CLUSTER_BUF_T cluster_buf;
+// Copy of a block of a file with direct views, see data_get().
+static thread_local std::vector<byte> bounce;
+
+// The file system of an instance.
+struct FS_T {
+    // Geometry, set up by FS_init() from the opened disk.
+    //  [SUPER_BLOCK]  [1, refs_start)  [refs_start, dedup_start)
+    //   superblock        bitmap          reference counts
+    //  [dedup_start, desc_start)  [desc_start, buffer_blocks)
+    //         dedup index                 descriptors
+    //  [buffer_blocks, first_data_block)  [first_data_block]
+    //               journal                ROOT's first block
+    // Data blocks are shared by clones of a file and by deduplication: the
+    // byte of a block in the reference counts counts the pointers to it
+    // past the first, a block whose count is not 0 is copied before it is
+    // written.
+    int block_size;
+    int block_shift;  // log2 of block_size, a power of two
+    int total_blocks;
+    int bitmap_blocks;
+    int refs_start;
+    int refcount_blocks;
+    int dedup_start;
+    int dedup_blocks;
+    int desc_start;
+    int descriptor_blocks;
+    int buffer_blocks;  // the blocks up to the journal are buffered
+    int journal_blocks;
+    int first_data_block;
+    // Number of descriptors in each block.
+    int desc_each_block;
+    // Total number of descriptors.
+    int descriptors;
+    // Number of block numbers in each indirect block, and its log2.
+    int ptrs_each_block, ptrs_shift;
+    // Largest file size, limited by the block map and by int positions.
+    int max_file_size;
+
+    // buffer_blocks blocks, see buffered_block(). A block is read on its
+    // first use, changes reach the disk through the journal.
+    byte *D_COPY;
+    std::atomic<bool> *D_LOADED;
+    MUTEX_T load_lock;  // guards reading blocks into D_COPY
+    // A buffered block failed its checksum as it was read: the disk is left
+    // unclean, for FS_fsck() at the next mount.
+    std::atomic<bool> damaged;
+    int cache_blocks = CACHE_BLOCKS;
+    // Next fit: block allocation goes on from the last allocated block.
+    // Blocks are claimed with atomic bitmap updates, so allocation takes no
+    // lock.
+    std::atomic<int> alloc_hint;
+    // Whether create() makes compressed files.
+    std::atomic<bool> compress_new;
+    // Bumped by every change to a compressed file, see CLUSTER_BUF_T.
+    std::atomic<unsigned int> cluster_gen;
+    unsigned long long id;  // of the instance, never reused by the process
+    // Whether write() deduplicates whole blocks.
+    std::atomic<bool> dedup_on;
+    // A bit per block the dedup index points to, read from the index on
+    // first use. dedup_lock guards it, the index and the references the
+    // index holds.
+    uint64_t *DEDUP_INDEXED;
+    std::atomic<bool> dedup_loaded;
+    MUTEX_T dedup_lock;
+    // Whole blocks written with dedup on since start, those of them which
+    // reused a block, and the blocks in the index once loaded.
+    std::atomic<long long> dedup_written, dedup_reused;
+    long long dedup_entries;
+    // Views of FS_mmap() by address, a range with two direct views is there
+    // twice. Guarded by view_lock.
+    std::unordered_multimap<const void *, VIEW_T> views;
+    MUTEX_T view_lock;
+    // Direct views of each descriptor, changed under its exclusive lock.
+    // The data blocks of a file with direct views are not cached, see
+    // data_get().
+    std::atomic<int> *DIRECT_VIEWS;
+    // The OFT table grows by chunks of OFTS entries which never move, so
+    // handles are looked up without a lock.
+    std::atomic<OFT_T *> OFT[OFT_CHUNKS];
+    int ofts;      // number of OFTs in the table
+    int free_oft;  // head of the free list, -1 if empty
+    MUTEX_T oft_lock;  // guards ofts and the free list
+    // Position of the first block of a directory which may have room for a
+    // name, 0 if not known yet. Guarded by an exclusive dir_lock.
+    std::unordered_map<int, int> dir_hint;
+    // Free descriptors. Descriptors below free_descriptor_scan which are not
+    // in FREE_DESCRIPTORS are in use, the ones above are not scanned yet.
+    int *FREE_DESCRIPTORS;
+    int free_descriptors;
+    int free_descriptor_scan;
+    MUTEX_T descriptor_lock;  // guards the free descriptors
+    int ROOT;
+
+    // Lock order: dir_lock, an OFT's lock, the descriptor locks, a journal
+    // handle, then the locks inside the allocators and the cache. Only the
+    // functions adding or removing a directory entry hold two descriptor
+    // locks, the directory's and the file's, taken by lock_pair().
+    //
+    // Directories change under an exclusive dir_lock, path lookups share it
+    // and fill the dentry cache.
+    RW_LOCK_T dir_lock;
+    // Descriptor d is guarded by DESC_LOCK[d % DESC_LOCKS], together with
+    // the file's blocks: read() shares it, write() and destroy() hold it
+    // alone.
+    RW_LOCK_T DESC_LOCK[DESC_LOCKS];
+};
 
 // HELPER FUNCTIONS
 
+static int FS_init_geometry();
 static int FS_init_disk();
+// Start the file system on a formatted disk.
+static int FS_start();
+// Read the superblock, return -1 unless it describes a disk of this
+// geometry.
+static int read_superblock();
+// Mark the disk as mounted, or as cleanly unmounted, on disk.
+static void set_clean(int clean);
+// read_block() of metadata block b for the check. A block failing its
+// checksum is used as read, so the blocks it points to stay in use, and
+// counted in c->damaged unless c is NULL.
+static int fsck_read(FSCK_T *c, int b, byte *buff);
+// Run work on c->threads threads, each taking pieces of work from c->next
+// until there are none left.
+static void fsck_run(FSCK_T *c, void (*work)(FSCK_T *));
+// FS_fsck() pass over the descriptors, filling used, shared, in_use and
+// dirs.
+static void fsck_files(FSCK_T *c);
+// Mark block b of the given indirect level (0 for data) and its subtree in
+// c->used, counting in found. buff has room for level blocks. The data
+// pointers of a compressed file may hold cluster lengths.
+static void fsck_mark(FSCK_T *c, int b, int level, bool compressed,
+                      byte *buff, FS_FSCK_T *found);
+// Check the directory tree one level at a time from the root.
+static void fsck_tree(FSCK_T *c);
+// Add the blocks of directory d to c->dir_blocks.
+static void fsck_dir_blocks(FSCK_T *c, int d);
+// Add the first n blocks of the tree of block b of the given level to
+// blocks.
+static void fsck_collect(int b, int level, int n, byte *buff,
+                         std::vector<int> *blocks);
+// Compare the reference counts on disk with the pointers counted, counting
+// the differences in found, and with write set them right.
+static void fsck_refcounts(FSCK_T *c, int write, FS_FSCK_T *found);
+// FS_fsck() pass over the entries of a level of directories, filling named
+// and the next level.
+static void fsck_dir(FSCK_T *c);
+// Check directory block b, adding the directories it names to subdirs if
+// not NULL, and return the number of bad entries, a header with wrong
+// counts being one. With clear the bad entries are freed and the counts set
+// right, or the whole block is emptied if its header is bad.
+static int fsck_dir_block(FSCK_T *c, byte *b, bool clear,
+                          std::vector<int> *subdirs);
+// Whether a directory entry names descriptor d rightly; marks d as named.
+static bool fsck_entry_ok(FSCK_T *c, int d);
+// Compare the bitmap on disk with c->used, counting the differences in
+// found, and with write replace the blocks which differ.
+static void fsck_bitmap(FSCK_T *c, int write, FS_FSCK_T *found);
+// Fix what the passes found, one thread.
+static void fsck_repair(FSCK_T *c);
+// Fix the pointer at p to a block of the given level and its subtree:
+// drop a bad pointer, and copy a block an earlier pointer claimed in
+// claimed (or every block, with copy). Return whether *p changed.
+static bool fsck_fix(FSCK_T *c, int *p, int level, bool compressed,
+                     bool copy, uint64_t *claimed, byte *buff);
+// Whether data pointer p of a compressed file is a cluster length.
+static bool fsck_packed(int p);
+// Count the pointers of the dedup index in c->pointers. An entry for a block
+// no file uses as data is dropped, so the block is freed; bad pointers and
+// second entries for a block are dropped and counted in found. With write
+// the index is written back without them.
+static void fsck_index(FSCK_T *c, int write, FS_FSCK_T *found);
+// Resolve every name of path but the last: store the directory holding the
+// last name in *parent and the name in name, empty if path is the root
+// directory. Return 0 or an error. The caller holds dir_lock.
+static int resolve(const char *path, int *parent, char *name);
+// Descriptor of name in directory parent, or -1 if there is no such file.
+// Store the slot of its entry if slot is not NULL. The caller holds
+// dir_lock.
+static int dir_lookup(int parent, const char *name, int *slot);
+// Find name in directory parent and store it in e if found. The entries of
+// a directory which fits in the dentry cache are all read into it, so the
+// directory is complete afterwards.
+static void dir_fill(int parent, const char *name, DENTRY_T *e);
+// FNV-1a of the len bytes of name.
+static unsigned int name_hash(const char *name, int len);
+// Number of entries of directory block b, within the block.
+static int dir_block_entries(const byte *b);
+// Whether the name of entry e lies in directory block b.
+static bool dir_name_ok(const byte *b, const DIRECTORY_ENTRY_T *e);
+// Slot of entry i of the directory block at pos.
+static inline int dir_slot(int pos, int i) {
+    return pos + sizeof(DIR_BLOCK_T) + i * sizeof(DIRECTORY_ENTRY_T);
+}
+// Add an entry naming descriptor to directory parent, d, and return its
+// slot, or -1 if the directory cannot grow. The caller holds an exclusive
+// dir_lock and the lock of d.
+static int dir_add(int parent, DESCRIPTOR_T *d, const char *name,
+                   int descriptor);
+// Put an entry in directory block b, packing its names if they are spread
+// out, and store its index in *i. Return false if there is no room.
+static bool dir_block_add(byte *b, const char *name, int len, int descriptor,
+                          int *i);
+// Free the entry at slot of directory parent, d; the locks are dir_add()'s.
+static void dir_remove(int parent, DESCRIPTOR_T *d, int slot);
+// Pin the block at pos of directory d in the cache, storing its number in
+// *b, and return it; NULL for a hole. The caller holds the lock of d.
+static byte *dir_block_get(DESCRIPTOR_T *d, int pos, int *b);
+// Unpin directory block b, journaling it if it was changed.
+static void dir_block_put(DESCRIPTOR_T *d, int b, bool dirty);
+// Whether directory d has no entries.
+static bool dir_empty(int d);
+// create() or mkdir().
+static int make_file(const char *path, int type);
+// Free the blocks of file d and mark its descriptor free, leaving it to the
+// caller to put it back. The caller holds its lock and a journal handle.
+static void free_file(DESCRIPTOR_T *d);
+// Free file d, named name at slot of directory parent, with its blocks and
+// its entry, and return 0, or ERR_FILE_MAPPED if it has a direct view. The
+// caller holds an exclusive dir_lock.
+static int remove_file(int parent, const char *name, int slot, int d);
 #if (DEBUG)
 static void print_blocks_status();
 #endif
@@ -55,322 +431,953 @@ static void print_blocks_status();
 static void set_block_status(int b, int status);
 // Get one free descriptor.
 static int get_free_descriptor();
+// Give back a descriptor with file_size -1.
+static void put_free_descriptor(int d);
 // Get one free block.
 static int get_free_block();
-// Get one free OFT.
+// Get n contiguous free blocks, return the first one.
+static int alloc_run(int n);
+// Free the blocks [first, first + n) at once, for blocks which no
+// committed metadata points to; other blocks go through journal_free().
+static void free_run(int first, int n);
+// Get one free OFT, return its index.
 static int get_free_oft();
+// Put OFT i back on the free list.
+static void put_free_oft(int i);
+// The OFT with the index of handle fh, or NULL if there is none.
+static OFT_T *get_oft(int fh);
+// Lock the OFT of handle fh with lock and return it, or NULL if fh is not an
+// open file handle.
+static OFT_T *lock_oft(int fh, UNIQUE_LOCK_T &lock);
+// The lock of descriptor d.
+static inline RW_LOCK_T &desc_lock(int d) {
+    FS_T *fs = instance->fs;
+    return fs->DESC_LOCK[d & (DESC_LOCKS - 1)];
+}
+// Lock descriptors a and b alone with first and second, in the order of
+// their locks so two pairs never wait on each other.
+static void lock_pair(int a, int b, WRITE_LOCK_T &first, WRITE_LOCK_T &second);
+// lock_pair() of three descriptors.
+static void lock_three(int a, int b, int c, WRITE_LOCK_T locks[3]);
+// Note a read of n bytes at pos through f and prefetch the blocks ahead of
+// it if the reads are sequential.
+static void readahead(OFT_T *f, DESCRIPTOR_T *d, int pos, int n);
+// Read or write len bytes at pos of a file, return the number of bytes
+// done. The caller holds the descriptor lock, shared for file_read(), and
+// a journal handle for file_write(). file_read() returns ERR_BAD_BLOCK if a
+// block it needs cannot be read intact.
+static int file_read(DESCRIPTOR_T *d, int pos, void *buff, unsigned int len);
+// Whether file d has direct views. Its data blocks then go around the cache,
+// straight between the disk and the callers, so the views see them.
+static inline bool direct_io(const DESCRIPTOR_T *d);
+// cache_get() of data block b of file d, or if d has direct views a copy of
+// the block in the bounce buffer of the thread, read unless CACHE_NOREAD.
+static byte *data_get(DESCRIPTOR_T *d, int b, int flags);
+// cache_put() of a block of data_get(), writing a changed copy back.
+static void data_put(DESCRIPTOR_T *d, int b, bool dirty);
+// FS_msync() of view.
+static int view_sync(VIEW_T *view);
+static int file_write(DESCRIPTOR_T *d, int pos, const void *buff,
+                      unsigned int len);
+// file_write() of a regular file in pieces of one journal handle each, so
+// a large write does not hold a commit up.
+static int journaled_write(DESCRIPTOR_T *d, int pos, const void *buff,
+                           unsigned int len);
+// Allocate the indirect blocks mapping the blocks [first, end) of a file,
+// so the data blocks allocated next are one run after them.
+static void file_map_indirect(DESCRIPTOR_T *d, int first, int end);
+// Zero the bytes past the end of a file in its last block, before the file
+// grows over them.
+static void file_zero_tail(DESCRIPTOR_T *d);
+// Set the size of a regular file to len, freeing the blocks past the new
+// end. The caller holds the descriptor lock and a journal handle.
+static int file_truncate(DESCRIPTOR_T *d, int len);
+// file_read() and file_write() of a compressed file, a cluster at a time.
+static int compressed_read(DESCRIPTOR_T *d, int pos, void *buff,
+                           unsigned int len);
+static int compressed_write(DESCRIPTOR_T *d, int pos, const void *buff,
+                            unsigned int len);
+// The data of cluster c of a compressed file, in the buffer of the thread,
+// or NULL if it cannot be read.
+static byte *cluster_get(DESCRIPTOR_T *d, int c);
+// Read cluster c of a compressed file into data, return 0 or -1.
+static int cluster_load(DESCRIPTOR_T *d, int c, byte *data);
+// Write data as cluster c of a file, compressed if pack and smaller so,
+// to new blocks, and free the old ones. Return 0 or ERR_DISK_IS_FULL.
+static int cluster_store(DESCRIPTOR_T *d, int c, const byte *data, bool pack);
+// Get or, with alloc, set the pointers of the cluster from block first;
+// unmapped ones are -1. Return -1 if an indirect block is missing.
+static int cluster_slots(DESCRIPTOR_T *d, int first, int *slots, int alloc);
+// Map the blocks [first, first + n) of a file, n <= MAP_BATCH, allocating
+// the missing ones and writing zeros from zeros to them. Return how many
+// are mapped.
+static int file_allocate(DESCRIPTOR_T *d, int first, int n,
+                         const byte *zeros);
+// Physical block of the n-th block of a file, or -1 if not mapped, BMAP_BAD
+// if an indirect block on the way fails its checksum. With alloc, unmapped
+// blocks (and indirect blocks on the way) are allocated; alloc may add
+// BMAP_UNSHARE and BMAP_NOCOPY to map a block for writing.
+static int bmap(DESCRIPTOR_T *d, int n, int alloc);
+// Map up to count blocks of a file from the n-th one in a single walk of the
+// block map, stopping at the end of an indirect block or at an unmapped
+// block. Store the physical blocks in blocks and return how many; a lookup
+// stopped by an indirect block failing its checksum stores BMAP_BAD.
+static int bmap_range(DESCRIPTOR_T *d, int n, int count, int *blocks,
+                      int alloc);
+// Copy n whole blocks between buff and the blocks of a file from the first
+// one without staging them in the cache. Return the number of bytes done,
+// or for a read ERR_BAD_BLOCK.
+static int read_whole_blocks(DESCRIPTOR_T *d, int first, int n, void *buff);
+static int write_whole_blocks(DESCRIPTOR_T *d, int first, int n,
+                              const void *buff);
+// Get one free block filled with -1, to be used as an indirect block of the
+// file with descriptor owner.
+static int get_free_indirect_block(int owner);
+// Free a block of the given indirect level (0 for data) and its subtree.
+static void free_block_tree(int b, int level);
+// Free the blocks of the tree at *root of the given level whose indexes
+// among the data blocks of the tree are keep or more.
+static void free_tree_tail(int *root, int level, long long keep, int owner);
+// Free the data blocks of ptrs[0, n), each run of contiguous ones at once.
+static void free_blocks(const int *ptrs, int n);
+// The reference count of block b.
+static inline byte *refcount(int b);
+// Whether data block b is shared by several files.
+static inline bool block_shared(int b) {
+    return __atomic_load_n(refcount(b), __ATOMIC_RELAXED) > 0;
+}
+// Add a pointer to data block b; false if it has MAX_REFS more already.
+static bool block_ref(int b);
+// Drop a pointer to data block b if it is shared and return true, or
+// return false if the caller holds the only one and is to free b. A block
+// only the dedup index points to afterwards is freed here.
+static bool block_unref(int b);
+// Copy data block b to a new block of the file with descriptor owner, return
+// it or -1.
+static int block_copy(int b, int owner);
+// Give the file with descriptor owner a block of its own in place of shared
+// block b, copying its data if copy. Return the new block or -1.
+static int block_unshare(int b, bool copy, int owner);
+// Copy the tree of block b of the given level for the file with descriptor
+// owner, sharing the data blocks, and return the copy. Sets *full and
+// leaves the copy short if a block is missing.
+static int clone_tree(int b, int level, int owner, bool *full);
+// 64-bit hash of the n bytes at p, n a multiple of 32. Its eight 32-bit
+// lanes are independent, so the compiler keeps them in vector registers.
+static uint64_t block_hash(const byte *p, int n);
+// The entries of the dedup index block which holds hash.
+static DEDUP_ENTRY_T *dedup_bucket(uint64_t hash);
+// Read the dedup index into DEDUP_INDEXED. The caller holds dedup_lock.
+static void dedup_load();
+// A stored block holding the block of data at data, whose hash is hash,
+// with a reference taken for the caller; -1 if there is none.
+static int dedup_find(const byte *data, uint64_t hash);
+// Add data block b, just written with the data of hash, to the index.
+static void dedup_insert(int b, uint64_t hash);
+// Free block b and drop it from the index if the index holds its only
+// pointer; called when b lost its last pointer but one.
+static void dedup_release(int b);
+// write_whole_blocks() with dedup on: a block stored already is pointed to,
+// the others are written and added to the index.
+static int dedup_write(DESCRIPTOR_T *d, int first, int n, const void *buff);
 // Since all descriptors are buffered, or we should use
 // DESCRIPTOR_T get_descriptor() and void set_descriptor() to
 // access the descriptors at disk.
 static DESCRIPTOR_T *get_descriptor(int d);
+// The in-memory copy of metadata block b, which may not be read yet.
+static inline byte *buffered_block(int b) {
+    FS_T *fs = instance->fs;
+    return fs->D_COPY + (size_t)b * fs->block_size;
+}
+// Read metadata block b into D_COPY.
+static void load(int b);
+// The in-memory copy of metadata block b, read on first use.
+static inline byte *load_block(int b) {
+    FS_T *fs = instance->fs;
+    if (!fs->D_LOADED[b].load(std::memory_order_acquire)) load(b);
+    return buffered_block(b);
+}
+// Load the bitmap blocks of the blocks [first, end).
+static void load_bitmap(int first, int end);
+// First run of n free blocks in [b, end), loading the bitmap as the search
+// goes.
+static int find_free(int b, int end, int n);
+// Add the buffered block holding p to the running transaction.
+static inline void set_dirty(const void *p) {
+    FS_T *fs = instance->fs;
+    journal_dirty_meta(((const byte *)p - fs->D_COPY) >> fs->block_shift);
+}
+// The bitmap as 64-bit words.
+static inline uint64_t *bitmap_words() {
+    return (uint64_t *)buffered_block(SUPER_BLOCK + 1);
+}
+static inline byte *refcount(int b) {
+    FS_T *fs = instance->fs;
+    return load_block(fs->refs_start + (b >> fs->block_shift)) +
+           (b & (fs->block_size - 1));
+}
+static inline bool is_directory(int d) {
+    return get_descriptor(d)->type == FILE_TYPE_DIRECTORY;
+}
+// The data of an inline file.
+static inline byte *inline_data(DESCRIPTOR_T *d) { return (byte *)d->block; }
+// Move the data of inline file d to a block; false if there is no block.
+static bool file_spill(DESCRIPTOR_T *d);
+// Number of the descriptor at d.
+static inline int descriptor_of(const DESCRIPTOR_T *d) {
+    FS_T *fs = instance->fs;
+    return d - (const DESCRIPTOR_T *)buffered_block(fs->desc_start);
+}
 
 // OTHER
 
-// Number of descriptors in each block.
-static const int desc_each_block = BLOCK_SIZE / sizeof(DESCRIPTOR_T);
-// Total number of descriptors.
-static const int descriptors = desc_each_block * DESCRIPTOR_BLOCKS;
+// FS_init(), FS_set_cache_size() and FS_close() must not run concurrently
+// with other calls; every other function may be called from any thread.
+
 static_assert(BLK_STS_FREE == 0 && BLK_STS_OCCUPIED == 1);
-// Two blocks should be reserved, one for bitmap, at least one for file
-// content.
-static_assert(DESCRIPTOR_BLOCKS > 0 && DESCRIPTOR_BLOCKS <= BLOCKS - 2);
-static_assert(descriptors > 0);
+static_assert(DESCRIPTOR_BLOCKS > 0);
+static_assert(sizeof(DESCRIPTOR_T) == 32);
+static_assert(sizeof(SUPERBLOCK_T) <= MIN_BLOCK_SIZE);
 
 //////////////////////////////////////////////////////////////////////////////
 
-int FS_init() {
-    // Since the disk is in RAM now, so we should call FS_init_disk() every time
-    // on fs_init, and if the disk is in actual disk, this should be done only
-    // once
-    FS_init_disk();
+FS_T *fs_new() {
+    static std::atomic<unsigned long long> next_id(1);
+    FS_T *fs = new FS_T();
+    fs->id = next_id++;
+    return fs;
+}
 
-    // Buffer blocks
-    for (int i = 0; i < BUFFER_BLOCKS; ++i) {
-        read_block(i, D_COPY[i]);
-    }
+void fs_delete(FS_T *fs) {
+    delete[] fs->D_COPY;
+    delete[] fs->D_LOADED;
+    delete[] fs->DEDUP_INDEXED;
+    delete[] fs->DIRECT_VIEWS;
+    for (int i = 0; i < fs->ofts / OFTS; ++i) delete[] fs->OFT[i].load();
+    delete[] fs->FREE_DESCRIPTORS;
+    delete fs;
+}
 
-    // Init OFTs
-    for (int i = 0; i < OFTS; ++i) {
-        OFT[i].pos = -1;
-        OFT[i].size = -1;
-        OFT[i].descriptor = -1;
-    }
+INSTANCE_T *FS_new() { return instance_new(); }
 
-    // Open the root directory
-    ROOT = open(NULL);
-    assert(ROOT == 0 && OFT[ROOT].descriptor == 0);
+INSTANCE_T *FS_use(INSTANCE_T *fs) {
+    INSTANCE_T *bound = instance;
+    instance = fs ? fs : &default_instance;
+    return bound;
+}
 
+int FS_delete(INSTANCE_T *fs) {
+    if (!fs || fs == &default_instance) return -1;
+    INSTANCE_T *bound = FS_use(fs);
+    if (fs->fs->D_COPY) FS_close();
+    // The prefetch thread reads the disk until the cache is closed
+    cache_close();
+    disk_close();
+    FS_use(bound);
+    instance_delete(fs);
     return 0;
 }
 
-int FS_close() {
-    // Write back buffered blocks
-    // Although the disk is now in RAM and this is useless
-    for (int i = 0; i < BUFFER_BLOCKS; ++i) {
-        write_block(i, D_COPY[i]);
+int FS_init() {
+    // Use an in-memory disk of the default geometry unless one was opened
+    if (disk_blocks() == 0 && disk_open(NULL, BLOCKS, BLOCK_SIZE, 0) < 0) {
+        return -1;
     }
+    journal_close();
+    if (FS_init_geometry() < 0) return -1;
+
+    // FS_init() formats the disk, FS_mount() uses an existing file system
+    if (FS_init_disk() < 0) return -1;
+
+    return FS_start();
+}
+
+int FS_mount() {
+    if (disk_blocks() == 0) return -1;
+    journal_close();
+    if (FS_init_geometry() < 0 || read_superblock() < 0) return -1;
+
+    // Replay the journal and repair what the crash left behind
+    SUPERBLOCK_T *super = (SUPERBLOCK_T *)buffered_block(SUPER_BLOCK);
+    if (!super->clean && FS_fsck(1, 0, NULL) < 0) return -1;
+    return FS_start();
+}
+
+int FS_close() {
+    FS_T *fs = instance->fs;
+    // Commit and checkpoint, the log is empty afterwards
+    journal_close();
+    cache_flush();
+    set_clean(!fs->damaged);
+    return 0;
+}
+
+int FS_sync() {
+    journal_commit();
+    journal_checkpoint();
+    cache_flush();
+    disk_sync();
     return 0;
 }
 
+int FS_fsync(int fh) {
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+
+    // The file's data first, then the commit of the metadata pointing to it
+    cache_flush_owner(f->descriptor);
+    disk_sync();
+    journal_commit();
+    return 0;
+}
+
+int FS_set_cache_size(int blocks) {
+    FS_T *fs = instance->fs;
+    // free_block_tree() pins a whole path of indirect blocks
+    if (blocks <= INDIRECT_LEVELS) return -1;
+    fs->cache_blocks = blocks;
+    return 0;
+}
+
+int FS_fsck(int repair, int threads, FS_FSCK_T *report) {
+    FS_T *fs = instance->fs;
+    if (disk_blocks() == 0) return -1;
+    journal_close();
+    cache_flush();
+    if (FS_init_geometry() < 0 || read_superblock() < 0) return -1;
+
+    FSCK_T c;
+    memset(&c.found, 0, sizeof(c.found));
+    c.damaged = 0;
+    c.found.unclean = !((SUPERBLOCK_T *)buffered_block(SUPER_BLOCK))->clean;
+    // Bring the home blocks up to the last commit; a broken journal is lost
+    if (c.found.unclean && repair &&
+        journal_replay(fs->buffer_blocks, fs->journal_blocks) < 0 &&
+        journal_format(fs->buffer_blocks, fs->journal_blocks) < 0) {
+        return -1;
+    }
+
+#if (THREAD_SAFE)
+    if (threads <= 0) threads = std::thread::hardware_concurrency();
+#endif
+    c.threads = threads > 0 ? threads : 1;
+    const int block_words =
+        fs->bitmap_blocks * fs->block_size / sizeof(uint64_t);
+    const int desc_words = (fs->descriptors + 63) / 64;
+    c.used = new uint64_t[block_words]();
+    c.shared = new uint64_t[block_words]();
+    c.in_use = new uint64_t[desc_words]();
+    c.dirs = new uint64_t[desc_words]();
+    c.named = new uint64_t[desc_words]();
+    c.refs = new byte[(size_t)fs->refcount_blocks * fs->block_size];
+    c.pointers = new uint16_t[fs->total_blocks]();
+    for (int i = 0; i < fs->refcount_blocks; ++i) {
+        byte *refs = c.refs + (size_t)i * fs->block_size;
+        if (fsck_read(&c, fs->refs_start + i, refs) < 0) {
+            memset(refs, 0, fs->block_size);
+        }
+    }
+
+    // Blocks outside the data area are never free
+    bitmap_set_range(c.used, 0, fs->first_data_block);
+    bitmap_set_range(c.used, fs->total_blocks,
+                     block_words * 64 - fs->total_blocks);
+    fsck_run(&c, fsck_files);
+    fsck_tree(&c);
+    fsck_index(&c, 0, &c.found);
+
+    FS_FSCK_T *found = &c.found;
+    for (int i = 0; i < desc_words; ++i) {
+        found->orphaned_files +=
+            __builtin_popcountll(c.in_use[i] & ~c.named[i]);
+    }
+    // No entry names the directory itself
+    if (bitmap_test(c.in_use, 0)) --found->orphaned_files;
+    fsck_bitmap(&c, 0, found);
+    fsck_refcounts(&c, 0, found);
+    // Nothing repairs a block which does not match its checksum
+    found->bad_checksums = disk_check(0, disk_blocks());
+    found->bad_metadata = c.damaged;
+
+    long long problems = found->double_allocated + found->bad_pointers +
+                         found->orphaned_blocks + found->unmarked_blocks +
+                         found->bad_entries + found->orphaned_files +
+                         found->bad_refcounts;
+    // What a damaged block points to may be wrong and a repair would free
+    // blocks files use: the disk stays as it is, and unclean
+    const bool damaged = found->bad_metadata > 0;
+    if (repair && problems > 0 && !damaged) {
+        fsck_repair(&c);
+
+        // Rebuild the bitmap from what is left, the report stays the one of
+        // the check
+        FS_FSCK_T check = c.found, rebuilt;
+        memset(&rebuilt, 0, sizeof(rebuilt));
+        memset(c.used, 0, block_words * sizeof(uint64_t));
+        memset(c.shared, 0, block_words * sizeof(uint64_t));
+        memset(c.in_use, 0, desc_words * sizeof(uint64_t));
+        memset(c.dirs, 0, desc_words * sizeof(uint64_t));
+        memset(c.pointers, 0, fs->total_blocks * sizeof(uint16_t));
+        bitmap_set_range(c.used, 0, fs->first_data_block);
+        bitmap_set_range(c.used, fs->total_blocks,
+                         block_words * 64 - fs->total_blocks);
+        fsck_run(&c, fsck_files);
+        fsck_index(&c, 1, &rebuilt);
+        fsck_bitmap(&c, 1, &rebuilt);
+        fsck_refcounts(&c, 1, &rebuilt);
+        c.found = check;
+        found->repaired = 1;
+    }
+    if (repair && !damaged) set_clean(1);
+
+    delete[] c.used;
+    delete[] c.shared;
+    delete[] c.in_use;
+    delete[] c.dirs;
+    delete[] c.named;
+    delete[] c.refs;
+    delete[] c.pointers;
+    if (report) *report = *found;
+    problems += found->bad_checksums;
+    return problems < INT_MAX ? (int)problems : INT_MAX;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
 int create(const char *path) {
-    if (strlen(path) >= MAX_FILE_NAME_LEN) {
-        return ERR_PATH_TOO_LONG;
-    }
+    FS_T *fs = instance->fs;
+    STAT_TIMER_T timer(STAT_CREATE);
+    // Until it outgrows the descriptor
+    return make_file(path, FILE_TYPE_REGULAR | FILE_INLINE |
+                               (fs->compress_new ? FILE_COMPRESSED : 0));
+}
 
-    int free_entry = -1;
+int destroy(const char *path) {
+    FS_T *fs = instance->fs;
+    STAT_TIMER_T timer(STAT_DESTROY);
+    char name[MAX_FILE_NAME_LEN];
+    int parent, slot;
+    WRITE_LOCK_T dir(fs->dir_lock);
+    int err = resolve(path, &parent, name);
+    if (err < 0) return err;
+    if (name[0] == '\0') return ERR_IS_A_DIRECTORY;
+    int descriptor = dir_lookup(parent, name, &slot);
+    if (descriptor < 0) return ERR_FILE_DOES_NOT_EXIST;
+    if (is_directory(descriptor)) return ERR_IS_A_DIRECTORY;
+
+    return remove_file(parent, name, slot, descriptor);
+}
 
-    seek(ROOT, 0);
-    DIRECTORY_ENTRY_T de;
-    while (!eof(ROOT)) {
-        if (read(ROOT, &de, sizeof(de)) > 0) {
-            if (de.file_name[0] == '\0') {
-                if (free_entry == -1) {
-                    free_entry = tell(ROOT - sizeof(DIRECTORY_ENTRY_T));
-                }
-            } else if (strncmp(de.file_name, path, MAX_FILE_NAME_LEN) == 0) {
-                return ERR_FILE_ALREADY_EXISTS;
-            }
-        }
+int mkdir(const char *path) { return make_file(path, FILE_TYPE_DIRECTORY); }
+
+int rmdir(const char *path) {
+    FS_T *fs = instance->fs;
+    char name[MAX_FILE_NAME_LEN];
+    int parent, slot;
+    WRITE_LOCK_T dir(fs->dir_lock);
+    int err = resolve(path, &parent, name);
+    if (err < 0) return err;
+    if (name[0] == '\0') return ERR_ROOT_DIRECTORY;
+    int descriptor = dir_lookup(parent, name, &slot);
+    if (descriptor < 0) return ERR_FILE_DOES_NOT_EXIST;
+    if (!is_directory(descriptor)) return ERR_NOT_A_DIRECTORY;
+    if (!dir_empty(descriptor)) return ERR_DIRECTORY_NOT_EMPTY;
+
+    remove_file(parent, name, slot, descriptor);
+    dcache_drop_dir(descriptor);
+    fs->dir_hint.erase(descriptor);
+    return 0;
+}
+
+int FS_clone(const char *src, const char *dst) {
+    FS_T *fs = instance->fs;
+    char name[MAX_FILE_NAME_LEN];
+    int parent;
+    WRITE_LOCK_T dir(fs->dir_lock);
+    int err = resolve(src, &parent, name);
+    if (err < 0) return err;
+    if (name[0] == '\0') return ERR_IS_A_DIRECTORY;
+    int source = dir_lookup(parent, name, NULL);
+    if (source < 0) return ERR_FILE_DOES_NOT_EXIST;
+    if (is_directory(source)) return ERR_IS_A_DIRECTORY;
+    err = resolve(dst, &parent, name);
+    if (err < 0) return err;
+    if (name[0] == '\0' || dir_lookup(parent, name, NULL) >= 0) {
+        return ERR_FILE_ALREADY_EXISTS;
     }
 
     int descriptor = get_free_descriptor();
     if (descriptor < 0) return ERR_TOO_MANY_FILES;
 
-    DESCRIPTOR_T *d = get_descriptor(descriptor);
-    d->file_size = 0;
-
-    if (free_entry == -1) {
-        free_entry = tell(ROOT);
+    // The entry, the descriptor and the reference counts are committed
+    // together
+    WRITE_LOCK_T locks[3];
+    lock_three(parent, descriptor, source, locks);
+    if (fs->DIRECT_VIEWS[source] > 0) {
+        put_free_descriptor(descriptor);
+        return ERR_FILE_MAPPED;
     }
-
-    if (free_entry != -1) {
-        seek(ROOT, free_entry);
-        de.descriptor = descriptor;
-        strncpy(de.file_name, path, MAX_FILE_NAME_LEN);
-        write(ROOT, &de, sizeof(de));
-        return 0;
+    JOURNAL_HANDLE_T handle;
+    int slot = dir_add(parent, get_descriptor(parent), name, descriptor);
+    if (slot < 0) {
+        put_free_descriptor(descriptor);
+        return ERR_NO_FREE_DIR_ENTRY;
     }
-    return ERR_NO_FREE_DIR_ENTRY;
-}
 
-int destroy(const char *path) {
-    seek(ROOT, 0);
-
-    DIRECTORY_ENTRY_T de;
-    while (!eof(ROOT)) {
-        if (read(ROOT, &de, sizeof(de)) > 0) {
-            if (strncmp(de.file_name, path, MAX_FILE_NAME_LEN) == 0) {
-                DESCRIPTOR_T *d = get_descriptor(de.descriptor);
-                d->file_size = -1;
-                for (int i = 0; i < DESCRIPTOR_MAX_BLOCKS; ++i) {
-                    if (d->block[i] > 0) {
-                        set_block_status(d->block[i], BLK_STS_FREE);
-                        d->block[i] = -1;
-                    } else {
-                        break;
-                    }
-                }
-                de.file_name[0] = '\0';
-                seek(ROOT, tell(ROOT) - sizeof(DIRECTORY_ENTRY_T));
-                write(ROOT, &de, sizeof(de));
-                return 0;
-            }
+    const DESCRIPTOR_T *from = get_descriptor(source);
+    DESCRIPTOR_T *d = get_descriptor(descriptor);
+    *d = *from;
+    if (!(from->type & FILE_INLINE)) {
+        // The data blocks are shared, the indirect blocks copied
+        bool full = false;
+        for (int i = 0; i < DESCRIPTOR_MAX_BLOCKS; ++i) {
+            d->block[i] = clone_tree(from->block[i], 0, descriptor, &full);
+        }
+        for (int i = 0; i < INDIRECT_LEVELS; ++i) {
+            d->indirect[i] =
+                clone_tree(from->indirect[i], i + 1, descriptor, &full);
+        }
+        if (full) {
+            free_file(d);
+            dir_remove(parent, get_descriptor(parent), slot);
+            put_free_descriptor(descriptor);
+            return ERR_DISK_IS_FULL;
         }
     }
-    return ERR_FILE_DOES_NOT_EXIST;
+    set_dirty(d);
+    dcache_insert(parent, name, descriptor, slot);
+    return 0;
 }
 
 int open(const char *path) {
-    if (path && strlen(path) >= MAX_FILE_NAME_LEN) {
-        return ERR_PATH_TOO_LONG;
-    }
-
-    int descriptor = -1;
+    FS_T *fs = instance->fs;
+    STAT_TIMER_T timer(STAT_OPEN);
+    int descriptor = 0;  // open(NULL) is the root directory
     if (path != NULL) {
-        // Find file
-        seek(ROOT, 0);
-        DIRECTORY_ENTRY_T de;
-        while (!eof(ROOT)) {
-            if (read(ROOT, &de, sizeof(de)) > 0) {
-                if (strncmp(de.file_name, path, MAX_FILE_NAME_LEN) == 0) {
-                    descriptor = de.descriptor;
-                    break;
-                }
-            }
-        }
-        if (descriptor == -1) {
-            return ERR_FILE_DOES_NOT_EXIST;
-        }
-    } else {
-        descriptor = 0;  // the root dir descriptor
+        char name[MAX_FILE_NAME_LEN];
+        int parent;
+        READ_LOCK_T dir(fs->dir_lock);
+        int err = resolve(path, &parent, name);
+        if (err < 0) return err;
+        if (name[0] == '\0') return ERR_IS_A_DIRECTORY;
+        descriptor = dir_lookup(parent, name, NULL);
+        if (descriptor < 0) return ERR_FILE_DOES_NOT_EXIST;
+        if (is_directory(descriptor)) return ERR_IS_A_DIRECTORY;
     }
 
-    int fh = get_free_oft();
-    if (fh < 0) {
+    int i = get_free_oft();
+    if (i < 0) {
         return ERR_TOO_MANY_FILES_OPENED;
     }
-    DESCRIPTOR_T *d = get_descriptor(descriptor);
-    OFT[fh].pos = 0;
-    OFT[fh].size = d->file_size;
-    OFT[fh].descriptor = descriptor;
-    if (d->block[0] != -1) {
-        // Buffer the first block
-        read_block(d->block[0], OFT[fh].buffer);
-    }
-    return fh;
+    OFT_T *f = get_oft(i);
+    LOCK_T lock(f->lock);
+    f->pos = 0;
+    f->descriptor = descriptor;
+    f->ra_next = f->ra_end = f->ra_window = 0;
+    return f->generation << FH_INDEX_BITS | i;
 }
 
 int close(int fh) {
-    DESCRIPTOR_T *d = get_descriptor(OFT[fh].descriptor);
-
-    // Write buffer to disk
-    if (!eof(fh)) {
-        int buffered_block = OFT[fh].pos / BLOCK_SIZE;
-        write_block(d->block[buffered_block], OFT[fh].buffer);
+    STAT_TIMER_T timer(STAT_CLOSE);
+    {
+        UNIQUE_LOCK_T lock;
+        OFT_T *f = lock_oft(fh, lock);
+        if (!f) return ERR_FILE_NOT_OPENED;
+
+        // Mark OFT entry as free
+        f->pos = -1;
+        f->descriptor = -1;
+        f->generation = (f->generation + 1) % FH_GENERATIONS;
     }
+    put_free_oft(FH_INDEX(fh));
+
+    return 0;
+}
+
+int read(int fh, void *buff, unsigned int len) {
+    STAT_TIMER_T timer(STAT_READ);
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+
+    READ_LOCK_T d_lock(desc_lock(f->descriptor));
+    DESCRIPTOR_T *d = get_descriptor(f->descriptor);
+    int n_read = file_read(d, f->pos, buff, len);
+    if (n_read < 0) return n_read;
+    readahead(f, d, f->pos, n_read);
+    f->pos += n_read;
+    timer.bytes = n_read;
+    return n_read;
+}
+
+int write(int fh, const void *buff, unsigned int len) {
+    STAT_TIMER_T timer(STAT_WRITE);
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+
+    WRITE_LOCK_T d_lock(desc_lock(f->descriptor));
+    int n_write =
+        journaled_write(get_descriptor(f->descriptor), f->pos, buff, len);
+    if (n_write > 0) f->pos += n_write;
+    timer.bytes = n_write;
+    return n_write;
+}
 
-    // Update file size in descriptor
-    d->file_size = OFT[fh].size;
+int FS_readv(int fh, const FS_IOVEC_T *iov, int iovcnt) {
+    STAT_TIMER_T timer(STAT_READ);
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+
+    READ_LOCK_T d_lock(desc_lock(f->descriptor));
+    DESCRIPTOR_T *d = get_descriptor(f->descriptor);
+    int n_read = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        int n = file_read(d, f->pos, iov[i].base, iov[i].len);
+        if (n < 0) return n_read ? n_read : n;
+        readahead(f, d, f->pos, n);
+        f->pos += n;
+        n_read += n;
+        if ((unsigned int)n < iov[i].len) break;
+    }
+    timer.bytes = n_read;
+    return n_read;
+}
 
-    // Mark OFT entry as free 
-    OFT[fh].pos = -1;
-    OFT[fh].size = -1;
-    OFT[fh].descriptor = -1;
+int FS_writev(int fh, const FS_IOVEC_T *iov, int iovcnt) {
+    STAT_TIMER_T timer(STAT_WRITE);
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+
+    WRITE_LOCK_T d_lock(desc_lock(f->descriptor));
+    DESCRIPTOR_T *d = get_descriptor(f->descriptor);
+    int n_write = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        int n = journaled_write(d, f->pos, iov[i].base, iov[i].len);
+        if (n < 0) return n_write ? n_write : n;
+        f->pos += n;
+        n_write += n;
+        if ((unsigned int)n < iov[i].len) break;
+    }
+    timer.bytes = n_write;
+    return n_write;
+}
 
+int seek(int fh, int pos) {
+    FS_T *fs = instance->fs;
+    STAT_TIMER_T timer(STAT_SEEK);
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+
+    // Past the end of the file too, a write there leaves a hole
+    if (pos < 0 || pos > fs->max_file_size) return ERR_SEEK_OUT_OF_RANGE;
+    f->pos = pos;
     return 0;
 }
 
-int read(int fh, void *buff, unsigned int len) {
-    unsigned int remain = OFT[fh].size - OFT[fh].pos;
-    if (remain < len) {
-        len = remain;
+int tell(int fh) {
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+    return f->pos;
+}
+
+int eof(int fh) {
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+
+    READ_LOCK_T d_lock(desc_lock(f->descriptor));
+    return f->pos >= get_descriptor(f->descriptor)->file_size;
+}
+
+int truncate(int fh, int len) {
+    FS_T *fs = instance->fs;
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+    if (len < 0 || len > fs->max_file_size) return ERR_SEEK_OUT_OF_RANGE;
+
+    WRITE_LOCK_T d_lock(desc_lock(f->descriptor));
+    DESCRIPTOR_T *d = get_descriptor(f->descriptor);
+    if (len < d->file_size && fs->DIRECT_VIEWS[f->descriptor] > 0) {
+        return ERR_FILE_MAPPED;
+    }
+    JOURNAL_HANDLE_T handle;
+    return file_truncate(d, len);
+}
+
+int fallocate(int fh, int pos, int len) {
+    FS_T *fs = instance->fs;
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+    if (pos < 0 || len < 0 || len > fs->max_file_size - pos) {
+        return ERR_SEEK_OUT_OF_RANGE;
     }
 
-    DESCRIPTOR_T *d = get_descriptor(OFT[fh].descriptor);
+    if (len == 0) return 0;
 
-    unsigned int n_read = 0, n;
-    while (len > 0) {
-        unsigned int begin = OFT[fh].pos % BLOCK_SIZE;
-        n = BLOCK_SIZE - begin;
-        if (len < n) n = len;
+    WRITE_LOCK_T d_lock(desc_lock(f->descriptor));
+    DESCRIPTOR_T *d = get_descriptor(f->descriptor);
+    // A compressed cluster is written to new blocks anyway
+    if (d->type & FILE_COMPRESSED) return 0;
+    if (d->type & FILE_INLINE) {
+        if (pos + len <= INLINE_BYTES) return 0;
+        JOURNAL_HANDLE_T handle;
+        if (!file_spill(d)) return ERR_DISK_IS_FULL;
+    }
 
-#if (DEBUG)
-        printf("fh:%d begin:%u n:%u\n", fh, begin, n);
-#endif
-        memcpy(buff, OFT[fh].buffer + begin, n);
+    // Reserve the missing blocks as one run, they are mapped in pieces of
+    // one journal handle each
+    int first = pos >> fs->block_shift;
+    const int end =
+        (int)(((long long)pos + len + fs->block_size - 1) >> fs->block_shift);
+    int missing = 0, blocks[MAP_BATCH];
+    for (int n = first; n < end;) {
+        int k = bmap_range(d, n, std::min(end - n, MAP_BATCH), blocks, 0);
+        if (k == 0) ++missing;
+        n += k > 0 ? k : 1;
+    }
+    if (missing > 1) {
+        JOURNAL_HANDLE_T handle;
+        reserved_next = alloc_run(missing);
+        if (reserved_next >= 0) {
+            reserved_end = reserved_next + missing;
+        } else {
+            reserved_next = 0;
+        }
+    }
 
-        OFT[fh].pos += n;
-        if (OFT[fh].pos % BLOCK_SIZE == 0) {
-            unsigned int new_buffer = OFT[fh].pos / BLOCK_SIZE;
-            assert(new_buffer > 0);
-            // copy buffer into appropriate block on disk
-            write_block(d->block[new_buffer - 1], OFT[fh].buffer);
-            // copy block from disk to buffer
-            if (!eof(fh)) read_block(d->block[new_buffer], OFT[fh].buffer);
+    byte *zeros = new byte[(size_t)MAP_BATCH * fs->block_size]();
+    int err = 0;
+    while (first < end) {
+        int n;
+        {
+            JOURNAL_HANDLE_T handle;
+            n = file_allocate(d, first, std::min(end - first, MAP_BATCH),
+                              zeros);
+        }
+        first += n;
+        // Blocks freed by transactions not on disk yet are free once the
+        // transactions are, so commit and try again
+        if (n == 0 &&
+            (journal_pending_frees() == 0 || journal_commit() != 0)) {
+            err = ERR_DISK_IS_FULL;
+            break;
         }
+    }
+    delete[] zeros;
 
-        n_read += n;
-        buff = (char *)buff + n;
-        len -= n;
+    if (reserved_next < reserved_end) {
+        JOURNAL_HANDLE_T handle;
+        free_run(reserved_next, reserved_end - reserved_next);
     }
+    reserved_next = reserved_end = 0;
+    return err;
+}
 
-    return n_read;
+int FS_set_compression(int on) {
+    FS_T *fs = instance->fs;
+    fs->compress_new = on != 0;
+    return 0;
 }
 
-int write(int fh, const void *buff, unsigned int len) {
-    DESCRIPTOR_T *d = get_descriptor(OFT[fh].descriptor);
+int FS_compress(int fh, int on) {
+    FS_T *fs = instance->fs;
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f) return ERR_FILE_NOT_OPENED;
+
+    WRITE_LOCK_T d_lock(desc_lock(f->descriptor));
+    DESCRIPTOR_T *d = get_descriptor(f->descriptor);
+    if (d->type == FILE_TYPE_DIRECTORY) return ERR_IS_A_DIRECTORY;
+    if (!on == !(d->type & FILE_COMPRESSED)) return 0;
+    if (fs->DIRECT_VIEWS[f->descriptor] > 0) return ERR_FILE_MAPPED;
+    if (on) {
+        // The clusters stay as they are, with zeros past the end
+        JOURNAL_HANDLE_T handle;
+        file_zero_tail(d);
+        d->type |= FILE_COMPRESSED;
+        set_dirty(d);
+        return 0;
+    }
 
-    if (d->block[0] < 0) {
-        d->block[0] = get_free_block();
-        if (d->block[0] < 0) {
-            return ERR_DISK_IS_FULL;  // DISK IS FULL
+    // Store the compressed clusters as they are, a journal handle each
+    const long long cluster_bytes = CLUSTER_BLOCKS * fs->block_size;
+    const int clusters = (d->file_size + cluster_bytes - 1) / cluster_bytes;
+    for (int c = 0; c < clusters && !(d->type & FILE_INLINE); ++c) {
+        JOURNAL_HANDLE_T handle;
+        int slots[CLUSTER_BLOCKS];
+        cluster_slots(d, c * CLUSTER_BLOCKS, slots, 0);
+        if (packed_length(slots[CLUSTER_BLOCKS - 1]) == 0) continue;
+        byte *cluster = cluster_get(d, c);
+        if (!cluster || cluster_store(d, c, cluster, false) < 0) {
+            return ERR_DISK_IS_FULL;
         }
     }
+    JOURNAL_HANDLE_T handle;
+    d->type &= ~FILE_COMPRESSED;
+    set_dirty(d);
+    fs->cluster_gen.fetch_add(1, std::memory_order_release);
+    return 0;
+}
 
-    unsigned int n_write = 0, n;
-    while (len > 0) {
-        unsigned int begin = OFT[fh].pos % BLOCK_SIZE;
-        n = BLOCK_SIZE - begin;
-        if (len < n) n = len;
+int FS_set_dedup(int on) {
+    FS_T *fs = instance->fs;
+    fs->dedup_on = on != 0;
+    return 0;
+}
 
-#if (DEBUG)
-        printf("fh:%d begin:%u n:%u\n", fh, begin, n);
-#endif
-        memcpy(OFT[fh].buffer + begin, buff, n);
-
-        OFT[fh].pos += n;
-        if (OFT[fh].size < OFT[fh].pos) {
-            OFT[fh].size = OFT[fh].pos;
-            d->file_size = OFT[fh].pos;
-        }
-        if (OFT[fh].pos % BLOCK_SIZE == 0) {
-            unsigned int new_buffer = OFT[fh].pos / BLOCK_SIZE;
-            assert(new_buffer > 0);
-            // copy buffer into appropriate block on disk
-            write_block(d->block[new_buffer - 1], OFT[fh].buffer);
-            if (new_buffer < DESCRIPTOR_MAX_BLOCKS) {
-                if (d->block[new_buffer] < 0) {
-                    d->block[new_buffer] = get_free_block();
-                    if (d->block[new_buffer] < 0) {
-                        break;  // DISK IS FULL
-                    }
-                } else {
-                    // copy block from disk to buffer
-                    read_block(d->block[new_buffer], OFT[fh].buffer);
-                }
-            } else {
-                break;  // MAX_FILE_SIZE reached
-            }
-        }
+int FS_dedup_stats(FS_DEDUP_T *stats) {
+    FS_T *fs = instance->fs;
+    LOCK_T lock(fs->dedup_lock);
+    dedup_load();
+    stats->blocks_written = fs->dedup_written;
+    stats->blocks_reused = fs->dedup_reused;
+    stats->indexed = fs->dedup_entries;
+    const long long stored = stats->blocks_written - stats->blocks_reused;
+    stats->ratio = stored > 0 ? (double)stats->blocks_written / stored : 1;
+    return 0;
+}
 
-        n_write += n;
-        buff = (char *)buff + n;
-        len -= n;
+void *FS_mmap(int fh, int off, int len) {
+    FS_T *fs = instance->fs;
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(fh, lock);
+    if (!f || off < 0 || len <= 0) return NULL;
+
+    WRITE_LOCK_T d_lock(desc_lock(f->descriptor));
+    DESCRIPTOR_T *d = get_descriptor(f->descriptor);
+    if (d->type == FILE_TYPE_DIRECTORY || len > d->file_size - off) {
+        return NULL;
+    }
+    VIEW_T view;
+    view.fh = fh;
+    view.descriptor = f->descriptor;
+    view.off = off;
+    view.len = len;
+    view.first = off >> fs->block_shift;
+    view.blocks = ((off + len - 1) >> fs->block_shift) + 1 - view.first;
+    view.block = -1;
+
+    // A direct view needs the blocks of the file alone, one run on the disk
+    int blocks[MAP_BATCH], mapped = 0;
+    bool direct = !(d->type & (FILE_INLINE | FILE_COMPRESSED));
+    while (direct && mapped < view.blocks) {
+        int k = std::min(view.blocks - mapped, MAP_BATCH);
+        k = bmap_range(d, view.first + mapped, k, blocks, 0);
+        if (mapped == 0 && k > 0) view.block = blocks[0];
+        for (int i = 0; i < k && direct; ++i) {
+            direct = blocks[i] == view.block + mapped + i &&
+                     !block_shared(blocks[i]);
+        }
+        direct &= k > 0;
+        mapped += k;
     }
 
-    return n_write;
+    byte *addr;
+    if (direct) {
+        // Write the cached blocks back and drop them, the view is the data.
+        // Only these: the file's indirect blocks belong to the journal
+        for (int i = 0; i < view.blocks; ++i) cache_evict(view.block + i);
+        ++fs->DIRECT_VIEWS[view.descriptor];
+        addr = disk_map(view.block, view.blocks) +
+               (off & (fs->block_size - 1));
+    } else {
+        view.block = -1;
+        view.data.resize((size_t)view.blocks * fs->block_size);
+        if (file_read(d, view.first * fs->block_size, view.data.data(),
+                      view.data.size()) < 0) {
+            return NULL;
+        }
+        view.hashes.resize(view.blocks);
+        for (int i = 0; i < view.blocks; ++i) {
+            view.hashes[i] = block_hash(
+                view.data.data() + (size_t)i * fs->block_size, fs->block_size);
+        }
+        addr = view.data.data() + (off & (fs->block_size - 1));
+    }
+    LOCK_T v_lock(fs->view_lock);
+    fs->views.emplace(addr, std::move(view));
+    return addr;
 }
 
-int seek(int fh, int pos) {
-    if (pos < 0 || OFT[fh].size < pos) {
-        return ERR_SEEK_OUT_OF_RANGE;
+int FS_msync(void *addr) {
+    FS_T *fs = instance->fs;
+    VIEW_T *view;
+    {
+        LOCK_T v_lock(fs->view_lock);
+        auto it = fs->views.find(addr);
+        if (it == fs->views.end()) return -1;
+        view = &it->second;
     }
-    int old_buffer = OFT[fh].pos / BLOCK_SIZE;
-    int new_buffer = pos / BLOCK_SIZE;
-    if (old_buffer != new_buffer) {
-        DESCRIPTOR_T *d = get_descriptor(OFT[fh].descriptor);
-        // copy buffer into appropriate block on disk
-        if (!eof(fh)) write_block(d->block[old_buffer], OFT[fh].buffer);
-        // copy block from disk to buffer
-        read_block(d->block[new_buffer], OFT[fh].buffer);
-    }
-    // set current position to pos
-    OFT[fh].pos = pos;
-    return 0;
+    return view_sync(view);
 }
 
-int tell(int fh) { return OFT[fh].pos; }
+int FS_munmap(void *addr) {
+    FS_T *fs = instance->fs;
+    VIEW_T view;
+    {
+        LOCK_T v_lock(fs->view_lock);
+        auto it = fs->views.find(addr);
+        if (it == fs->views.end()) return -1;
+        view = std::move(it->second);
+        fs->views.erase(it);
+    }
+    int err = view_sync(&view);
+    if (view.block >= 0) {
+        WRITE_LOCK_T d_lock(desc_lock(view.descriptor));
+        --fs->DIRECT_VIEWS[view.descriptor];
+        disk_unmap(view.block, view.blocks);
+    }
+    return err;
+}
 
-int eof(int fh) { return OFT[fh].pos == OFT[fh].size; }
+int directory() { return FS_directory("/"); }
 
-int directory() {
+int FS_directory(const char *path) {
+    FS_T *fs = instance->fs;
     int count = 0;
 
-    seek(ROOT, 0);
-    DIRECTORY_ENTRY_T de;
-    while (!eof(ROOT)) {
-        if (read(ROOT, &de, sizeof(de)) > 0) {
-            if (de.file_name[0] != '\0') {
-                DESCRIPTOR_T *d = get_descriptor(de.descriptor);
-                if (count) {
-                    printf(" %s %u", de.file_name, d->file_size);
-                } else {
-                    printf("%s %u", de.file_name, d->file_size);
-                }
-                ++count;
+    char name[MAX_FILE_NAME_LEN];
+    int parent;
+    READ_LOCK_T dir(fs->dir_lock);
+    int err = resolve(path, &parent, name);
+    if (err < 0) return err;
+    int descriptor = name[0] ? dir_lookup(parent, name, NULL) : 0;
+    if (descriptor < 0) return ERR_FILE_DOES_NOT_EXIST;
+    if (!is_directory(descriptor)) return ERR_NOT_A_DIRECTORY;
+
+    DESCRIPTOR_T *d = get_descriptor(descriptor);
+    std::vector<byte> buff(fs->block_size);
+    const DIRECTORY_ENTRY_T *de =
+        (const DIRECTORY_ENTRY_T *)(buff.data() + sizeof(DIR_BLOCK_T));
+    for (int pos = 0; pos < d->file_size; pos += fs->block_size) {
+        int n;
+        {
+            READ_LOCK_T lock(desc_lock(descriptor));
+            n = file_read(d, pos, buff.data(), fs->block_size);
+        }
+        if (n < fs->block_size) break;
+        for (int i = 0; i < dir_block_entries(buff.data()); ++i) {
+            if (de[i].descriptor < 0 || !dir_name_ok(buff.data(), &de[i])) {
+                continue;
             }
+            int size;
+            const char *slash;
+            {
+                READ_LOCK_T lock(desc_lock(de[i].descriptor));
+                size = get_descriptor(de[i].descriptor)->file_size;
+                slash = is_directory(de[i].descriptor) ? "/" : "";
+            }
+            printf("%s%.*s%s %u", count ? " " : "", de[i].len,
+                   (const char *)buff.data() + de[i].name, slash, size);
+            ++count;
         }
     }
     printf("\n");
@@ -380,119 +1387,2193 @@ int directory() {
 
 //////////////////////////////////////////////////////////////////////////////
 
+static int FS_init_geometry() {
+    FS_T *fs = instance->fs;
+    // Release the buffers of a previous FS_init()
+    delete[] fs->D_COPY;
+    delete[] fs->D_LOADED;
+    fs->D_COPY = NULL;
+    fs->D_LOADED = NULL;
+
+    fs->block_size = disk_block_size();
+    fs->block_shift = __builtin_ctz(fs->block_size);
+    fs->total_blocks = disk_blocks();
+
+    const int bits = fs->block_size * 8;
+    fs->bitmap_blocks = (fs->total_blocks + bits - 1) / bits;
+    fs->refs_start = SUPER_BLOCK + 1 + fs->bitmap_blocks;
+    fs->refcount_blocks =
+        (fs->total_blocks + fs->block_size - 1) / fs->block_size;
+    fs->dedup_start = fs->refs_start + fs->refcount_blocks;
+    fs->dedup_blocks = ((long long)fs->total_blocks / DEDUP_SPAN *
+                        sizeof(DEDUP_ENTRY_T) + fs->block_size - 1) /
+                   fs->block_size;
+    if (fs->dedup_blocks == 0) fs->dedup_blocks = 1;
+    fs->desc_start = fs->dedup_start + fs->dedup_blocks;
+    fs->desc_each_block = fs->block_size / sizeof(DESCRIPTOR_T);
+    fs->descriptor_blocks =
+        (fs->total_blocks / BLOCKS_PER_DESCRIPTOR + fs->desc_each_block - 1) /
+        fs->desc_each_block;
+    if (fs->descriptor_blocks < DESCRIPTOR_BLOCKS) {
+        fs->descriptor_blocks = DESCRIPTOR_BLOCKS;
+    }
+    fs->descriptors = fs->desc_each_block * fs->descriptor_blocks;
+    fs->buffer_blocks = fs->desc_start + fs->descriptor_blocks;
+    // Room for a transaction which changes the whole bitmap and every
+    // reference count
+    const int counts = fs->bitmap_blocks + fs->refcount_blocks;
+    fs->journal_blocks = fs->total_blocks / JOURNAL_FRACTION;
+    if (fs->journal_blocks < 2 * counts + JOURNAL_MIN_BLOCKS) {
+        fs->journal_blocks = 2 * counts + JOURNAL_MIN_BLOCKS;
+    }
+    fs->first_data_block = fs->buffer_blocks + fs->journal_blocks;
+
+    fs->ptrs_each_block = fs->block_size / sizeof(int);
+    fs->ptrs_shift = __builtin_ctz(fs->ptrs_each_block);
+    long long file_blocks = DESCRIPTOR_MAX_BLOCKS, span = 1;
+    for (int i = 0; i < INDIRECT_LEVELS; ++i) {
+        span *= fs->ptrs_each_block;
+        file_blocks += span;
+    }
+    fs->max_file_size = file_blocks * fs->block_size < INT_MAX
+                        ? (int)(file_blocks * fs->block_size)
+                        : INT_MAX;
+
+    // The ROOT's first block and at least one block for file content should
+    // be left.
+    if (fs->first_data_block + 2 > fs->total_blocks) return -1;
+
+    fs->D_COPY = new byte[(size_t)fs->buffer_blocks * fs->block_size];
+    fs->D_LOADED = new std::atomic<bool>[fs->buffer_blocks];
+    for (int i = 0; i < fs->buffer_blocks; ++i) fs->D_LOADED[i] = false;
+    fs->damaged = false;
+    return 0;
+}
+
 static int FS_init_disk() {
-    // Init the bitmap
-    memset(D_COPY[0], 0, sizeof(byte) * BLOCK_SIZE);
-    //  [0]        [1-6]            [7]
-    // bitmap   descriptors    ROOT's first block
-    for (int i = 0; i < (1 + DESCRIPTOR_BLOCKS + 1); ++i) {
+    FS_T *fs = instance->fs;
+    SUPERBLOCK_T *super = (SUPERBLOCK_T *)buffered_block(SUPER_BLOCK);
+    memset(super, 0, fs->block_size);
+    memcpy(super->magic, SUPER_MAGIC, sizeof(super->magic));
+    super->block_size = fs->block_size;
+    super->total_blocks = fs->total_blocks;
+    super->bitmap_blocks = fs->bitmap_blocks;
+    super->refcount_blocks = fs->refcount_blocks;
+    super->dedup_blocks = fs->dedup_blocks;
+    super->descriptor_blocks = fs->descriptor_blocks;
+    super->journal_blocks = fs->journal_blocks;
+    super->clean = 0;
+    write_block(SUPER_BLOCK, (byte *)super);
+    fs->D_LOADED[SUPER_BLOCK] = true;
+
+    // Init the bitmap, the bits past the end of the disk are never free, the
+    // reference counts and the dedup index
+    memset(bitmap_words(), 0,
+           sizeof(byte) * fs->block_size * fs->bitmap_blocks);
+    memset(buffered_block(fs->refs_start), 0,
+           (size_t)fs->block_size * fs->refcount_blocks);
+    memset(buffered_block(fs->dedup_start), -1,
+           (size_t)fs->block_size * fs->dedup_blocks);
+    for (int i = SUPER_BLOCK + 1; i < fs->desc_start; ++i) {
+        fs->D_LOADED[i] = true;
+    }
+    for (int i = 0; i < (fs->first_data_block + 1); ++i) {
+        set_block_status(i, BLK_STS_OCCUPIED);
+    }
+    // The bits past the last block
+    const int bits = fs->bitmap_blocks * fs->block_size * 8;
+    for (int i = fs->total_blocks; i < bits; ++i) {
         set_block_status(i, BLK_STS_OCCUPIED);
     }
-    write_block(0, D_COPY[0]);
+    for (int i = SUPER_BLOCK + 1; i < fs->desc_start; ++i) {
+        write_block(i, buffered_block(i));
+    }
 
     // Create the ROOT directory on disk
-    memset(D_COPY[0], -1, sizeof(byte) * BLOCK_SIZE);
+    byte *first = buffered_block(fs->desc_start);
+    memset(first, -1, sizeof(byte) * fs->block_size);
     DESCRIPTOR_T d;
+    memset(&d, -1, sizeof(d));
     d.file_size = 0;
-    d.block[0] = (1 + DESCRIPTOR_BLOCKS);
-    d.block[1] = -1;
-    memcpy(D_COPY[0], &d, sizeof(DESCRIPTOR_T));
-    write_block(1, D_COPY[0]);
+    d.type = FILE_TYPE_DIRECTORY;
+    d.block[0] = fs->first_data_block;
+    memcpy(first, &d, sizeof(DESCRIPTOR_T));
+    write_block(fs->desc_start, first);
+    fs->D_LOADED[fs->desc_start] = true;
 
     // Init the rest of descriptor blocks
-    for (unsigned int i = 2; i <= DESCRIPTOR_BLOCKS; ++i) {
+    for (int i = fs->desc_start + 1; i < fs->buffer_blocks; ++i) {
         init_block(i, -1);
     }
 
     //? TODO Init the rest of blocks
 
-    return 0;
+    return journal_format(fs->buffer_blocks, fs->journal_blocks);
 }
 
-#if (DEBUG)
-static void print_blocks_status() {
-    printf("block status:");
-    for (unsigned int i = 0; i < BLOCKS / (sizeof(byte) * 8); ++i) {
-        printf(" %03o", (int)D_COPY[0][i]);
+static int FS_start() {
+    FS_T *fs = instance->fs;
+    if (cache_init(fs->cache_blocks) < 0) return -1;
+
+    fs->alloc_hint = fs->first_data_block;
+    reserved_next = reserved_end = 0;
+    fs->cluster_gen.fetch_add(1, std::memory_order_release);
+
+    // The dedup index is read on first use
+    delete[] fs->DEDUP_INDEXED;
+    fs->DEDUP_INDEXED = new uint64_t[fs->bitmap_blocks * fs->block_size / 8]();
+    fs->dedup_loaded = false;
+    fs->dedup_written = fs->dedup_reused = 0;
+    fs->dedup_entries = 0;
+
+    // Drop the views of FS_mmap()
+    for (auto &v : fs->views) {
+        if (v.second.block >= 0) disk_unmap(v.second.block, v.second.blocks);
     }
-    printf("\n");
+    fs->views.clear();
+    delete[] fs->DIRECT_VIEWS;
+    fs->DIRECT_VIEWS = new std::atomic<int>[fs->descriptors]();
+
+    // Drop the OFTs, get_free_oft() adds them back
+    for (int i = 0; i < fs->ofts / OFTS; ++i) {
+        delete[] fs->OFT[i].exchange(NULL);
+    }
+    fs->ofts = 0;
+    fs->free_oft = -1;
+
+    // Descriptor 0 is the root directory
+    delete[] fs->FREE_DESCRIPTORS;
+    fs->FREE_DESCRIPTORS = new int[fs->descriptors];
+    fs->free_descriptors = 0;
+    fs->free_descriptor_scan = 1;
+
+    // Open the root directory
+    fs->ROOT = open(NULL);
+    assert(fs->ROOT == 0 && get_oft(fs->ROOT)->descriptor == 0);
+
+    // Room for a name of every file, so directories stay complete
+    dcache_init(std::max(DCACHE_ENTRIES, 2 * fs->descriptors));
+    fs->dir_hint.clear();
+    set_clean(0);
+
+    // A transaction holds its cached blocks, leave most of the cache free
+    int max_txn = (fs->journal_blocks - 1) / 4;
+    if (max_txn > fs->cache_blocks / 4) max_txn = fs->cache_blocks / 4;
+    return journal_open(fs->buffer_blocks, fs->journal_blocks, fs->D_COPY,
+                        fs->buffer_blocks, max_txn, free_run);
 }
-#endif
 
-// static int block_status(int b) {
-//     return D_COPY[0][b / sizeof(D_COPY[0][0])] &
-//            (1 << (b % sizeof(D_COPY[0][0])));
-// }
+static void set_clean(int clean) {
+    FS_T *fs = instance->fs;
+    if (!fs->D_COPY) return;
+    // Everything else is on disk before the superblock says it is clean
+    disk_sync();
+    SUPERBLOCK_T *super = (SUPERBLOCK_T *)buffered_block(SUPER_BLOCK);
+    super->clean = clean;
+    write_block(SUPER_BLOCK, (byte *)super);
+    disk_sync_blocks(SUPER_BLOCK, 1);
+}
 
-static void set_block_status(int b, int status) {
-    if (status) {
-        // set bit
-        D_COPY[0][b / (sizeof(byte) * 8)] |=
-            (byte)(1 << (b % (sizeof(byte) * 8)));
-    } else {
-        // clear bit
-        D_COPY[0][b / (sizeof(byte) * 8)] &=
-            (~(byte)(1 << (b % (sizeof(byte) * 8))));
+static int read_superblock() {
+    FS_T *fs = instance->fs;
+    // The geometry of the disk must be the one it was formatted with
+    SUPERBLOCK_T *super = (SUPERBLOCK_T *)buffered_block(SUPER_BLOCK);
+    if (read_block(SUPER_BLOCK, (byte *)super) == DISK_BAD_CHECKSUM) {
+        fs->damaged = true;
+    }
+    if (memcmp(super->magic, SUPER_MAGIC, sizeof(super->magic)) != 0 ||
+        super->block_size != fs->block_size ||
+        super->total_blocks != fs->total_blocks ||
+        super->bitmap_blocks != fs->bitmap_blocks ||
+        super->refcount_blocks != fs->refcount_blocks ||
+        super->dedup_blocks != fs->dedup_blocks ||
+        super->descriptor_blocks != fs->descriptor_blocks ||
+        super->journal_blocks != fs->journal_blocks) {
+        return -1;
     }
+    return 0;
+}
 
-#if (DEBUG)
-    print_blocks_status();
-#endif
+static int fsck_read(FSCK_T *c, int b, byte *buff) {
+    int result = read_block(b, buff);
+    if (result != DISK_BAD_CHECKSUM) return result;
+    if (c) ++c->damaged;
+    return 0;
 }
 
-static int get_free_descriptor() {
-    for (int i = 0; i < descriptors; ++i) {
-        if (get_descriptor(i)->file_size == -1) {
-            return i;
-        }
+static void fsck_run(FSCK_T *c, void (*work)(FSCK_T *)) {
+    c->next = 0;
+#if (THREAD_SAFE)
+    std::vector<std::thread> pool;
+    INSTANCE_T *i = instance;
+    for (int k = 1; k < c->threads; ++k) {
+        pool.emplace_back([=] {
+            instance = i;
+            work(c);
+        });
     }
-    return -1;
+    work(c);
+    for (std::thread &t : pool) t.join();
+#else
+    work(c);
+#endif
 }
 
-static int get_free_block() {
-    unsigned char *bitmap = (unsigned char *)D_COPY[0];
-    const int bits = sizeof(unsigned char) * 8;
-
-    // Check the first possible available (the first 1 + DESCRIPTOR_BLOCKS are
-    // occupied) unsigned char bitmap
-    const int first = (1 + DESCRIPTOR_BLOCKS) / bits;
-    if (bitmap[first] != ((unsigned char)~0)) {
-        for (unsigned int j = (1 + DESCRIPTOR_BLOCKS) % bits;
-             j < sizeof(unsigned char) * 8; ++j) {
-            if (bitmap[first] ^ (1 << j)) {
-                bitmap[first] |= (1 << j);
-                return first * bits + j;
+static void fsck_files(FSCK_T *c) {
+    FS_T *fs = instance->fs;
+    // A descriptor block, then a block for each level of indirection
+    byte *buff = new byte[(size_t)(INDIRECT_LEVELS + 1) * fs->block_size];
+    FS_FSCK_T found;
+    memset(&found, 0, sizeof(found));
+    for (int i; (i = c->next++) < fs->descriptor_blocks;) {
+        if (fsck_read(c, fs->desc_start + i, buff) < 0) continue;
+        DESCRIPTOR_T *d = (DESCRIPTOR_T *)buff;
+        for (int j = 0; j < fs->desc_each_block; ++j) {
+            if (d[j].file_size < 0) continue;
+            bitmap_set_range(c->in_use, i * fs->desc_each_block + j, 1);
+            if (d[j].type == FILE_TYPE_DIRECTORY) {
+                bitmap_set_range(c->dirs, i * fs->desc_each_block + j, 1);
+            }
+            ++found.files;
+            if (d[j].type & FILE_INLINE) continue;
+            const bool compressed = d[j].type & FILE_COMPRESSED;
+            for (int k = 0; k < DESCRIPTOR_MAX_BLOCKS; ++k) {
+                fsck_mark(c, d[j].block[k], 0, compressed, NULL, &found);
+            }
+            for (int k = 0; k < INDIRECT_LEVELS; ++k) {
+                fsck_mark(c, d[j].indirect[k], k + 1, compressed,
+                          buff + fs->block_size, &found);
             }
         }
     }
+    delete[] buff;
 
-    static_assert(BLOCKS % bits == 0);
+    LOCK_T lock(c->lock);
+    c->found.files += found.files;
+    c->found.blocks += found.blocks;
+    c->found.double_allocated += found.double_allocated;
+    c->found.bad_pointers += found.bad_pointers;
+}
 
-    // Check the rest
-    for (int i = first + 1; i < BLOCKS / bits; ++i) {
-        if (bitmap[i] != ((unsigned char)~0)) {
-            for (unsigned int j = 0; j < sizeof(unsigned char) * 8; ++j) {
-                if (bitmap[i] ^ (1 << j)) {
-                    bitmap[i] |= (1 << j);
-                    return i * bits + j;
-                }
-            }
+static void fsck_mark(FSCK_T *c, int b, int level, bool compressed,
+                      byte *buff, FS_FSCK_T *found) {
+    FS_T *fs = instance->fs;
+    if (b == -1 || (level == 0 && compressed && fsck_packed(b))) return;
+    if (b < fs->first_data_block || b >= fs->total_blocks) {
+        ++found->bad_pointers;
+        return;
+    }
+    // The subtree of a block met before is walked from its first pointer.
+    // Clones share data blocks with a reference count.
+    const bool first = !bitmap_test_and_set(c->used, b);
+    if (level == 0 && (first || c->refs[b] > 0)) {
+        __atomic_fetch_add(&c->pointers[b], 1, __ATOMIC_RELAXED);
+    }
+    if (!first) {
+        if ((level > 0 || c->refs[b] == 0) &&
+            !bitmap_test_and_set(c->shared, b)) {
+            ++found->double_allocated;
         }
+        return;
     }
+    ++found->blocks;
+    if (level == 0 || fsck_read(c, b, buff) < 0) return;
+    const int *ptrs = (const int *)buff;
+    for (int i = 0; i < fs->ptrs_each_block; ++i) {
+        fsck_mark(c, ptrs[i], level - 1, compressed, buff + fs->block_size,
+                  found);
+    }
+}
 
-    return -1;
+static bool fsck_packed(int p) {
+    FS_T *fs = instance->fs;
+    const int len = packed_length(p);
+    return len > 0 && len <= (CLUSTER_BLOCKS - 1) * fs->block_size;
 }
 
-static int get_free_oft() {
-    for (int i = 0; i < OFTS; ++i) {
-        if (OFT[i].pos == -1) {
-            return i;
+static void fsck_tree(FSCK_T *c) {
+    c->dir_blocks.clear();
+    c->subdirs.clear();
+    if (!bitmap_test(c->dirs, 0)) return;
+    std::vector<int> level(1, 0);
+    while (!level.empty()) {
+        c->level_begin = c->dir_blocks.size();
+        for (int d : level) fsck_dir_blocks(c, d);
+        fsck_run(c, fsck_dir);
+        level.swap(c->subdirs);
+        c->subdirs.clear();
+    }
+}
+
+static void fsck_dir_blocks(FSCK_T *c, int d) {
+    FS_T *fs = instance->fs;
+    byte *buff = new byte[(size_t)(INDIRECT_LEVELS + 1) * fs->block_size];
+    // The descriptor and indirect blocks were counted by fsck_files()
+    if (fsck_read(NULL, fs->desc_start + d / fs->desc_each_block, buff) == 0) {
+        DESCRIPTOR_T desc = ((DESCRIPTOR_T *)buff)[d % fs->desc_each_block];
+        const int size = desc.file_size > 0 ? desc.file_size : 0;
+        const int n = (size + fs->block_size - 1) / fs->block_size;
+        std::vector<int> blocks;
+        for (int k = 0; k < DESCRIPTOR_MAX_BLOCKS; ++k) {
+            fsck_collect(desc.block[k], 0, n, buff, &blocks);
+        }
+        for (int k = 0; k < INDIRECT_LEVELS; ++k) {
+            fsck_collect(desc.indirect[k], k + 1, n, buff, &blocks);
         }
+        c->dir_blocks.insert(c->dir_blocks.end(), blocks.begin(),
+                             blocks.end());
     }
-    return -1;
+    delete[] buff;
 }
 
-static DESCRIPTOR_T *get_descriptor(int d) {
-    int block = d / desc_each_block;
-    return ((DESCRIPTOR_T *)D_COPY[block + 1]) + d % desc_each_block;
+static void fsck_collect(int b, int level, int n, byte *buff,
+                         std::vector<int> *blocks) {
+    FS_T *fs = instance->fs;
+    if ((int)blocks->size() >= n) return;
+    if (b < fs->first_data_block || b >= fs->total_blocks) {
+        // A hole or a bad pointer, its blocks are skipped
+        long long count = 1;
+        for (int i = 0; i < level; ++i) count *= fs->ptrs_each_block;
+        while (count-- > 0 && (int)blocks->size() < n) blocks->push_back(-1);
+        return;
+    }
+    if (level == 0) {
+        blocks->push_back(b);
+        return;
+    }
+    if (fsck_read(NULL, b, buff) < 0) memset(buff, -1, fs->block_size);
+    const int *ptrs = (const int *)buff;
+    for (int i = 0; i < fs->ptrs_each_block; ++i) {
+        fsck_collect(ptrs[i], level - 1, n, buff + fs->block_size, blocks);
+    }
+}
+
+static void fsck_dir(FSCK_T *c) {
+    FS_T *fs = instance->fs;
+    byte *buff = new byte[fs->block_size];
+    long long bad = 0;
+    std::vector<int> subdirs;
+    for (int i; (i = c->level_begin + c->next++) < (int)c->dir_blocks.size();) {
+        const int b = c->dir_blocks[i];
+        if (b < 0 || fsck_read(c, b, buff) < 0) continue;
+        bad += fsck_dir_block(c, buff, false, &subdirs);
+    }
+    delete[] buff;
+
+    LOCK_T lock(c->lock);
+    c->found.bad_entries += bad;
+    c->subdirs.insert(c->subdirs.end(), subdirs.begin(), subdirs.end());
+}
+
+static int fsck_dir_block(FSCK_T *c, byte *b, bool clear,
+                          std::vector<int> *subdirs) {
+    FS_T *fs = instance->fs;
+    DIR_BLOCK_T *h = (DIR_BLOCK_T *)b;
+    DIRECTORY_ENTRY_T *de = (DIRECTORY_ENTRY_T *)(h + 1);
+    if (h->entries != dir_block_entries(b) || h->names < 0 ||
+        dir_slot(0, h->entries) + h->names > fs->block_size) {
+        if (clear) memset(b, 0, fs->block_size);
+        return 1;
+    }
+
+    int bad = 0, live = 0, live_names = 0;
+    for (int j = 0; j < h->entries; ++j) {
+        if (de[j].descriptor == -1) continue;
+        const char *name = (const char *)b + de[j].name;
+        bool ok = dir_name_ok(b, &de[j]) &&
+                  de[j].hash == name_hash(name, de[j].len) &&
+                  !memchr(name, '/', de[j].len) &&
+                  !memchr(name, '\0', de[j].len);
+        if (!ok || !fsck_entry_ok(c, de[j].descriptor)) {
+            ++bad;
+            if (clear) {
+                de[j].descriptor = -1;
+                de[j].len = 0;
+            }
+            continue;
+        }
+        ++live;
+        live_names += de[j].len;
+        if (subdirs && bitmap_test(c->dirs, de[j].descriptor)) {
+            subdirs->push_back(de[j].descriptor);
+        }
+    }
+    // Counts which are off only need setting right
+    if (bad == 0 && (h->live != live || h->live_names != live_names)) bad = 1;
+    if (clear) {
+        h->live = live;
+        h->live_names = live_names;
+    }
+    return bad;
+}
+
+static bool fsck_entry_ok(FSCK_T *c, int d) {
+    FS_T *fs = instance->fs;
+    return d > 0 && d < fs->descriptors && bitmap_test(c->in_use, d) &&
+           !bitmap_test_and_set(c->named, d);
+}
+
+static void fsck_bitmap(FSCK_T *c, int write, FS_FSCK_T *found) {
+    FS_T *fs = instance->fs;
+    const int words = fs->block_size / sizeof(uint64_t);
+    uint64_t *disk = new uint64_t[words];
+    for (int i = 0; i < fs->bitmap_blocks; ++i) {
+        const uint64_t *used = c->used + (size_t)i * words;
+        if (fsck_read(c, SUPER_BLOCK + 1 + i, (byte *)disk) < 0) continue;
+        bool differ = false;
+        for (int w = 0; w < words; ++w) {
+            found->orphaned_blocks += __builtin_popcountll(disk[w] & ~used[w]);
+            found->unmarked_blocks += __builtin_popcountll(used[w] & ~disk[w]);
+            differ |= disk[w] != used[w];
+        }
+        if (differ && write) write_block(SUPER_BLOCK + 1 + i, (byte *)used);
+    }
+    delete[] disk;
+}
+
+static void fsck_refcounts(FSCK_T *c, int write, FS_FSCK_T *found) {
+    FS_T *fs = instance->fs;
+    for (int i = 0; i < fs->refcount_blocks; ++i) {
+        byte *refs = c->refs + (size_t)i * fs->block_size;
+        bool differ = false;
+        for (int j = 0; j < fs->block_size; ++j) {
+            const int b = i * fs->block_size + j;
+            const int n = b < fs->total_blocks ? c->pointers[b] : 0;
+            const byte want = n > 1 ? std::min(n - 1, MAX_REFS) : 0;
+            if (refs[j] == want) continue;
+            ++found->bad_refcounts;
+            differ = true;
+            if (write) refs[j] = want;
+        }
+        if (differ && write) write_block(fs->refs_start + i, refs);
+    }
+}
+
+static void fsck_index(FSCK_T *c, int write, FS_FSCK_T *found) {
+    FS_T *fs = instance->fs;
+    const int block_words =
+        fs->bitmap_blocks * fs->block_size / sizeof(uint64_t);
+    const int entries = fs->block_size / sizeof(DEDUP_ENTRY_T);
+    uint64_t *seen = new uint64_t[block_words]();
+    byte *buff = new byte[fs->block_size];
+    for (int i = 0; i < fs->dedup_blocks; ++i) {
+        if (fsck_read(c, fs->dedup_start + i, buff) < 0) continue;
+        DEDUP_ENTRY_T *e = (DEDUP_ENTRY_T *)buff;
+        bool differ = false;
+        for (int j = 0; j < entries; ++j) {
+            const int b = e[j].block;
+            if (b == -1) continue;
+            if (b < fs->first_data_block || b >= fs->total_blocks ||
+                bitmap_test_and_set(seen, b)) {
+                ++found->bad_pointers;
+            } else if (c->pointers[b] > 0) {
+                ++c->pointers[b];
+                continue;
+            }
+            e[j].block = -1;
+            differ = true;
+        }
+        if (differ && write) write_block(fs->dedup_start + i, buff);
+    }
+    delete[] buff;
+    delete[] seen;
+}
+
+static void fsck_repair(FSCK_T *c) {
+    FS_T *fs = instance->fs;
+    byte *buff = new byte[(size_t)(INDIRECT_LEVELS + 1) * fs->block_size];
+
+    // Keep the first entry naming a file, in the order of the check
+    memset(c->named, 0, (fs->descriptors + 63) / 64 * sizeof(uint64_t));
+    for (int b : c->dir_blocks) {
+        if (b < 0 || fsck_read(NULL, b, buff) < 0) continue;
+        if (fsck_dir_block(c, buff, true, NULL)) write_block(b, buff);
+    }
+
+    // Free the files nothing names, and give every other file blocks of its
+    // own: the first pointer to a shared block keeps it, later ones get
+    // copies
+    const int block_words =
+        fs->bitmap_blocks * fs->block_size / sizeof(uint64_t);
+    uint64_t *claimed = new uint64_t[block_words]();
+    for (int i = 0; i < fs->descriptor_blocks; ++i) {
+        if (fsck_read(NULL, fs->desc_start + i, buff) < 0) continue;
+        DESCRIPTOR_T *d = (DESCRIPTOR_T *)buff;
+        bool modified = false;
+        for (int j = 0; j < fs->desc_each_block; ++j) {
+            const int n = i * fs->desc_each_block + j;
+            if (d[j].file_size < 0) continue;
+            if (n != 0 && !bitmap_test(c->named, n)) {
+                memset(&d[j], -1, sizeof(d[j]));
+                modified = true;
+                continue;
+            }
+            if (d[j].type & FILE_INLINE) continue;
+            const bool compressed = d[j].type & FILE_COMPRESSED;
+            for (int k = 0; k < DESCRIPTOR_MAX_BLOCKS; ++k) {
+                modified |= fsck_fix(c, &d[j].block[k], 0, compressed, false,
+                                     claimed, buff + fs->block_size);
+            }
+            for (int k = 0; k < INDIRECT_LEVELS; ++k) {
+                modified |= fsck_fix(c, &d[j].indirect[k], k + 1, compressed,
+                                     false, claimed, buff + fs->block_size);
+            }
+        }
+        if (modified) write_block(fs->desc_start + i, buff);
+    }
+    delete[] claimed;
+    delete[] buff;
+}
+
+static bool fsck_fix(FSCK_T *c, int *p, int level, bool compressed,
+                     bool copy, uint64_t *claimed, byte *buff) {
+    FS_T *fs = instance->fs;
+    int b = *p;
+    if (b == -1 || (level == 0 && compressed && fsck_packed(b))) return false;
+    if (b < fs->first_data_block || b >= fs->total_blocks) {
+        *p = -1;
+        return true;
+    }
+    if (!copy && bitmap_test(c->shared, b)) {
+        copy = bitmap_test_and_set(claimed, b);
+    }
+    if (!copy && level == 0) return false;
+
+    if (fsck_read(NULL, b, buff) < 0) {
+        memset(buff, level ? -1 : 0, fs->block_size);
+    }
+    if (copy) {
+        // Without a free block the pointer is dropped
+        b = bitmap_find_zero(c->used, fs->first_data_block, fs->total_blocks);
+        if (b >= 0) bitmap_set_range(c->used, b, 1);
+        *p = b;
+        if (b < 0) return true;
+    }
+    bool modified = copy;
+    int *ptrs = (int *)buff;
+    for (int i = 0; level > 0 && i < fs->ptrs_each_block; ++i) {
+        modified |= fsck_fix(c, &ptrs[i], level - 1, compressed, copy,
+                             claimed, buff + fs->block_size);
+    }
+    if (modified) write_block(b, buff);
+    return copy;
+}
+
+static int resolve(const char *path, int *parent, char *name) {
+    *parent = 0;
+    name[0] = '\0';
+    for (const char *p = path; *p != '\0';) {
+        if (*p == '/') {
+            ++p;
+            continue;
+        }
+        const char *end = strchr(p, '/');
+        if (!end) end = p + strlen(p);
+        if (end - p >= MAX_FILE_NAME_LEN) return ERR_PATH_TOO_LONG;
+
+        // The name before this one is a directory to go into
+        if (name[0] != '\0') {
+            int d = dir_lookup(*parent, name, NULL);
+            if (d < 0) return ERR_FILE_DOES_NOT_EXIST;
+            if (!is_directory(d)) return ERR_NOT_A_DIRECTORY;
+            *parent = d;
+        }
+        memcpy(name, p, end - p);
+        name[end - p] = '\0';
+        p = end;
+    }
+    return 0;
+}
+
+static int dir_lookup(int parent, const char *name, int *slot) {
+    DENTRY_T e;
+    if (!dcache_lookup(parent, name, &e)) {
+        // A name missing from a complete directory does not exist
+        e.descriptor = e.slot = -1;
+        if (!dcache_complete(parent)) dir_fill(parent, name, &e);
+        if (e.descriptor < 0) dcache_insert(parent, name, -1, -1);
+    }
+    if (slot) *slot = e.slot;
+    return e.descriptor;
+}
+
+static void dir_fill(int parent, const char *name, DENTRY_T *e) {
+    FS_T *fs = instance->fs;
+    unsigned int ticket = dcache_fill_begin(parent);
+    READ_LOCK_T lock(desc_lock(parent));
+    DESCRIPTOR_T *d = get_descriptor(parent);
+    // Filling a directory larger than the cache would only evict its names
+    const bool fill =
+        d->file_size / (int)sizeof(DIRECTORY_ENTRY_T) <= dcache_capacity() / 2;
+    const int len = strlen(name);
+    const unsigned int hash = name_hash(name, len);
+    char entry_name[MAX_FILE_NAME_LEN];
+    for (int pos = 0; pos < d->file_size; pos += fs->block_size) {
+        int b;
+        const byte *block = dir_block_get(d, pos, &b);
+        if (!block) return;
+        const DIRECTORY_ENTRY_T *de =
+            (const DIRECTORY_ENTRY_T *)(block + sizeof(DIR_BLOCK_T));
+        const int n = dir_block_entries(block);
+        for (int i = 0; i < n; ++i) {
+            if (de[i].descriptor < 0 || !dir_name_ok(block, &de[i])) {
+                continue;
+            }
+            const char *s = (const char *)block + de[i].name;
+            if (de[i].hash == hash && de[i].len == len &&
+                memcmp(s, name, len) == 0) {
+                e->descriptor = de[i].descriptor;
+                e->slot = dir_slot(pos, i);
+                if (!fill) break;
+            }
+            if (fill) {
+                memcpy(entry_name, s, de[i].len);
+                entry_name[de[i].len] = '\0';
+                dcache_insert(parent, entry_name, de[i].descriptor,
+                              dir_slot(pos, i));
+            }
+        }
+        dir_block_put(d, b, false);
+        if (!fill && e->descriptor >= 0) break;
+    }
+    if (fill) {
+        dcache_set_complete(parent, ticket);
+    } else if (e->descriptor >= 0) {
+        dcache_insert(parent, name, e->descriptor, e->slot);
+    }
+}
+
+static unsigned int name_hash(const char *name, int len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; ++i) h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+static int dir_block_entries(const byte *b) {
+    FS_T *fs = instance->fs;
+    const int max = (fs->block_size - sizeof(DIR_BLOCK_T)) /
+                    sizeof(DIRECTORY_ENTRY_T);
+    const int n = ((const DIR_BLOCK_T *)b)->entries;
+    return n < 0 ? 0 : n > max ? max : n;
+}
+
+static bool dir_name_ok(const byte *b, const DIRECTORY_ENTRY_T *e) {
+    FS_T *fs = instance->fs;
+    const int names = ((const DIR_BLOCK_T *)b)->names;
+    return e->len > 0 && e->len < MAX_FILE_NAME_LEN &&
+           e->name >= dir_slot(0, dir_block_entries(b)) &&
+           e->name >= fs->block_size - names &&
+           e->name <= fs->block_size - e->len;
+}
+
+static int dir_add(int parent, DESCRIPTOR_T *d, const char *name,
+                   int descriptor) {
+    FS_T *fs = instance->fs;
+    const int len = strlen(name);
+    int &hint = fs->dir_hint[parent];
+    int i;
+    for (int pos = hint; pos < d->file_size; pos += fs->block_size) {
+        int b;
+        byte *block = dir_block_get(d, pos, &b);
+        if (!block) continue;
+        bool added = dir_block_add(block, name, len, descriptor, &i);
+        dir_block_put(d, b, added);
+        if (added) {
+            hint = pos;
+            return dir_slot(pos, i);
+        }
+    }
+
+    // Append a block
+    std::vector<byte> buff(fs->block_size);
+    const int pos = d->file_size;
+    dir_block_add(buff.data(), name, len, descriptor, &i);
+    if (file_write(d, pos, buff.data(), fs->block_size) != fs->block_size) {
+        return -1;
+    }
+    hint = pos;
+    return dir_slot(pos, i);
+}
+
+static bool dir_block_add(byte *b, const char *name, int len, int descriptor,
+                          int *i) {
+    FS_T *fs = instance->fs;
+    DIR_BLOCK_T *h = (DIR_BLOCK_T *)b;
+    DIRECTORY_ENTRY_T *de = (DIRECTORY_ENTRY_T *)(h + 1);
+    const int n = dir_block_entries(b);
+    // A free entry, if live says there is one, or a new one
+    const int entries = h->live < n ? n : n + 1;
+    if (dir_slot(0, entries) + h->live_names + len > fs->block_size) {
+        return false;
+    }
+    int j = entries == n ? 0 : n;
+    while (j < n && de[j].descriptor >= 0) ++j;
+    if (j == entries) return false;
+
+    if (dir_slot(0, entries) + h->names + len > fs->block_size) {
+        // Pack the names in use at the end of the block
+        int names = 0;
+        for (int k = 0; k < n; ++k) {
+            if (de[k].descriptor >= 0 && dir_name_ok(b, &de[k])) {
+                names += de[k].len;
+            }
+        }
+        if (dir_slot(0, entries) + names + len > fs->block_size) return false;
+        std::vector<byte> packed(fs->block_size);
+        int top = fs->block_size;
+        for (int k = 0; k < n; ++k) {
+            if (de[k].descriptor < 0 || !dir_name_ok(b, &de[k])) continue;
+            top -= de[k].len;
+            memcpy(&packed[top], b + de[k].name, de[k].len);
+            de[k].name = top;
+        }
+        memcpy(b + top, &packed[top], fs->block_size - top);
+        h->names = h->live_names = names;
+    }
+
+    h->names += len;
+    de[j].hash = name_hash(name, len);
+    de[j].descriptor = descriptor;
+    de[j].name = fs->block_size - h->names;
+    de[j].len = len;
+    memcpy(b + de[j].name, name, len);
+    h->entries = entries;
+    ++h->live;
+    h->live_names += len;
+    *i = j;
+    return true;
+}
+
+static void dir_remove(int parent, DESCRIPTOR_T *d, int slot) {
+    FS_T *fs = instance->fs;
+    const int pos = slot & ~(fs->block_size - 1);
+    int b;
+    byte *block = dir_block_get(d, pos, &b);
+    if (!block) return;
+    DIR_BLOCK_T *h = (DIR_BLOCK_T *)block;
+    DIRECTORY_ENTRY_T *e = (DIRECTORY_ENTRY_T *)(block + slot - pos);
+
+    // The lowest name is given back now, others when the block is packed
+    if (e->name == fs->block_size - h->names) h->names -= e->len;
+    --h->live;
+    h->live_names -= e->len;
+    if (slot == dir_slot(pos, h->entries - 1)) --h->entries;
+    e->descriptor = -1;
+    e->len = 0;
+    dir_block_put(d, b, true);
+
+    int &hint = fs->dir_hint[parent];
+    if (pos < hint) hint = pos;
+}
+
+static byte *dir_block_get(DESCRIPTOR_T *d, int pos, int *b) {
+    FS_T *fs = instance->fs;
+    *b = bmap(d, pos >> fs->block_shift, 0);
+    return cache_get(*b, 0);
+}
+
+static void dir_block_put(DESCRIPTOR_T *d, int b, bool dirty) {
+    if (dirty) journal_dirty_cached(b);
+    cache_put(b, dirty, dirty ? descriptor_of(d) : CACHE_NO_OWNER);
+}
+
+static bool dir_empty(int d) {
+    FS_T *fs = instance->fs;
+    READ_LOCK_T lock(desc_lock(d));
+    DESCRIPTOR_T *dir = get_descriptor(d);
+    DIR_BLOCK_T h;
+    for (int pos = 0; pos < dir->file_size; pos += fs->block_size) {
+        if (file_read(dir, pos, &h, sizeof(h)) < (int)sizeof(h)) break;
+        if (h.live > 0) return false;
+    }
+    return true;
+}
+
+static int make_file(const char *path, int type) {
+    FS_T *fs = instance->fs;
+    char name[MAX_FILE_NAME_LEN];
+    int parent;
+    WRITE_LOCK_T dir(fs->dir_lock);
+    int err = resolve(path, &parent, name);
+    if (err < 0) return err;
+    if (name[0] == '\0' || dir_lookup(parent, name, NULL) >= 0) {
+        return ERR_FILE_ALREADY_EXISTS;
+    }
+
+    int descriptor = get_free_descriptor();
+    if (descriptor < 0) return ERR_TOO_MANY_FILES;
+
+    // The entry and the descriptor are committed together
+    WRITE_LOCK_T first, second;
+    lock_pair(parent, descriptor, first, second);
+    JOURNAL_HANDLE_T handle;
+    int slot = dir_add(parent, get_descriptor(parent), name, descriptor);
+    if (slot < 0) {
+        put_free_descriptor(descriptor);
+        return ERR_NO_FREE_DIR_ENTRY;
+    }
+
+    DESCRIPTOR_T *d = get_descriptor(descriptor);
+    d->file_size = 0;
+    d->type = type;
+    set_dirty(d);
+    dcache_insert(parent, name, descriptor, slot);
+    return 0;
+}
+
+static void free_file(DESCRIPTOR_T *d) {
+    FS_T *fs = instance->fs;
+    if (d->type & FILE_COMPRESSED) {
+        fs->cluster_gen.fetch_add(1, std::memory_order_release);
+    }
+    if (!(d->type & FILE_INLINE)) {
+        for (int i = 0; i < DESCRIPTOR_MAX_BLOCKS; ++i) {
+            free_block_tree(d->block[i], 0);
+        }
+        for (int i = 0; i < INDIRECT_LEVELS; ++i) {
+            free_block_tree(d->indirect[i], i + 1);
+        }
+    }
+    memset(d, -1, sizeof(*d));
+    set_dirty(d);
+}
+
+static int remove_file(int parent, const char *name, int slot, int d) {
+    FS_T *fs = instance->fs;
+    WRITE_LOCK_T first, second;
+    lock_pair(parent, d, first, second);
+    if (fs->DIRECT_VIEWS[d] > 0) return ERR_FILE_MAPPED;
+    JOURNAL_HANDLE_T handle;
+    free_file(get_descriptor(d));
+
+    dir_remove(parent, get_descriptor(parent), slot);
+    put_free_descriptor(d);
+    dcache_insert(parent, name, -1, -1);
+    return 0;
+}
+
+static void lock_pair(int a, int b, WRITE_LOCK_T &first,
+                      WRITE_LOCK_T &second) {
+    RW_LOCK_T *la = &desc_lock(a), *lb = &desc_lock(b);
+    if (lb < la) std::swap(la, lb);
+    first = WRITE_LOCK_T(*la);
+    if (lb != la) second = WRITE_LOCK_T(*lb);
+}
+
+static void lock_three(int a, int b, int c, WRITE_LOCK_T locks[3]) {
+    RW_LOCK_T *l[3] = {&desc_lock(a), &desc_lock(b), &desc_lock(c)};
+    std::sort(l, l + 3);
+    for (int i = 0; i < 3; ++i) {
+        if (i == 0 || l[i] != l[i - 1]) locks[i] = WRITE_LOCK_T(*l[i]);
+    }
+}
+
+static void load(int b) {
+    FS_T *fs = instance->fs;
+    LOCK_T lock(fs->load_lock);
+    if (!fs->D_LOADED[b].load(std::memory_order_relaxed)) {
+        // What was read is used all the same, nothing better is left
+        if (read_block(b, buffered_block(b)) == DISK_BAD_CHECKSUM) {
+            fs->damaged = true;
+        }
+        fs->D_LOADED[b].store(true, std::memory_order_release);
+    }
+}
+
+static void load_bitmap(int first, int end) {
+    FS_T *fs = instance->fs;
+    const int bits = fs->block_size * 8;
+    for (int i = first / bits; i < (end + bits - 1) / bits; ++i) {
+        load_block(SUPER_BLOCK + 1 + i);
+    }
+}
+
+static int find_free(int b, int end, int n) {
+    FS_T *fs = instance->fs;
+    // One bitmap block at a time, a run may reach into the next one
+    const int bits = fs->block_size * 8;
+    while (b < end) {
+        int next = (b / bits + 1) * bits;
+        int limit = next + n - 1 < end ? next + n - 1 : end;
+        load_bitmap(b, limit);
+        int found = n == 1 ? bitmap_find_zero(bitmap_words(), b, limit)
+                           : bitmap_find_run(bitmap_words(), b, limit, n);
+        if (found >= 0) return found;
+        b = next;
+    }
+    return -1;
+}
+
+#if (DEBUG)
+static void print_blocks_status() {
+    FS_T *fs = instance->fs;
+    printf("block status:");
+    for (int i = 0; i < fs->total_blocks / (int)(sizeof(byte) * 8); ++i) {
+        printf(" %03o", (int)((byte *)bitmap_words())[i]);
+    }
+    printf("\n");
+}
+#endif
+
+// static int block_status(int b) {
+//     return D_COPY[b / sizeof(D_COPY[0])] &
+//            (1 << (b % sizeof(D_COPY[0])));
+// }
+
+static void set_block_status(int b, int status) {
+    load_bitmap(b, b + 1);
+    // Atomic, other threads may allocate from the same word
+    if (status) {
+        bitmap_set_range(bitmap_words(), b, 1);
+    } else {
+        bitmap_clear_range(bitmap_words(), b, 1);
+    }
+    set_dirty((byte *)bitmap_words() + b / (sizeof(byte) * 8));
+
+#if (DEBUG)
+    print_blocks_status();
+#endif
+}
+
+static int get_free_descriptor() {
+    FS_T *fs = instance->fs;
+    LOCK_T lock(fs->descriptor_lock);
+    // Scan one more descriptor block until a free descriptor is found, so
+    // each descriptor is scanned once
+    while (fs->free_descriptors == 0 &&
+           fs->free_descriptor_scan < fs->descriptors) {
+        int end = (fs->free_descriptor_scan / fs->desc_each_block + 1) *
+                  fs->desc_each_block;
+        for (int i = end - 1; i >= fs->free_descriptor_scan; --i) {
+            if (get_descriptor(i)->file_size == -1) {
+                fs->FREE_DESCRIPTORS[fs->free_descriptors++] = i;
+            }
+        }
+        fs->free_descriptor_scan = end;
+    }
+    if (fs->free_descriptors == 0) return -1;
+    return fs->FREE_DESCRIPTORS[--fs->free_descriptors];
+}
+
+static void put_free_descriptor(int d) {
+    FS_T *fs = instance->fs;
+    LOCK_T lock(fs->descriptor_lock);
+    if (d < fs->free_descriptor_scan) {
+        fs->FREE_DESCRIPTORS[fs->free_descriptors++] = d;
+    }
+}
+
+static int get_free_block() {
+    FS_T *fs = instance->fs;
+    STAT_TIMER_T timer(STAT_ALLOC);
+    if (reserved_next < reserved_end) return reserved_next++;
+
+    // Next fit, wrapping around to the first data block. The bits past the
+    // end of the disk are never free. A free bit found may be claimed by
+    // another thread first, then search on.
+    uint64_t *bitmap = bitmap_words();
+    int hint = fs->alloc_hint.load(std::memory_order_relaxed);
+    int b = hint, end = fs->total_blocks;
+    for (bool wrapped = false;;) {
+        b = find_free(b, end, 1);
+        if (b < 0) {
+            if (wrapped) return -1;
+            wrapped = true;
+            b = fs->first_data_block;
+            end = hint;
+        } else if (bitmap_claim_range(bitmap, b, 1)) {
+            break;
+        }
+    }
+
+    set_dirty((byte *)bitmap_words() + b / (sizeof(byte) * 8));
+    fs->alloc_hint.store(b + 1, std::memory_order_relaxed);
+    return b;
+}
+
+static int alloc_run(int n) {
+    FS_T *fs = instance->fs;
+    STAT_TIMER_T timer(STAT_ALLOC);
+    uint64_t *bitmap = bitmap_words();
+    int hint = fs->alloc_hint.load(std::memory_order_relaxed);
+    int b = hint, begin = hint;
+    for (;;) {
+        b = find_free(b, fs->total_blocks, n);
+        if (b < 0) {
+            if (begin == fs->first_data_block) return -1;
+            b = begin = fs->first_data_block;
+        } else if (bitmap_claim_range(bitmap, b, n)) {
+            break;
+        }
+    }
+
+    const int bits = fs->block_size * 8;
+    for (int i = b / bits; i <= (b + n - 1) / bits; ++i) {
+        journal_dirty_meta(SUPER_BLOCK + 1 + i);
+    }
+    fs->alloc_hint.store(b + n, std::memory_order_relaxed);
+    return b;
+}
+
+static void free_run(int first, int n) {
+    FS_T *fs = instance->fs;
+    load_bitmap(first, first + n);
+    bitmap_clear_range(bitmap_words(), first, n);
+    const int bits = fs->block_size * 8;
+    for (int i = first / bits; i <= (first + n - 1) / bits; ++i) {
+        journal_dirty_meta(SUPER_BLOCK + 1 + i);
+    }
+}
+
+static int get_free_oft() {
+    FS_T *fs = instance->fs;
+    LOCK_T lock(fs->oft_lock);
+    if (fs->free_oft < 0) {
+        // Add a chunk, its entries make up the free list
+        if (fs->ofts == MAX_OFTS) return -1;
+        OFT_T *chunk = new OFT_T[OFTS];
+        for (int i = 0; i < OFTS; ++i) {
+            chunk[i].pos = -1;
+            chunk[i].descriptor = -1;
+            chunk[i].generation = 0;
+            chunk[i].next_free = i + 1 < OFTS ? fs->ofts + i + 1 : -1;
+        }
+        fs->OFT[fs->ofts / OFTS].store(chunk, std::memory_order_release);
+        fs->free_oft = fs->ofts;
+        fs->ofts += OFTS;
+    }
+
+    int i = fs->free_oft;
+    fs->free_oft = get_oft(i)->next_free;
+    return i;
+}
+
+static void put_free_oft(int i) {
+    FS_T *fs = instance->fs;
+    LOCK_T lock(fs->oft_lock);
+    get_oft(i)->next_free = fs->free_oft;
+    fs->free_oft = i;
+}
+
+static OFT_T *get_oft(int fh) {
+    FS_T *fs = instance->fs;
+    if (fh < 0) return NULL;
+    int i = FH_INDEX(fh);
+    OFT_T *chunk = fs->OFT[i / OFTS].load(std::memory_order_acquire);
+    return chunk ? &chunk[i % OFTS] : NULL;
+}
+
+static OFT_T *lock_oft(int fh, UNIQUE_LOCK_T &lock) {
+    OFT_T *f = get_oft(fh);
+    if (!f) return NULL;
+    lock = UNIQUE_LOCK_T(f->lock);
+    if (f->descriptor < 0 || f->generation != fh >> FH_INDEX_BITS) {
+        lock.unlock();
+        return NULL;
+    }
+    return f;
+}
+
+static void readahead(OFT_T *f, DESCRIPTOR_T *d, int pos, int n) {
+    FS_T *fs = instance->fs;
+    if (pos != f->ra_next || direct_io(d)) {
+        f->ra_window = f->ra_end = 0;
+        f->ra_next = pos + n;
+        return;
+    }
+    f->ra_next = pos + n;
+
+    // Go on once the reader is within half a window of the prefetched end
+    int next = (pos + n) >> fs->block_shift;
+    if (f->ra_window == 0) {
+        f->ra_window = RA_MIN_BLOCKS;
+    } else if (f->ra_end - next > f->ra_window / 2) {
+        return;
+    }
+
+    int begin = f->ra_end > next ? f->ra_end : next;
+    int end = next + f->ra_window;
+    int last = (d->file_size + fs->block_size - 1) >> fs->block_shift;
+    if (end > last) end = last;
+
+    int blocks[MAP_BATCH];
+    for (int b = begin; b < end;) {
+        int k = end - b < MAP_BATCH ? end - b : MAP_BATCH;
+        if ((k = bmap_range(d, b, k, blocks, 0)) == 0) break;
+        for (int i = 0, j; i < k; i = j) {
+            j = i + 1;
+            while (j < k && blocks[j] == blocks[j - 1] + 1) ++j;
+            cache_prefetch(blocks[i], j - i);
+        }
+        b += k;
+    }
+    f->ra_end = end > f->ra_end ? end : f->ra_end;
+    if (f->ra_window < RA_MAX_BLOCKS) f->ra_window *= 2;
+}
+
+static int file_read(DESCRIPTOR_T *d, int pos, void *buff, unsigned int len) {
+    FS_T *fs = instance->fs;
+    if (pos >= d->file_size) return 0;
+    unsigned int remain = d->file_size - pos;
+    if (remain < len) {
+        len = remain;
+    }
+    if (d->type & FILE_INLINE) {
+        // Even with a bad size, no further than the descriptor
+        if (pos >= INLINE_BYTES) return 0;
+        if (len > (unsigned int)(INLINE_BYTES - pos)) len = INLINE_BYTES - pos;
+        memcpy(buff, inline_data(d) + pos, len);
+        return len;
+    }
+    if (d->type & FILE_COMPRESSED) return compressed_read(d, pos, buff, len);
+
+    unsigned int n_read = 0, n;
+    while (len > 0) {
+        unsigned int begin = pos & (fs->block_size - 1);
+        if (begin == 0 && len >= (unsigned int)fs->block_size) {
+            int whole = read_whole_blocks(d, pos >> fs->block_shift,
+                                          len >> fs->block_shift, buff);
+            if (whole < 0) return whole;
+            if (whole > 0) {
+                pos += whole;
+                n_read += whole;
+                buff = (char *)buff + whole;
+                len -= whole;
+                continue;
+            }
+            // A hole, read as one block below
+        }
+        n = fs->block_size - begin;
+        if (len < n) n = len;
+
+#if (DEBUG)
+        printf("descriptor:%d begin:%u n:%u\n", descriptor_of(d), begin, n);
+#endif
+        int b = bmap(d, pos >> fs->block_shift, 0);
+        if (b == BMAP_BAD) return ERR_BAD_BLOCK;
+        if (b < 0) {
+            memset(buff, 0, n);  // a hole
+        } else {
+            byte *buffer = data_get(d, b, 0);
+            if (!buffer) return ERR_BAD_BLOCK;
+            memcpy(buff, buffer + begin, n);
+            data_put(d, b, false);
+        }
+
+        pos += n;
+
+        n_read += n;
+        buff = (char *)buff + n;
+        len -= n;
+    }
+
+    return n_read;
+}
+
+static int file_write(DESCRIPTOR_T *d, int pos, const void *buff,
+                      unsigned int len) {
+    FS_T *fs = instance->fs;
+    if (len > (unsigned int)(fs->max_file_size - pos)) {
+        len = fs->max_file_size - pos;
+    }
+    // What lies between the end and pos reads as zeros
+    if (pos > d->file_size) file_zero_tail(d);
+    if (d->type & FILE_INLINE) {
+        if (pos + len <= (unsigned int)INLINE_BYTES) {
+            memcpy(inline_data(d) + pos, buff, len);
+            if (d->file_size < pos + (int)len) d->file_size = pos + len;
+            set_dirty(d);
+            return len;
+        }
+        if (!file_spill(d)) return ERR_DISK_IS_FULL;
+    }
+    if (d->type & FILE_COMPRESSED) return compressed_write(d, pos, buff, len);
+
+    // Reserve the blocks appended to the file as one contiguous run
+    int mapped =
+        std::max((d->file_size + fs->block_size - 1) >> fs->block_shift,
+                 pos >> fs->block_shift);
+    int last = (int)(((long long)pos + len + fs->block_size - 1) >>
+                     fs->block_shift);
+    if (last - mapped > 1) {
+        file_map_indirect(d, mapped, last);
+        reserved_next = alloc_run(last - mapped);
+        if (reserved_next >= 0) {
+            reserved_end = reserved_next + last - mapped;
+        } else {
+            reserved_next = 0;
+        }
+    }
+
+    // The directory is metadata, its blocks are journaled
+    const bool is_dir = d->type == FILE_TYPE_DIRECTORY;
+    unsigned int n_write = 0, n;
+    while (len > 0) {
+        unsigned int begin = pos & (fs->block_size - 1);
+        if (begin == 0 && len >= (unsigned int)fs->block_size && !is_dir) {
+            n = write_whole_blocks(d, pos >> fs->block_shift,
+                                   len >> fs->block_shift, buff);
+            if (n == 0) break;  // DISK IS FULL
+            pos += n;
+            if (d->file_size < pos) {
+                d->file_size = pos;
+                set_dirty(d);
+            }
+            n_write += n;
+            buff = (char *)buff + n;
+            len -= n;
+            continue;
+        }
+        n = fs->block_size - begin;
+        if (len < n) n = len;
+
+        // Allocate the block on its first write. A new block, or one past
+        // the end, is not read: what the write leaves of it is zeros.
+        int b = bmap(d, pos >> fs->block_shift, 0);
+        const bool fresh = b < 0 || pos - (int)begin >= d->file_size;
+        const bool whole = fresh || n == (unsigned int)fs->block_size;
+        if (b < 0 || block_shared(b)) {
+            b = bmap(d, pos >> fs->block_shift,
+                     1 | BMAP_UNSHARE | (whole ? BMAP_NOCOPY : 0));
+        }
+        byte *buffer = data_get(d, b, whole ? CACHE_NOREAD : 0);
+        if (!buffer) break;  // DISK IS FULL
+        if (fresh && n < (unsigned int)fs->block_size) {
+            memset(buffer, 0, fs->block_size);
+        }
+
+#if (DEBUG)
+        printf("descriptor:%d begin:%u n:%u\n", descriptor_of(d), begin, n);
+#endif
+        memcpy(buffer + begin, buff, n);
+        if (is_dir) journal_dirty_cached(b);
+        data_put(d, b, true);
+
+        pos += n;
+        if (d->file_size < pos) {
+            d->file_size = pos;
+            set_dirty(d);
+        }
+
+        n_write += n;
+        buff = (char *)buff + n;
+        len -= n;
+    }
+
+    // Return what is left of the reservation
+    if (reserved_next < reserved_end) {
+        free_run(reserved_next, reserved_end - reserved_next);
+    }
+    reserved_next = reserved_end = 0;
+
+    if (n_write == 0 && len > 0) return ERR_DISK_IS_FULL;
+    return n_write;
+}
+
+static bool file_spill(DESCRIPTOR_T *d) {
+    byte data[INLINE_BYTES];
+    const int size = std::min(d->file_size, INLINE_BYTES);
+    memcpy(data, inline_data(d), INLINE_BYTES);
+    memset(inline_data(d), -1, INLINE_BYTES);
+    d->type &= ~FILE_INLINE;
+    d->file_size = 0;
+    set_dirty(d);
+    if (size == 0 || file_write(d, 0, data, size) == size) return true;
+
+    // Without a block the data stays where it was
+    memcpy(inline_data(d), data, INLINE_BYTES);
+    d->type |= FILE_INLINE;
+    d->file_size = size;
+    return false;
+}
+
+static void file_map_indirect(DESCRIPTOR_T *d, int first, int end) {
+    FS_T *fs = instance->fs;
+    // A leaf indirect block maps ptrs_each_block blocks from the direct ones
+    first = std::max(first, DESCRIPTOR_MAX_BLOCKS);
+    while (first < end) {
+        int slot;
+        if (bmap_range(d, first, 1, &slot, BMAP_SLOTS) == 0) {
+            // Set the slot as it is, a hole, which maps the path to it
+            slot = -1;
+            if (bmap_range(d, first, 1, &slot, 1 | BMAP_SLOTS) == 0) return;
+        }
+        first += fs->ptrs_each_block -
+                 (first - DESCRIPTOR_MAX_BLOCKS) % fs->ptrs_each_block;
+    }
+}
+
+static void file_zero_tail(DESCRIPTOR_T *d) {
+    FS_T *fs = instance->fs;
+    const int size = d->file_size;
+    if (d->type & FILE_INLINE) {
+        if (size < INLINE_BYTES) {
+            memset(inline_data(d) + size, 0, INLINE_BYTES - size);
+        }
+        return;
+    }
+    const int begin = size & (fs->block_size - 1);
+    if (begin == 0 || (d->type & FILE_COMPRESSED)) return;
+    int b = bmap(d, size >> fs->block_shift, 0);
+    if (b >= 0 && block_shared(b)) {
+        b = bmap(d, size >> fs->block_shift, 1 | BMAP_UNSHARE);
+    }
+    byte *buffer = b < 0 ? NULL : data_get(d, b, 0);
+    if (!buffer) return;
+    memset(buffer + begin, 0, fs->block_size - begin);
+    data_put(d, b, true);
+}
+
+static int file_truncate(DESCRIPTOR_T *d, int len) {
+    FS_T *fs = instance->fs;
+    if (d->type & FILE_INLINE) {
+        if (len <= INLINE_BYTES) {
+            if (len > d->file_size) file_zero_tail(d);
+            d->file_size = len;
+            set_dirty(d);
+            return 0;
+        }
+        if (!file_spill(d)) return ERR_DISK_IS_FULL;
+    }
+    if (len >= d->file_size) {
+        file_zero_tail(d);
+        d->file_size = len;
+        set_dirty(d);
+        return 0;
+    }
+
+    // A file cut short enough goes back into its descriptor
+    byte data[INLINE_BYTES];
+    const bool to_inline =
+        len <= INLINE_BYTES && file_read(d, 0, data, len) == len;
+    long long keep =
+        to_inline ? 0 : ((long long)len + fs->block_size - 1) / fs->block_size;
+    if (d->type & FILE_COMPRESSED) {
+        // The cluster holding the end is kept whole, zeros past the end
+        const int cluster_bytes = CLUSTER_BLOCKS * fs->block_size;
+        const int c = len / cluster_bytes, cut = len % cluster_bytes;
+        if (!to_inline && cut > 0) {
+            byte *cluster = cluster_get(d, c);
+            if (!cluster) return ERR_DISK_IS_FULL;
+            memset(cluster + cut, 0, cluster_bytes - cut);
+            if (cluster_store(d, c, cluster, true) < 0) {
+                return ERR_DISK_IS_FULL;
+            }
+        }
+        if (!to_inline) keep = (long long)(c + (cut > 0)) * CLUSTER_BLOCKS;
+        fs->cluster_gen.fetch_add(1, std::memory_order_release);
+    }
+
+    if (keep < DESCRIPTOR_MAX_BLOCKS) {
+        free_blocks(d->block + keep, DESCRIPTOR_MAX_BLOCKS - keep);
+        for (int i = keep; i < DESCRIPTOR_MAX_BLOCKS; ++i) d->block[i] = -1;
+    }
+    long long first = DESCRIPTOR_MAX_BLOCKS, span = fs->ptrs_each_block;
+    for (int i = 0; i < INDIRECT_LEVELS; ++i) {
+        if (keep < first + span) {
+            free_tree_tail(&d->indirect[i], i + 1, std::max(keep - first, 0LL),
+                           descriptor_of(d));
+        }
+        first += span;
+        span *= fs->ptrs_each_block;
+    }
+    if (to_inline) {
+        memcpy(inline_data(d), data, len);
+        d->type |= FILE_INLINE;
+    }
+    d->file_size = len;
+    set_dirty(d);
+    return 0;
+}
+
+static int compressed_read(DESCRIPTOR_T *d, int pos, void *buff,
+                           unsigned int len) {
+    FS_T *fs = instance->fs;
+    const int cluster_bytes = CLUSTER_BLOCKS * fs->block_size;
+    unsigned int n_read = 0;
+    while (len > 0) {
+        const int begin = pos % cluster_bytes;
+        const unsigned int n =
+            std::min(len, (unsigned int)(cluster_bytes - begin));
+        const byte *cluster = cluster_get(d, pos / cluster_bytes);
+        if (!cluster) return ERR_BAD_BLOCK;
+        memcpy(buff, cluster + begin, n);
+        pos += n;
+        n_read += n;
+        buff = (char *)buff + n;
+        len -= n;
+    }
+    return n_read;
+}
+
+static int compressed_write(DESCRIPTOR_T *d, int pos, const void *buff,
+                            unsigned int len) {
+    FS_T *fs = instance->fs;
+    const int cluster_bytes = CLUSTER_BLOCKS * fs->block_size;
+    unsigned int n_write = 0;
+    while (len > 0) {
+        const int c = pos / cluster_bytes, begin = pos % cluster_bytes;
+        const unsigned int n =
+            std::min(len, (unsigned int)(cluster_bytes - begin));
+        // A whole cluster is compressed straight from buff
+        const byte *data = (const byte *)buff;
+        if (n < (unsigned int)cluster_bytes) {
+            byte *cluster = cluster_get(d, c);
+            if (!cluster) break;
+            memcpy(cluster + begin, buff, n);
+            data = cluster;
+        }
+        if (cluster_store(d, c, data, true) < 0) break;  // DISK IS FULL
+
+        pos += n;
+        if (d->file_size < pos) {
+            d->file_size = pos;
+            set_dirty(d);
+        }
+        n_write += n;
+        buff = (const char *)buff + n;
+        len -= n;
+    }
+
+    if (n_write == 0 && len > 0) return ERR_DISK_IS_FULL;
+    return n_write;
+}
+
+static byte *cluster_get(DESCRIPTOR_T *d, int c) {
+    FS_T *fs = instance->fs;
+    CLUSTER_BUF_T &buf = cluster_buf;
+    const unsigned int gen = fs->cluster_gen.load(std::memory_order_acquire);
+    buf.data.resize(CLUSTER_BLOCKS * fs->block_size);
+    if (buf.fs_id == fs->id && buf.descriptor == descriptor_of(d) &&
+        buf.cluster == c && buf.gen == gen) {
+        return buf.data.data();
+    }
+    buf.descriptor = -1;
+    if (cluster_load(d, c, buf.data.data()) < 0) return NULL;
+    buf.fs_id = fs->id;
+    buf.descriptor = descriptor_of(d);
+    buf.cluster = c;
+    buf.gen = gen;
+    return buf.data.data();
+}
+
+static int cluster_load(DESCRIPTOR_T *d, int c, byte *data) {
+    FS_T *fs = instance->fs;
+    const int cluster_bytes = CLUSTER_BLOCKS * fs->block_size;
+    int slots[CLUSTER_BLOCKS];
+    cluster_slots(d, c * CLUSTER_BLOCKS, slots, 0);
+    const int packed = packed_length(slots[CLUSTER_BLOCKS - 1]);
+    if (packed > (CLUSTER_BLOCKS - 1) * fs->block_size) return -1;
+    cluster_buf.packed.resize(cluster_bytes);
+    byte *to = packed ? cluster_buf.packed.data() : data;
+    for (int i = 0; i < CLUSTER_BLOCKS; ++i, to += fs->block_size) {
+        if (slots[i] < 0) {
+            if (!packed) memset(to, 0, fs->block_size);  // a hole
+            continue;
+        }
+        const byte *block = cache_get(slots[i], 0);
+        if (!block) return -1;
+        memcpy(to, block, fs->block_size);
+        cache_put(slots[i], 0, CACHE_NO_OWNER);
+    }
+    if (!packed) return 0;
+
+    STAT_TIMER_T timer(STAT_DECOMPRESS);
+    timer.bytes = cluster_bytes;
+    return lz_decompress(cluster_buf.packed.data(), packed, data,
+                         cluster_bytes) == cluster_bytes
+               ? 0
+               : -1;
+}
+
+static int cluster_store(DESCRIPTOR_T *d, int c, const byte *data,
+                         bool pack) {
+    FS_T *fs = instance->fs;
+    const unsigned int gen =
+        fs->cluster_gen.fetch_add(1, std::memory_order_release) + 1;
+    const int cluster_bytes = CLUSTER_BLOCKS * fs->block_size;
+    const int first = c * CLUSTER_BLOCKS;
+    // Map the indirect blocks first, so the map is then changed at once
+    int old[CLUSTER_BLOCKS], slots[CLUSTER_BLOCKS];
+    cluster_slots(d, first, old, 0);
+    if (cluster_slots(d, first, old, 1) < 0) return ERR_DISK_IS_FULL;
+
+    int blocks = 0, packed = 0, bytes = cluster_bytes;
+    const byte *from = data;
+    if (std::any_of(data, data + cluster_bytes, [](byte x) { return x; })) {
+        blocks = CLUSTER_BLOCKS;
+        if (pack) {
+            STAT_TIMER_T timer(STAT_COMPRESS);
+            timer.bytes = cluster_bytes;
+            cluster_buf.packed.resize(cluster_bytes);
+            packed = lz_compress(data, cluster_bytes, cluster_buf.packed.data(),
+                                 (CLUSTER_BLOCKS - 1) * fs->block_size);
+        }
+        if (packed > 0) {
+            blocks = (packed + fs->block_size - 1) / fs->block_size;
+            bytes = packed;
+            from = cluster_buf.packed.data();
+        }
+    }
+
+    for (int i = 0; i < CLUSTER_BLOCKS; ++i) slots[i] = -1;
+    for (int i = 0; i < blocks; ++i) {
+        slots[i] = get_free_block();
+        byte *buffer = slots[i] < 0 ? NULL : cache_get(slots[i], CACHE_NOREAD);
+        if (!buffer) {
+            // The blocks filled so far are dirty in the cache, under d
+            for (int k = 0; k <= i; ++k) {
+                if (slots[k] < 0) continue;
+                cache_invalidate(slots[k]);
+                set_block_status(slots[k], BLK_STS_FREE);
+            }
+            return ERR_DISK_IS_FULL;
+        }
+        const int n = std::min(fs->block_size, bytes - i * fs->block_size);
+        memcpy(buffer, from + i * fs->block_size, n);
+        memset(buffer + n, 0, fs->block_size - n);
+        cache_put(slots[i], 1, descriptor_of(d));
+    }
+    if (packed > 0) slots[CLUSTER_BLOCKS - 1] = -2 - packed;
+    cluster_slots(d, first, slots, 1);
+    free_blocks(old, CLUSTER_BLOCKS);
+
+    // The buffer of the thread holds the cluster as it is now
+    if (data == cluster_buf.data.data()) cluster_buf.gen = gen;
+    return 0;
+}
+
+static int cluster_slots(DESCRIPTOR_T *d, int first, int *slots, int alloc) {
+    for (int i = 0; i < CLUSTER_BLOCKS;) {
+        int k = bmap_range(d, first + i, CLUSTER_BLOCKS - i, slots + i,
+                           alloc | BMAP_SLOTS);
+        if (k == 0) {
+            if (alloc) return -1;
+            slots[i++] = -1;
+        }
+        i += k;
+    }
+    return 0;
+}
+
+static int file_allocate(DESCRIPTOR_T *d, int first, int n,
+                         const byte *zeros) {
+    int old[MAP_BATCH], blocks[MAP_BATCH];
+    for (int i = 0; i < n;) {
+        int k = bmap_range(d, first + i, n - i, old + i, 0);
+        if (k == 0) old[i++] = -1;
+        i += k;
+    }
+    int mapped = 0;
+    while (mapped < n) {
+        int k = bmap_range(d, first + mapped, n - mapped, blocks + mapped, 1);
+        if (k == 0) break;  // DISK IS FULL
+        mapped += k;
+    }
+
+    // Zero the new blocks, runs of contiguous ones at once
+    for (int i = 0, j; i < mapped; i = j) {
+        j = i + 1;
+        if (old[i] >= 0) continue;
+        while (j < mapped && old[j] < 0 && blocks[j] == blocks[j - 1] + 1) {
+            ++j;
+        }
+        cache_write_direct(blocks[i], j - i, zeros);
+    }
+    return mapped;
+}
+
+static int journaled_write(DESCRIPTOR_T *d, int pos, const void *buff,
+                           unsigned int len) {
+    FS_T *fs = instance->fs;
+    const unsigned int piece = MAP_BATCH * fs->block_size;
+    unsigned int n_write = 0;
+    while (len > 0) {
+        unsigned int k = len < piece ? len : piece;
+        int n;
+        {
+            JOURNAL_HANDLE_T handle;
+            n = file_write(d, pos, buff, k);
+        }
+        // Blocks freed by transactions not on disk yet are free once the
+        // transactions are, so commit and try again
+        bool retry = (n < 0 || (unsigned int)n < k) &&
+                     journal_pending_frees() > 0 && journal_commit() == 0;
+        if (n > 0) {
+            pos += n;
+            n_write += n;
+            buff = (const char *)buff + n;
+            len -= n;
+        }
+        if (!retry && (n < 0 || (unsigned int)n < k)) break;
+    }
+
+    if (n_write == 0 && len > 0) return ERR_DISK_IS_FULL;
+    return n_write;
+}
+
+static DESCRIPTOR_T *get_descriptor(int d) {
+    FS_T *fs = instance->fs;
+    int block = d / fs->desc_each_block;
+    return ((DESCRIPTOR_T *)load_block(fs->desc_start + block)) +
+           d % fs->desc_each_block;
+}
+
+static int read_whole_blocks(DESCRIPTOR_T *d, int first, int n, void *buff) {
+    FS_T *fs = instance->fs;
+    int blocks[MAP_BATCH];
+    if (n > MAP_BATCH) n = MAP_BATCH;
+    blocks[0] = -1;
+    n = bmap_range(d, first, n, blocks, 0);
+    if (n == 0 && blocks[0] == BMAP_BAD) return ERR_BAD_BLOCK;
+
+    // Copy runs of contiguous blocks at once
+    for (int i = 0, j; i < n; i = j) {
+        j = i + 1;
+        while (j < n && blocks[j] == blocks[j - 1] + 1) ++j;
+        if (cache_read_direct(blocks[i], j - i,
+                              (byte *)buff + (size_t)i * fs->block_size) < 0) {
+            return ERR_BAD_BLOCK;
+        }
+    }
+    return n * fs->block_size;
+}
+
+static int write_whole_blocks(DESCRIPTOR_T *d, int first, int n,
+                              const void *buff) {
+    FS_T *fs = instance->fs;
+    int blocks[MAP_BATCH];
+    if (n > MAP_BATCH) n = MAP_BATCH;
+    if (fs->dedup_on.load(std::memory_order_relaxed) && !direct_io(d)) {
+        return dedup_write(d, first, n, buff);
+    }
+    n = bmap_range(d, first, n, blocks, 1 | BMAP_UNSHARE | BMAP_NOCOPY);
+
+    // Copy runs of contiguous blocks at once
+    for (int i = 0, j; i < n; i = j) {
+        j = i + 1;
+        while (j < n && blocks[j] == blocks[j - 1] + 1) ++j;
+        cache_write_direct(blocks[i], j - i,
+                           (const byte *)buff + (size_t)i * fs->block_size);
+    }
+    return n * fs->block_size;
+}
+
+static int bmap(DESCRIPTOR_T *d, int n, int alloc) {
+    int b = -1;
+    return bmap_range(d, n, 1, &b, alloc) == 1 || b == BMAP_BAD ? b : -1;
+}
+
+static int bmap_range(DESCRIPTOR_T *d, int n, int count, int *blocks,
+                      int alloc) {
+    FS_T *fs = instance->fs;
+    if (d->type & FILE_INLINE) return 0;
+    int k = 0;
+    if (n < DESCRIPTOR_MAX_BLOCKS) {
+        for (; k < count && n + k < DESCRIPTOR_MAX_BLOCKS; ++k) {
+            int b = d->block[n + k];
+            if (alloc & BMAP_SLOTS) {
+                if (alloc & 1) b = blocks[k];
+            } else if (b < 0 && alloc) {
+                b = get_free_block();
+            } else if (b >= 0 && (alloc & BMAP_UNSHARE) && block_shared(b)) {
+                b = block_unshare(b, !(alloc & BMAP_NOCOPY), descriptor_of(d));
+                if (b < 0) break;
+            }
+            if (b != d->block[n + k]) {
+                d->block[n + k] = b;
+                set_dirty(d);
+            }
+            if ((blocks[k] = b) < 0 && !(alloc & BMAP_SLOTS)) break;
+        }
+        return k;
+    }
+
+    // Find the tree holding block n, and n's index in it; a tree of height
+    // level + 1 maps 2^shift blocks
+    n -= DESCRIPTOR_MAX_BLOCKS;
+    int level = 0, shift = fs->ptrs_shift;
+    while (n >= 1LL << shift) {
+        n -= 1LL << shift;
+        if (++level == INDIRECT_LEVELS) return 0;
+        shift += fs->ptrs_shift;
+    }
+
+    int b = d->indirect[level];
+    if (b < 0) {
+        if (!(alloc & 1) ||
+            (b = get_free_indirect_block(descriptor_of(d))) < 0) {
+            return 0;
+        }
+        d->indirect[level] = b;
+        set_dirty(d);
+    }
+
+    // Walk down the tree
+    for (;;) {
+        shift -= fs->ptrs_shift;
+        int i = (long long)n >> shift;
+        n &= (1LL << shift) - 1;
+
+        int *ptrs = (int *)cache_get(b, 0);
+        if (!ptrs) {
+            if (count > 0 && !(alloc & 1)) blocks[0] = BMAP_BAD;
+            return 0;
+        }
+        int next = ptrs[i], dirty = 0;
+        if (shift == 0) {
+            // A leaf, map the run of blocks up to its end
+            for (; k < count && i + k < fs->ptrs_each_block; ++k) {
+                next = ptrs[i + k];
+                if (alloc & BMAP_SLOTS) {
+                    if (alloc & 1) next = blocks[k];
+                } else if (next < 0 && alloc) {
+                    next = get_free_block();
+                } else if (next >= 0 && (alloc & BMAP_UNSHARE) &&
+                           block_shared(next)) {
+                    next = block_unshare(next, !(alloc & BMAP_NOCOPY),
+                                         descriptor_of(d));
+                    if (next < 0) break;
+                }
+                if ((next >= 0 || (alloc & BMAP_SLOTS)) &&
+                    next != ptrs[i + k]) {
+                    ptrs[i + k] = next;
+                    dirty = 1;
+                }
+                if ((blocks[k] = next) < 0 && !(alloc & BMAP_SLOTS)) break;
+            }
+            if (dirty) journal_dirty_cached(b);
+            cache_put(b, dirty, descriptor_of(d));
+            return k;
+        }
+        if (next < 0 && (alloc & 1)) {
+            next = get_free_indirect_block(descriptor_of(d));
+            if (next >= 0) {
+                ptrs[i] = next;
+                dirty = 1;
+            }
+        }
+        if (dirty) journal_dirty_cached(b);
+        cache_put(b, dirty, descriptor_of(d));
+        if (next < 0) return 0;
+        b = next;
+    }
+}
+
+static int get_free_indirect_block(int owner) {
+    FS_T *fs = instance->fs;
+    int b = get_free_block();
+    if (b < 0) return -1;
+    byte *ptrs = cache_get(b, CACHE_NOREAD);
+    if (!ptrs) {
+        set_block_status(b, BLK_STS_FREE);
+        return -1;
+    }
+    memset(ptrs, -1, fs->block_size);
+    journal_dirty_cached(b);
+    cache_put(b, 1, owner);
+    return b;
+}
+
+static void free_block_tree(int b, int level) {
+    FS_T *fs = instance->fs;
+    if (b < 0 || (level == 0 && block_unref(b))) return;
+    if (level > 0) {
+        int *ptrs = (int *)cache_get(b, 0);
+        if (ptrs) {
+            if (level == 1) {
+                free_blocks(ptrs, fs->ptrs_each_block);
+            } else {
+                for (int i = 0; i < fs->ptrs_each_block; ++i) {
+                    free_block_tree(ptrs[i], level - 1);
+                }
+            }
+            cache_put(b, 0, CACHE_NO_OWNER);
+        }
+    }
+    // A freed block is never written back, and is not reused before the
+    // transaction freeing it is committed
+    journal_free(b);
+    cache_invalidate(b);
+}
+
+static void free_tree_tail(int *root, int level, long long keep, int owner) {
+    FS_T *fs = instance->fs;
+    if (*root < 0) return;
+    if (keep == 0) {
+        free_block_tree(*root, level);
+        *root = -1;
+        return;
+    }
+    int *ptrs = (int *)cache_get(*root, 0);
+    if (!ptrs) return;
+
+    // Each pointer covers span data blocks, the one holding keep is cut
+    // short and those after it freed whole
+    long long span = 1;
+    for (int i = 1; i < level; ++i) span *= fs->ptrs_each_block;
+    int i = keep / span;
+    if (keep % span) free_tree_tail(&ptrs[i++], level - 1, keep % span, owner);
+    if (level == 1) free_blocks(ptrs + i, fs->ptrs_each_block - i);
+    bool dirty = false;
+    for (; i < fs->ptrs_each_block; ++i) {
+        if (ptrs[i] == -1) continue;
+        if (level > 1) free_block_tree(ptrs[i], level - 1);
+        ptrs[i] = -1;
+        dirty = true;
+    }
+    if (dirty) journal_dirty_cached(*root);
+    cache_put(*root, dirty, owner);
+}
+
+static void free_blocks(const int *ptrs, int n) {
+    int first = -1, count = 0;
+    for (int i = 0; i <= n; ++i) {
+        const int b = i < n ? ptrs[i] : -1;
+        // Shared blocks lose a pointer and stay
+        if (b >= 0 && block_unref(b)) continue;
+        if (b >= 0 && count > 0 && b == first + count) {
+            ++count;
+            continue;
+        }
+        if (count > 0) {
+            journal_free_run(first, count);
+            for (int k = first; k < first + count; ++k) cache_invalidate(k);
+        }
+        first = b;
+        count = b >= 0;
+    }
+}
+
+static bool block_ref(int b) {
+    byte *r = refcount(b);
+    byte n = __atomic_load_n(r, __ATOMIC_RELAXED);
+    do {
+        if (n == MAX_REFS) return false;
+    } while (!__atomic_compare_exchange_n(r, &n, n + 1, true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    set_dirty(r);
+    return true;
+}
+
+static bool block_unref(int b) {
+    byte *r = refcount(b);
+    byte n = __atomic_load_n(r, __ATOMIC_RELAXED);
+    do {
+        if (n == 0) return false;
+    } while (!__atomic_compare_exchange_n(r, &n, n - 1, true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    set_dirty(r);
+    if (n == 1) dedup_release(b);
+    return true;
+}
+
+static int block_copy(int b, int owner) {
+    FS_T *fs = instance->fs;
+    int copy_b = get_free_block();
+    if (copy_b < 0) return -1;
+    byte *from = cache_get(b, 0);
+    byte *to = from ? cache_get(copy_b, CACHE_NOREAD) : NULL;
+    if (!to) {
+        if (from) cache_put(b, 0, CACHE_NO_OWNER);
+        set_block_status(copy_b, BLK_STS_FREE);
+        return -1;
+    }
+    memcpy(to, from, fs->block_size);
+    cache_put(copy_b, 1, owner);
+    cache_put(b, 0, CACHE_NO_OWNER);
+    return copy_b;
+}
+
+static int block_unshare(int b, bool copy, int owner) {
+    int copy_b = copy ? block_copy(b, owner) : get_free_block();
+    if (copy_b < 0) return -1;
+    // The other owners may have let go of b meanwhile
+    if (!block_unref(b)) {
+        journal_free(b);
+        cache_invalidate(b);
+    }
+    return copy_b;
+}
+
+static int clone_tree(int b, int level, int owner, bool *full) {
+    FS_T *fs = instance->fs;
+    if (b < 0) return b;  // a hole or a cluster length
+    if (*full) return -1;
+    if (level == 0) {
+        if (block_ref(b)) return b;
+        // Shared too many times already, the clone gets a copy
+        int copy_b = block_copy(b, owner);
+        if (copy_b < 0) *full = true;
+        return copy_b;
+    }
+
+    int copy_b = get_free_indirect_block(owner);
+    if (copy_b < 0) {
+        *full = true;
+        return -1;
+    }
+    const int *from = (const int *)cache_get(b, 0);
+    int *to = from ? (int *)cache_get(copy_b, CACHE_NOREAD) : NULL;
+    if (to) {
+        for (int i = 0; i < fs->ptrs_each_block; ++i) {
+            to[i] = clone_tree(from[i], level - 1, owner, full);
+        }
+        journal_dirty_cached(copy_b);
+        cache_put(copy_b, 1, owner);
+    } else {
+        *full = true;
+    }
+    if (from) cache_put(b, 0, CACHE_NO_OWNER);
+    return copy_b;
+}
+
+static uint64_t block_hash(const byte *p, int n) {
+    uint32_t lane[8];
+    for (int j = 0; j < 8; ++j) lane[j] = 0x9e3779b9u * (j + 1);
+    for (int i = 0; i < n; i += sizeof(lane)) {
+        uint32_t w[8];
+        memcpy(w, p + i, sizeof(w));
+        for (int j = 0; j < 8; ++j) {
+            uint32_t x = lane[j] + w[j] * 0x85ebca77u;
+            lane[j] = (x << 13 | x >> 19) * 0x9e3779b1u;
+        }
+    }
+    uint64_t h = n;
+    for (int j = 0; j < 8; ++j) h = (h ^ lane[j]) * 0x100000001b3ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    return h ^ h >> 33;
+}
+
+static DEDUP_ENTRY_T *dedup_bucket(uint64_t hash) {
+    FS_T *fs = instance->fs;
+    return (DEDUP_ENTRY_T *)load_block(fs->dedup_start +
+                                       hash % fs->dedup_blocks);
+}
+
+static void dedup_load() {
+    FS_T *fs = instance->fs;
+    if (fs->dedup_loaded.load(std::memory_order_relaxed)) return;
+    const int entries = fs->block_size / sizeof(DEDUP_ENTRY_T);
+    for (int i = 0; i < fs->dedup_blocks; ++i) {
+        const DEDUP_ENTRY_T *e =
+            (const DEDUP_ENTRY_T *)load_block(fs->dedup_start + i);
+        for (int j = 0; j < entries; ++j) {
+            if (e[j].block < fs->first_data_block ||
+                e[j].block >= fs->total_blocks) {
+                continue;
+            }
+            bitmap_set_range(fs->DEDUP_INDEXED, e[j].block, 1);
+            ++fs->dedup_entries;
+        }
+    }
+    fs->dedup_loaded.store(true, std::memory_order_release);
+}
+
+static int dedup_find(const byte *data, uint64_t hash) {
+    FS_T *fs = instance->fs;
+    const unsigned int tag = hash >> 32;
+    int b = -1;
+    {
+        LOCK_T lock(fs->dedup_lock);
+        dedup_load();
+        const DEDUP_ENTRY_T *e = dedup_bucket(hash);
+        const int entries = fs->block_size / sizeof(DEDUP_ENTRY_T);
+        for (int i = 0; i < entries && b < 0; ++i) {
+            if (e[i].block >= 0 && e[i].hash == tag && block_ref(e[i].block)) {
+                b = e[i].block;
+            }
+        }
+    }
+    if (b < 0) return -1;
+
+    // The reference keeps the block as it is, compare the data
+    const byte *stored = cache_get(b, 0);
+    const bool same = stored && memcmp(stored, data, fs->block_size) == 0;
+    if (stored) cache_put(b, 0, CACHE_NO_OWNER);
+    if (same) return b;
+    free_blocks(&b, 1);
+    return -1;
+}
+
+static void dedup_insert(int b, uint64_t hash) {
+    FS_T *fs = instance->fs;
+    LOCK_T lock(fs->dedup_lock);
+    dedup_load();
+    DEDUP_ENTRY_T *e = dedup_bucket(hash);
+    const int entries = fs->block_size / sizeof(DEDUP_ENTRY_T);
+    for (int i = 0; i < entries; ++i) {
+        if (e[i].block >= 0) continue;
+        // A block just written has no other pointer yet
+        if (!block_ref(b)) return;
+        e[i].hash = hash >> 32;
+        e[i].block = b;
+        set_dirty(&e[i]);
+        bitmap_set_range(fs->DEDUP_INDEXED, b, 1);
+        ++fs->dedup_entries;
+        return;
+    }
+}
+
+static void dedup_release(int b) {
+    FS_T *fs = instance->fs;
+    if (fs->dedup_loaded.load(std::memory_order_acquire) &&
+        !bitmap_test(fs->DEDUP_INDEXED, b)) {
+        return;
+    }
+    LOCK_T lock(fs->dedup_lock);
+    dedup_load();
+    // dedup_find() may have taken a reference meanwhile
+    if (!bitmap_test(fs->DEDUP_INDEXED, b) ||
+        __atomic_load_n(refcount(b), __ATOMIC_RELAXED) > 0) {
+        return;
+    }
+    const byte *data = cache_get(b, 0);
+    if (!data) return;
+    DEDUP_ENTRY_T *e = dedup_bucket(block_hash(data, fs->block_size));
+    cache_put(b, 0, CACHE_NO_OWNER);
+    const int entries = fs->block_size / sizeof(DEDUP_ENTRY_T);
+    for (int i = 0; i < entries; ++i) {
+        if (e[i].block != b) continue;
+        e[i].block = -1;
+        set_dirty(&e[i]);
+        bitmap_clear_range(fs->DEDUP_INDEXED, b, 1);
+        --fs->dedup_entries;
+        journal_free(b);
+        cache_invalidate(b);
+        return;
+    }
+}
+
+static int dedup_write(DESCRIPTOR_T *d, int first, int n, const void *buff) {
+    FS_T *fs = instance->fs;
+    const byte *data = (const byte *)buff;
+    uint64_t hash[MAP_BATCH];
+    int found[MAP_BATCH], blocks[MAP_BATCH];
+    for (int i = 0; i < n; ++i) {
+        hash[i] = block_hash(data + (size_t)i * fs->block_size, fs->block_size);
+        found[i] = dedup_find(data + (size_t)i * fs->block_size, hash[i]);
+    }
+
+    // Runs of blocks found or not, each mapped in one walk
+    int done = 0;
+    while (done < n) {
+        const bool hit = found[done] >= 0;
+        int end = done + 1;
+        for (; end < n && (found[end] >= 0) == hit; ++end) {
+            // A block repeating one of the run is looked up once it is stored
+            int j = done;
+            while (!hit && j < end && hash[j] != hash[end]) ++j;
+            if (!hit && j < end) break;
+        }
+        int k;
+        if (hit) {
+            // Point the file at the stored blocks, dropping the old ones
+            k = bmap_range(d, first + done, end - done, blocks, BMAP_SLOTS);
+            if (k == 0) {
+                // No indirect block yet, the blocks are holes
+                k = end - done;
+                for (int i = 0; i < k; ++i) blocks[i] = -1;
+            }
+            k = bmap_range(d, first + done, k, found + done, 1 | BMAP_SLOTS);
+            free_blocks(blocks, k);
+            fs->dedup_reused += k;
+        } else {
+            k = bmap_range(d, first + done, end - done, blocks + done,
+                           1 | BMAP_UNSHARE | BMAP_NOCOPY);
+            for (int i = done, j; i < done + k; i = j) {
+                j = i + 1;
+                while (j < done + k && blocks[j] == blocks[j - 1] + 1) ++j;
+                cache_write_direct(blocks[i], j - i,
+                                   data + (size_t)i * fs->block_size);
+            }
+            for (int i = done; i < done + k; ++i) {
+                dedup_insert(blocks[i], hash[i]);
+            }
+            // The blocks after them may repeat them
+            for (int i = done + k; i < n; ++i) {
+                for (int j = done; j < done + k && found[i] < 0; ++j) {
+                    if (hash[j] != hash[i]) continue;
+                    found[i] = dedup_find(data + (size_t)i * fs->block_size,
+                                          hash[i]);
+                }
+            }
+        }
+        done += k;
+        fs->dedup_written += k;
+        if (done < end) break;  // DISK IS FULL
+    }
+
+    // Drop the references to the stored blocks not used
+    for (int i = done; i < n; ++i) {
+        if (found[i] >= 0) free_blocks(&found[i], 1);
+    }
+    return done * fs->block_size;
+}
+
+static int view_sync(VIEW_T *view) {
+    FS_T *fs = instance->fs;
+    if (view->block >= 0) {
+        // Drop copies the cache read meanwhile, the disk has the data
+        for (int i = 0; i < view->blocks; ++i) {
+            cache_invalidate(view->block + i);
+        }
+        return disk_sync_blocks(view->block, view->blocks);
+    }
+
+    UNIQUE_LOCK_T lock;
+    OFT_T *f = lock_oft(view->fh, lock);
+    if (!f || f->descriptor != view->descriptor) return ERR_FILE_NOT_OPENED;
+    WRITE_LOCK_T d_lock(desc_lock(f->descriptor));
+    DESCRIPTOR_T *d = get_descriptor(f->descriptor);
+
+    // Write the runs of changed blocks back, within the view and the file
+    for (int i = 0, j; i < view->blocks; i = j) {
+        const byte *data = view->data.data() + (size_t)i * fs->block_size;
+        const uint64_t hash = block_hash(data, fs->block_size);
+        j = i + 1;
+        if (hash == view->hashes[i]) continue;
+        view->hashes[i] = hash;
+        for (; j < view->blocks; ++j) {
+            const uint64_t next = block_hash(
+                view->data.data() + (size_t)j * fs->block_size, fs->block_size);
+            if (next == view->hashes[j]) break;
+            view->hashes[j] = next;
+        }
+        int begin = std::max(view->off, (view->first + i) * fs->block_size);
+        int end = std::min({view->off + view->len,
+                            (view->first + j) * fs->block_size, d->file_size});
+        if (begin >= end) continue;
+        int n = journaled_write(
+            d, begin,
+            view->data.data() + (begin - view->first * fs->block_size),
+            end - begin);
+        if (n < end - begin) return n < 0 ? n : ERR_DISK_IS_FULL;
+    }
+    return 0;
+}
+
+static inline bool direct_io(const DESCRIPTOR_T *d) {
+    FS_T *fs = instance->fs;
+    return fs->DIRECT_VIEWS[descriptor_of(d)].load(
+               std::memory_order_relaxed) > 0;
+}
+
+static byte *data_get(DESCRIPTOR_T *d, int b, int flags) {
+    FS_T *fs = instance->fs;
+    if (!direct_io(d)) return cache_get(b, flags);
+    bounce.resize(fs->block_size);
+    if (!(flags & CACHE_NOREAD) && cache_read_direct(b, 1, bounce.data()) < 0) {
+        return NULL;
+    }
+    return bounce.data();
+}
+
+static void data_put(DESCRIPTOR_T *d, int b, bool dirty) {
+    if (!direct_io(d)) {
+        cache_put(b, dirty, descriptor_of(d));
+    } else if (dirty) {
+        cache_write_direct(b, 1, bounce.data());
+    }
 }
@@ -10,24 +10,168 @@
 #define ERR_FILE_NOT_OPENED -4
 #define ERR_TOO_MANY_FILES -5
 #define ERR_NO_FREE_DIR_ENTRY -6
-#define ERR_SEEK_OUT_OF_RANGE -7  // current position is past the end of file
+#define ERR_SEEK_OUT_OF_RANGE -7  // a position past the largest file
 #define ERR_PATH_TOO_LONG -8
 #define ERR_DISK_IS_FULL -9
 #define ERR_TOO_MANY_FILES_OPENED -10
+#define ERR_NOT_A_DIRECTORY -11  // a component before the last is a file
+#define ERR_IS_A_DIRECTORY -12
+#define ERR_DIRECTORY_NOT_EMPTY -13
+#define ERR_ROOT_DIRECTORY -14  // the root directory cannot be removed
+#define ERR_FILE_MAPPED -15     // the file has a direct view of FS_mmap()
+#define ERR_BAD_BLOCK -16       // a block failed its checksum (disk.h)
 
-// init()
+// Paths are names separated by slashes, from the root directory; a leading
+// slash is allowed. Each name is shorter than MAX_FILE_NAME_LEN bytes.
+#define MAX_FILE_NAME_LEN 256
+
+// A file handle is the index of its OFT entry with a generation number in the
+// bits above FH_INDEX_BITS, so a handle is stale once its file is closed.
+#define FH_INDEX_BITS 20
+#define FH_INDEX(fh) ((fh) & ((1 << FH_INDEX_BITS) - 1))
+
+// A buffer of FS_readv() and FS_writev(), like struct iovec.
+struct FS_IOVEC_T {
+    void *base;
+    unsigned int len;
+};
+
+// init(), formats the opened disk
 int FS_init();
+// Mount the file system on the opened disk without formatting it. Metadata
+// is read on first use; after an unclean shutdown the disk is repaired by
+// FS_fsck() first. Returns -1 if the disk holds no file system of its
+// geometry.
+int FS_mount();
+// Unmount, marking the disk clean.
 int FS_close();
+// Capacity of the block cache in blocks, used by the next FS_init().
+int FS_set_cache_size(int blocks);
+// Write every modified block back to the disk.
+int FS_sync();
+// Write the modified blocks of an open file back to the disk and commit the
+// metadata needed to reach them.
+int FS_fsync(int fh);
+
+// Instances: a process may run many file systems, each on a disk of its own
+// with its own cache, journal and open files, sharing no lock with the
+// others. Every call, disk_open() and the other disk calls included, works
+// on the instance bound to the calling thread, the default instance until
+// the thread calls FS_use(). File handles belong to their instance.
+struct INSTANCE_T;
+// A new instance with no disk opened.
+INSTANCE_T *FS_new();
+// Bind the calling thread to fs, or to the default instance if fs is NULL,
+// and return the instance it was bound to.
+INSTANCE_T *FS_use(INSTANCE_T *fs);
+// FS_close() and disk_close() fs, and free it. No thread may use it any
+// more; the default instance cannot be deleted (-1).
+int FS_delete(INSTANCE_T *fs);
+
+// What FS_fsck() found.
+struct FS_FSCK_T {
+    int unclean;                 // the disk was not unmounted by FS_close()
+    int repaired;                // the problems below were fixed
+    long long files;             // files in use
+    long long blocks;            // blocks the files use
+    long long double_allocated;  // blocks more than one pointer points to
+    long long bad_pointers;      // block numbers outside the data area
+    long long orphaned_blocks;   // allocated in the bitmap but not used
+    long long unmarked_blocks;   // used but free in the bitmap
+    long long bad_entries;       // directory entries naming no file, or a
+                                 // file named by an earlier entry
+    long long orphaned_files;    // files no directory entry names
+    long long bad_refcounts;     // shared blocks whose count is wrong
+    long long bad_checksums;     // blocks not matching their checksums, on
+                                 // a disk which keeps them (disk.h)
+    long long bad_metadata;      // of them, metadata blocks the check read
+};
+// Check the file system on the opened disk, walking the descriptors and the
+// directory with threads threads (0 for one per CPU) and rebuilding the
+// bitmap and the reference counts from the block maps. Memory use is a few
+// bytes per block. With repair, replay the journal first and fix what is
+// found: bad entries and pointers are dropped, orphaned files freed, blocks
+// used twice copied and the bitmap and the counts written back. Nothing is
+// repaired while a metadata block fails its checksum: the check still walks
+// what the block holds, so no block it points to is lost. The disk is
+// unmounted first and must be mounted again afterwards. Return the number of
+// problems found, or -1 if the disk holds no file system of its geometry.
+int FS_fsck(int repair, int threads, FS_FSCK_T *report);
 
 int create(const char *path);
 int destroy(const char *path);
+// Make dst a copy of file src which shares its data blocks, as with
+// FICLONE: the copy takes no data blocks and a block is copied on the
+// first write to it through either file.
+int FS_clone(const char *src, const char *dst);
+int mkdir(const char *path);  // mkdir()
+int rmdir(const char *path);  // rmdir(), the directory must be empty
 int open(const char *path);                             // open()
 int close(int fh);                                      // close()
 int read(int fh, void *buff, unsigned int len);         // read()
 int write(int fh, const void *buff, unsigned int len);  // write()
+// Scatter-gather I/O: one call moves the buffers in order, as if read() or
+// write() were called for each, and returns the total number of bytes.
+// Whole aligned blocks go straight between the buffers and the disk.
+int FS_readv(int fh, const FS_IOVEC_T *iov, int iovcnt);   // readv()
+int FS_writev(int fh, const FS_IOVEC_T *iov, int iovcnt);  // writev()
+// Seeking past the end is allowed: a write there leaves a hole, which
+// takes no blocks and reads as zeros.
 int seek(int fh, int pos);                              // seek()
 int tell(int fh);                                       // ftell()
 int eof(int fh);                                        // feof()
+// Set the size of an open file, freeing the blocks past a shorter end; a
+// longer file reads as zeros up to the new end.
+int truncate(int fh, int len);  // ftruncate()
+// Allocate the blocks of [pos, pos + len) of an open file up front, the
+// missing ones as one contiguous run, so later writes there allocate
+// nothing. They read as zeros; the size is kept, as with
+// FALLOC_FL_KEEP_SIZE, so appending fills them.
+int fallocate(int fh, int pos, int len);
+// Compression: a compressed file keeps its data in clusters of a few
+// blocks, each compressed on write with a fast LZ codec and decompressed on
+// read. A cluster which does not shrink by a block is stored as is; data
+// which does not compress is better kept in files without compression.
+// Whether the files created from now on are compressed, off at start.
+int FS_set_compression(int on);
+// Turn compression of an open file on or off; off, the compressed clusters
+// are stored again as they are. A compressed file is not preallocated by
+// fallocate().
+int FS_compress(int fh, int on);
+// Deduplication: write() looks each whole block it writes up in an index of
+// block hashes on the disk, and a block holding the data of a stored one
+// points to it instead of taking a block, as with FS_clone(). Stored blocks
+// are copied on their next write. Whether write() deduplicates, off at
+// start.
+int FS_set_dedup(int on);
+// What deduplication did since the file system was started.
+struct FS_DEDUP_T {
+    long long blocks_written;  // whole blocks written with dedup on
+    long long blocks_reused;   // of them, those pointing to a stored block
+    long long indexed;         // blocks in the index
+    double ratio;              // blocks written per block taken
+};
+int FS_dedup_stats(FS_DEDUP_T *stats);
+// Memory-mapped access: FS_mmap() returns a pointer to the len bytes of
+// open file fh from off, which lie within the file, or NULL. If the blocks
+// of the range are the file's own and contiguous on the disk, it points
+// into the disk: reads and writes through it are reads and writes of the
+// file, and of read() and write(). Otherwise it points to a copy of the
+// range, and the blocks changed through it are written back to the file by
+// FS_msync() and FS_munmap(), while fh is open. A file with a direct view
+// cannot be destroyed, cloned, cut short or compressed (ERR_FILE_MAPPED),
+// and write() does not deduplicate it. FS_init() and FS_mount() drop the
+// views left.
+void *FS_mmap(int fh, int off, int len);
+// Write the changes made through the view at addr back to the file, as
+// msync().
+int FS_msync(void *addr);
+// FS_msync() and drop the view at addr, as munmap().
+int FS_munmap(void *addr);
+// List the names and sizes of the files in the root directory, or in the
+// directory at path, on stdout; directories end with a slash. Return the
+// number of files.
 int directory();
+int FS_directory(const char *path);
 
 #endif  //_FILE_SYSTEM_H_
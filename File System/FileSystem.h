@@ -0,0 +1,136 @@
+#pragma once
+
+#ifndef _FILESYSTEM_CLASS_H_
+#define _FILESYSTEM_CLASS_H_
+
+#include <cstddef>
+
+#include "FS.h"
+#include "disk.h"
+
+// A file system instance as an object, for a process running many of them:
+//
+//     struct TENANT_GEOMETRY {
+//         static constexpr unsigned int blocks = 4096;
+//         static constexpr unsigned int block_size = 4096;
+//         static constexpr int cache_blocks = 256;
+//     };
+//     FileSystem<TENANT_GEOMETRY, MEMORY_DISK> fs;
+//     if (fs.init() < 0) ...
+//
+// Each call binds the calling thread to the instance for its duration, so
+// objects may be used from any thread and mixed freely with the C API of
+// FS.h, which works on whatever instance the thread is bound to. The
+// geometry is checked at compile time; the file system works with the
+// shifts and masks of its block size once the disk is opened, so a power
+// of two costs no division on the paths of read() and write().
+
+// Where the disk of an instance lives: Backend::open(path, blocks,
+// block_size) opens it with disk_open().
+struct MEMORY_DISK {
+    static int open(const char *, unsigned int blocks,
+                    unsigned int block_size) {
+        return disk_open(NULL, blocks, block_size, 0);
+    }
+};
+struct FILE_DISK {
+    static int open(const char *path, unsigned int blocks,
+                    unsigned int block_size) {
+        if (!path) return -1;
+        return disk_open(path, blocks, block_size, 0);
+    }
+};
+
+template <class Geometry, class Backend = MEMORY_DISK>
+class FileSystem {
+    static_assert(Geometry::block_size >= MIN_BLOCK_SIZE &&
+                      (Geometry::block_size & (Geometry::block_size - 1)) == 0,
+                  "the block size is a power of two, MIN_BLOCK_SIZE or more");
+    static_assert(Geometry::blocks > 0 && Geometry::cache_blocks > 0,
+                  "a disk and a cache of some blocks");
+
+   public:
+    static constexpr int block_shift = __builtin_ctz(Geometry::block_size);
+
+    // The block of byte pos of a file, and the offset of pos in it.
+    static constexpr int block_of(int pos) { return pos >> block_shift; }
+    static constexpr int offset_of(int pos) {
+        return pos & (Geometry::block_size - 1);
+    }
+
+    // A new instance on the disk of Backend at path, opened but neither
+    // formatted nor mounted; error() is -1 if the disk could not be opened.
+    explicit FileSystem(const char *path = NULL) : fs(FS_new()) {
+        BINDING_T bound(fs);
+        failed =
+            Backend::open(path, Geometry::blocks, Geometry::block_size) < 0 ||
+            FS_set_cache_size(Geometry::cache_blocks) < 0;
+    }
+    ~FileSystem() { FS_delete(fs); }
+    FileSystem(const FileSystem &) = delete;
+    FileSystem &operator=(const FileSystem &) = delete;
+
+    int error() const { return failed ? -1 : 0; }
+    INSTANCE_T *instance() const { return fs; }
+
+    int init() { return failed ? -1 : (BINDING_T(fs), FS_init()); }
+    int mount() { return failed ? -1 : (BINDING_T(fs), FS_mount()); }
+    int close() { return BINDING_T(fs), FS_close(); }
+    int sync() { return BINDING_T(fs), FS_sync(); }
+    int fsck(int repair, int threads, FS_FSCK_T *report) {
+        return BINDING_T(fs), FS_fsck(repair, threads, report);
+    }
+
+    int create(const char *path) { return BINDING_T(fs), ::create(path); }
+    int destroy(const char *path) { return BINDING_T(fs), ::destroy(path); }
+    int clone(const char *src, const char *dst) {
+        return BINDING_T(fs), FS_clone(src, dst);
+    }
+    int mkdir(const char *path) { return BINDING_T(fs), ::mkdir(path); }
+    int rmdir(const char *path) { return BINDING_T(fs), ::rmdir(path); }
+    int open(const char *path) { return BINDING_T(fs), ::open(path); }
+    int close(int fh) { return BINDING_T(fs), ::close(fh); }
+    int read(int fh, void *buff, unsigned int len) {
+        return BINDING_T(fs), ::read(fh, buff, len);
+    }
+    int write(int fh, const void *buff, unsigned int len) {
+        return BINDING_T(fs), ::write(fh, buff, len);
+    }
+    int readv(int fh, const FS_IOVEC_T *iov, int iovcnt) {
+        return BINDING_T(fs), FS_readv(fh, iov, iovcnt);
+    }
+    int writev(int fh, const FS_IOVEC_T *iov, int iovcnt) {
+        return BINDING_T(fs), FS_writev(fh, iov, iovcnt);
+    }
+    int seek(int fh, int pos) { return BINDING_T(fs), ::seek(fh, pos); }
+    int tell(int fh) { return BINDING_T(fs), ::tell(fh); }
+    int eof(int fh) { return BINDING_T(fs), ::eof(fh); }
+    int truncate(int fh, int len) {
+        return BINDING_T(fs), ::truncate(fh, len);
+    }
+    int fallocate(int fh, int pos, int len) {
+        return BINDING_T(fs), ::fallocate(fh, pos, len);
+    }
+    int fsync(int fh) { return BINDING_T(fs), FS_fsync(fh); }
+    void *mmap(int fh, int off, int len) {
+        return BINDING_T(fs), FS_mmap(fh, off, len);
+    }
+    int msync(void *addr) { return BINDING_T(fs), FS_msync(addr); }
+    int munmap(void *addr) { return BINDING_T(fs), FS_munmap(addr); }
+    int directory(const char *path) {
+        return BINDING_T(fs), FS_directory(path);
+    }
+
+   private:
+    // Binds the calling thread to an instance while it lives.
+    struct BINDING_T {
+        INSTANCE_T *bound;
+        explicit BINDING_T(INSTANCE_T *fs) : bound(FS_use(fs)) {}
+        ~BINDING_T() { FS_use(bound); }
+    };
+
+    INSTANCE_T *fs;
+    bool failed;
+};
+
+#endif  //_FILESYSTEM_CLASS_H_
@@ -0,0 +1,543 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "FS.h"
+#include "FileSystem.h"
+#include "crc32c.h"
+#include "disk.h"
+
+// Microbenchmarks of the FS API. Every benchmark runs on a freshly
+// formatted in-memory disk and is reported as one JSON object with its
+// throughput and latency percentiles, so runs of different versions can be
+// compared by a script.
+//
+// FS-bench [-o <json file>]
+
+#define DISK_BLOCKS 32768
+#define DISK_BLOCK_SIZE 4096
+#define CACHE_SIZE 1024
+
+#define FILE_BYTES (32 << 20)  // size of the file the I/O benchmarks use
+#define RANDOM_OPS 4096        // operations of the random I/O benchmarks
+#define SEEK_OPS 100000
+#define LISTINGS 100           // directory() calls timed
+#define LISTING_FILES 1000
+#define SMALL_FILES 1000
+#define SMALL_FILE_BYTES 16    // small enough to stay in the descriptor
+#define APPEND_SIZE 4096       // writes appending to a preallocated file
+#define CLONES 8               // clones of one file timed
+#define TEXT_WORDS 64          // vocabulary of the compressible data
+#define VIEW_BYTES (1 << 20)   // span of the FS_mmap() benchmarks
+#define RECORD_BYTES 64        // random reads of the FS_mmap() benchmarks
+#define TENANTS 4              // threads of the instance benchmarks
+#define TENANT_BYTES (8 << 20)  // written by each of them
+#define TENANT_IO 65536         // bytes of each of their writes
+#define SUM_BYTES (1 << 20)     // span of the checksum kernel benchmarks
+#define SUM_ROUNDS 64           // passes over it timed
+
+static const int file_counts[] = {100, 1000, 4000};
+static const int io_sizes[] = {512, 4096, 65536, 1 << 20};
+
+static FILE *json;
+static int results;  // objects written so far
+
+static inline long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// The i-th file name, up to 62^3 different ones.
+static void file_name(char *name, int i) {
+    static const char digits[] =
+        "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    name[0] = digits[i % 62];
+    name[1] = digits[i / 62 % 62];
+    name[2] = digits[i / (62 * 62) % 62];
+    name[3] = '\0';
+}
+
+static void format() {
+    if (FS_init() < 0) {
+        fprintf(stderr, "FS_init() failed\n");
+        exit(1);
+    }
+}
+
+// Write one result. param/value describe the run (e.g. "size", 4096), bytes
+// is the data moved in total or 0.
+static void report(const char *name, const char *param, long value,
+                   std::vector<long long> &latency, long long elapsed_ns,
+                   long long bytes) {
+    std::sort(latency.begin(), latency.end());
+    size_t n = latency.size();
+    double seconds = elapsed_ns / 1e9;
+
+    fprintf(json, "%s\n    {\"name\": \"%s\", \"%s\": %ld, \"ops\": %zu, ",
+            results++ ? "," : "", name, param, value, n);
+    fprintf(json, "\"ops_per_sec\": %.0f, ", n / seconds);
+    if (bytes) fprintf(json, "\"mb_per_sec\": %.1f, ", bytes / seconds / 1e6);
+    fprintf(json, "\"p50_ns\": %lld, \"p99_ns\": %lld}",
+            n ? latency[n / 2] : 0, n ? latency[n * 99 / 100] : 0);
+}
+
+// Time op(i) for i in [0, n) and report it.
+template <typename OP>
+static void run(const char *name, const char *param, long value, int n,
+                long long bytes_each, OP op) {
+    std::vector<long long> latency(n);
+    long long start = now_ns();
+    for (int i = 0; i < n; ++i) {
+        long long t = now_ns();
+        op(i);
+        latency[i] = now_ns() - t;
+    }
+    long long elapsed = now_ns() - start;
+    report(name, param, value, latency, elapsed, bytes_each * n);
+}
+
+static void bench_files(int files) {
+    format();
+    char name[4];
+    std::vector<int> fh(files);
+
+    run("create", "files", files, files, 0, [&](int i) {
+        file_name(name, i);
+        create(name);
+    });
+    run("open", "files", files, files, 0, [&](int i) {
+        file_name(name, i);
+        fh[i] = open(name);
+    });
+    run("close", "files", files, files, 0, [&](int i) { close(fh[i]); });
+    run("destroy", "files", files, files, 0, [&](int i) {
+        file_name(name, i);
+        destroy(name);
+    });
+}
+
+// Whole small files: write each one from its creation to its close, then
+// read each one back from its open to its close.
+static void bench_small_files(char *buff) {
+    format();
+    char name[4];
+    run("small_write", "size", SMALL_FILE_BYTES, SMALL_FILES, SMALL_FILE_BYTES,
+        [&](int i) {
+            file_name(name, i);
+            create(name);
+            int fh = open(name);
+            write(fh, buff, SMALL_FILE_BYTES);
+            close(fh);
+        });
+    run("small_read", "size", SMALL_FILE_BYTES, SMALL_FILES, SMALL_FILE_BYTES,
+        [&](int i) {
+            file_name(name, i);
+            int fh = open(name);
+            read(fh, buff, SMALL_FILE_BYTES);
+            close(fh);
+        });
+}
+
+static void bench_io(int size, char *buff) {
+    format();
+    create("io");
+    int fh = open("io");
+    const int n = FILE_BYTES / size;
+    const int ops = n < RANDOM_OPS ? n : RANDOM_OPS;
+    unsigned int seed = 1;
+
+    run("seq_write", "size", size, n, size,
+        [&](int) { write(fh, buff, size); });
+    seek(fh, 0);
+    run("seq_read", "size", size, n, size, [&](int) { read(fh, buff, size); });
+
+    // Random aligned offsets, the seek is part of the operation
+    run("rand_write", "size", size, ops, size, [&](int) {
+        seek(fh, rand_r(&seed) % n * size);
+        write(fh, buff, size);
+    });
+    run("rand_read", "size", size, ops, size, [&](int) {
+        seek(fh, rand_r(&seed) % n * size);
+        read(fh, buff, size);
+    });
+
+    close(fh);
+}
+
+// Allocate the blocks of a file up front, append to it, then cut it back to
+// nothing.
+static void bench_prealloc(char *buff) {
+    format();
+    create("pa");
+    int fh = open("pa");
+    run("fallocate", "file_bytes", FILE_BYTES, 1, FILE_BYTES,
+        [&](int) { fallocate(fh, 0, FILE_BYTES); });
+    run("prealloc_write", "size", APPEND_SIZE, FILE_BYTES / APPEND_SIZE,
+        APPEND_SIZE, [&](int) { write(fh, buff, APPEND_SIZE); });
+    run("truncate", "file_bytes", FILE_BYTES, 1, 0,
+        [&](int) { truncate(fh, 0); });
+    close(fh);
+}
+
+// Clone a file, against copying it through read() and write(), then write
+// over each clone once, copying its shared blocks.
+static void bench_clone(char *buff) {
+    format();
+    create("src");
+    int fh = open("src");
+    for (int i = 0; i < FILE_BYTES / (1 << 20); ++i) write(fh, buff, 1 << 20);
+    close(fh);
+
+    char name[4];
+    run("clone", "file_bytes", FILE_BYTES, CLONES, FILE_BYTES, [&](int i) {
+        file_name(name, i);
+        FS_clone("src", name);
+    });
+    run("copy", "file_bytes", FILE_BYTES, 1, FILE_BYTES, [&](int) {
+        create("cp");
+        int from = open("src"), to = open("cp");
+        for (int n; (n = read(from, buff, 1 << 20)) > 0;) write(to, buff, n);
+        close(from);
+        close(to);
+    });
+    run("cow_write", "size", 1 << 20, CLONES, 1 << 20, [&](int i) {
+        file_name(name, i);
+        int fh = open(name);
+        write(fh, buff, 1 << 20);
+        close(fh);
+    });
+}
+
+// Write and read a file of text-like data compressed, then the same without
+// compression, and report how many blocks each took.
+static void bench_compress() {
+    std::vector<char> text(1 << 20);
+    unsigned int seed = 1;
+    char words[TEXT_WORDS][8];
+    for (auto &w : words) {
+        int len = 2 + rand_r(&seed) % 6;
+        for (int i = 0; i < len; ++i) w[i] = 'a' + rand_r(&seed) % 26;
+        w[len] = '\0';
+    }
+    for (size_t i = 0; i < text.size();) {
+        for (const char *w = words[rand_r(&seed) % TEXT_WORDS];
+             *w && i < text.size(); ++w) {
+            text[i++] = *w;
+        }
+        if (i < text.size()) text[i++] = ' ';
+    }
+
+    for (int on = 1; on >= 0; --on) {
+        format();
+        FS_set_compression(on);
+        create("cz");
+        FS_set_compression(0);
+        int fh = open("cz");
+        const int n = FILE_BYTES / text.size();
+        run(on ? "compressed_write" : "text_write", "size", text.size(), n,
+            text.size(), [&](int) { write(fh, text.data(), text.size()); });
+        seek(fh, 0);
+        run(on ? "compressed_read" : "text_read", "size", text.size(), n,
+            text.size(), [&](int) { read(fh, text.data(), text.size()); });
+        close(fh);
+
+        FS_FSCK_T r;
+        FS_close();
+        FS_fsck(0, 0, &r);
+        fprintf(json, ",\n    {\"name\": \"%s\", \"file_bytes\": %d, ",
+                on ? "compressed_blocks" : "text_blocks", FILE_BYTES);
+        fprintf(json, "\"blocks\": %lld}", r.blocks);
+    }
+}
+
+// Write and read a file whose every MB repeats the same half MB after half
+// a MB of new data, with deduplication on and then off, and report the
+// dedup ratio and how many blocks each took.
+static void bench_dedup() {
+    const size_t chunk = 1 << 20;
+    const int n = FILE_BYTES / chunk;
+    // The whole file is built beforehand, so the runs time write() alone
+    std::vector<char> data((size_t)n * chunk);
+    unsigned int seed = 1, fill = 2;
+    for (size_t i = chunk / 2; i < chunk; ++i) data[i] = rand_r(&seed);
+    for (int k = 0; k < n; ++k) {
+        char *p = data.data() + (size_t)k * chunk;
+        for (size_t i = 0; i < chunk / 2; ++i) p[i] = rand_r(&fill);
+        if (k > 0) memcpy(p + chunk / 2, data.data() + chunk / 2, chunk / 2);
+    }
+
+    for (int on = 1; on >= 0; --on) {
+        format();
+        FS_set_dedup(on);
+        create("dp");
+        int fh = open("dp");
+        run(on ? "dedup_write" : "plain_write", "size", chunk, n, chunk,
+            [&](int i) {
+                write(fh, data.data() + (size_t)i * chunk, chunk);
+            });
+        seek(fh, 0);
+        run(on ? "dedup_read" : "plain_read", "size", chunk, n, chunk,
+            [&](int i) {
+                read(fh, data.data() + (size_t)i * chunk, chunk);
+            });
+        close(fh);
+
+        FS_DEDUP_T stats;
+        FS_dedup_stats(&stats);
+        FS_set_dedup(0);
+        FS_FSCK_T r;
+        FS_close();
+        FS_fsck(0, 0, &r);
+        fprintf(json, ",\n    {\"name\": \"%s\", \"file_bytes\": %d, ",
+                on ? "dedup_blocks" : "plain_blocks", FILE_BYTES);
+        fprintf(json, "\"blocks\": %lld, \"ratio\": %.2f}", r.blocks,
+                stats.ratio);
+    }
+}
+
+// Read small records at random from a span of a file through seek() and
+// read(), then through a view of FS_mmap(), and time mapping the span.
+static void bench_mmap(char *buff) {
+    format();
+    create("mm");
+    int fh = open("mm");
+    for (int i = 0; i < FILE_BYTES / (1 << 20); ++i) write(fh, buff, 1 << 20);
+    unsigned int seed = 1;
+    run("read_record", "size", RECORD_BYTES, SEEK_OPS, RECORD_BYTES,
+        [&](int) {
+            seek(fh, rand_r(&seed) % (VIEW_BYTES - RECORD_BYTES));
+            read(fh, buff, RECORD_BYTES);
+        });
+    const char *view = (const char *)FS_mmap(fh, 0, VIEW_BYTES);
+    run("mmap_record", "size", RECORD_BYTES, SEEK_OPS, RECORD_BYTES,
+        [&](int) {
+            memcpy(buff, view + rand_r(&seed) % (VIEW_BYTES - RECORD_BYTES),
+                   RECORD_BYTES);
+        });
+    FS_munmap((void *)view);
+    run("mmap", "size", VIEW_BYTES, RANDOM_OPS, 0, [&](int i) {
+        FS_munmap(FS_mmap(fh, i % (FILE_BYTES / VIEW_BYTES) * VIEW_BYTES,
+                          VIEW_BYTES));
+    });
+    close(fh);
+}
+
+// The geometry of each instance of the tenant benchmarks.
+struct TENANT_GEOMETRY {
+    static constexpr unsigned int blocks = 4096;
+    static constexpr unsigned int block_size = DISK_BLOCK_SIZE;
+    static constexpr int cache_blocks = CACHE_SIZE;
+};
+
+// Their disks, faulted in up front like the one the other benchmarks have
+// written all over.
+struct TENANT_DISK {
+    static int open(const char *, unsigned int blocks,
+                    unsigned int block_size) {
+        return disk_open(NULL, blocks, block_size, DISK_POPULATE);
+    }
+};
+
+// Write TENANT_BYTES to file name of the instance bound to the thread,
+// timing each write into latency, and return the time it all took.
+static long long tenant_write(const char *name, const char *buff,
+                              std::vector<long long> *latency) {
+    create(name);
+    int fh = open(name);
+    long long begin = now_ns();
+    for (int done = 0; done < TENANT_BYTES; done += TENANT_IO) {
+        long long start = now_ns();
+        write(fh, buff, TENANT_IO);
+        latency->push_back(now_ns() - start);
+    }
+    long long elapsed = now_ns() - begin;
+    close(fh);
+    return elapsed;
+}
+
+// TENANTS threads write TENANT_BYTES each, every thread to a file of its
+// own in the shared file system or in an instance of its own. The slowest
+// thread's writes are timed, not setting the instances up.
+static void bench_tenants(const char *buff) {
+    std::vector<std::vector<long long>> latency(TENANTS);
+    std::vector<long long> spent(TENANTS);
+    auto tenant = [&](int t, bool own) {
+        char name[4];
+        file_name(name, t);
+        if (!own) {
+            spent[t] = tenant_write(name, buff, &latency[t]);
+            return;
+        }
+        FileSystem<TENANT_GEOMETRY, TENANT_DISK> fs;
+        if (fs.init() < 0) return;
+        // Bind the thread for the C API calls of tenant_write()
+        FS_use(fs.instance());
+        spent[t] = tenant_write(name, buff, &latency[t]);
+        FS_use(NULL);
+    };
+    for (bool own : {false, true}) {
+        format();
+        for (auto &l : latency) l.clear();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < TENANTS; ++t) threads.emplace_back(tenant, t, own);
+        for (auto &t : threads) t.join();
+        long long elapsed = *std::max_element(spent.begin(), spent.end());
+        std::vector<long long> all;
+        for (auto &l : latency) all.insert(all.end(), l.begin(), l.end());
+        report(own ? "tenant_instances" : "tenant_shared", "threads",
+               TENANTS, all, elapsed, (long long)TENANTS * TENANT_BYTES);
+    }
+}
+
+// The geometry of the checksum benchmarks: room for a FILE_BYTES file.
+struct SUM_GEOMETRY {
+    static constexpr unsigned int blocks = 16384;
+    static constexpr unsigned int block_size = DISK_BLOCK_SIZE;
+    static constexpr int cache_blocks = CACHE_SIZE;
+};
+
+struct SUM_DISK {
+    static int open(const char *, unsigned int blocks,
+                    unsigned int block_size) {
+        return disk_open(NULL, blocks, block_size,
+                         DISK_POPULATE | DISK_CHECKSUMS);
+    }
+};
+
+// Write then read a FILE_BYTES file in 1 MB calls on a new instance of
+// Backend, after setting the verify policy if verify >= 0.
+template <class Backend>
+static void sum_io(const char *write_name, const char *read_name, int verify,
+                   char *buff) {
+    FileSystem<SUM_GEOMETRY, Backend> fs;
+    if (fs.init() < 0) return;
+    // Bind the thread for disk_set_verify()
+    INSTANCE_T *bound = FS_use(fs.instance());
+    if (verify >= 0) disk_set_verify(verify);
+    FS_use(bound);
+    fs.create("sum");
+    int fh = fs.open("sum");
+    const int n = FILE_BYTES / (1 << 20);
+    run(write_name, "verify", verify, n, 1 << 20,
+        [&](int) { fs.write(fh, buff, 1 << 20); });
+    fs.sync();
+    fs.seek(fh, 0);
+    run(read_name, "verify", verify, n, 1 << 20,
+        [&](int) { fs.read(fh, buff, 1 << 20); });
+    fs.close(fh);
+}
+
+// The checksum kernels against memcpy() over SUM_BYTES a block at a time,
+// then reads and writes of a file on a disk without checksums and on one
+// with them under each verify policy ("verify" -1 is the plain disk).
+static void bench_checksum(char *buff) {
+    char *copy = new char[SUM_BYTES];
+    volatile uint32_t sink = 0;
+    auto blocks = [&](auto op) {
+        for (int off = 0; off < SUM_BYTES; off += DISK_BLOCK_SIZE) op(off);
+    };
+    run("memcpy", "size", DISK_BLOCK_SIZE, SUM_ROUNDS, SUM_BYTES, [&](int) {
+        blocks([&](int off) {
+            memcpy(copy + off, buff + off, DISK_BLOCK_SIZE);
+        });
+    });
+    run("crc32c", "size", DISK_BLOCK_SIZE, SUM_ROUNDS, SUM_BYTES, [&](int) {
+        blocks([&](int off) { sink = crc32c(0, buff + off, DISK_BLOCK_SIZE); });
+    });
+    run("crc32c_copy", "size", DISK_BLOCK_SIZE, SUM_ROUNDS, SUM_BYTES,
+        [&](int) {
+            blocks([&](int off) {
+                sink = crc32c_copy(0, copy + off, buff + off, DISK_BLOCK_SIZE);
+            });
+        });
+    run("crc32c_table", "size", DISK_BLOCK_SIZE, SUM_ROUNDS, SUM_BYTES,
+        [&](int) {
+            blocks([&](int off) {
+                sink = crc32c_table(0, buff + off, DISK_BLOCK_SIZE);
+            });
+        });
+    (void)sink;
+    delete[] copy;
+
+    sum_io<TENANT_DISK>("nosum_write", "nosum_read", -1, buff);
+    for (int verify : {DISK_VERIFY_OFF, DISK_VERIFY_SAMPLED,
+                       DISK_VERIFY_ALWAYS, DISK_VERIFY_FIRST})
+        sum_io<SUM_DISK>("sum_write", "sum_read", verify, buff);
+}
+
+static void bench_seek(char *buff) {
+    format();
+    create("sk");
+    int fh = open("sk");
+    for (int i = 0; i < FILE_BYTES / (1 << 20); ++i) write(fh, buff, 1 << 20);
+    unsigned int seed = 1;
+    run("seek", "file_bytes", FILE_BYTES, SEEK_OPS, 0,
+        [&](int) { seek(fh, rand_r(&seed) % FILE_BYTES); });
+    close(fh);
+}
+
+static void bench_directory() {
+    format();
+    char name[4];
+    for (int i = 0; i < LISTING_FILES; ++i) {
+        file_name(name, i);
+        create(name);
+    }
+    // directory() prints to stdout, which main() sent to /dev/null
+    run("directory", "files", LISTING_FILES, LISTINGS, 0,
+        [&](int) { directory(); });
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "/dev/stdout";
+    if (argc == 3 && strcmp(argv[1], "-o") == 0) {
+        path = argv[2];
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-o <json file>]\n", argv[0]);
+        return 1;
+    }
+
+    // Keep the report apart from what directory() prints
+    json = fopen(path, "w");
+    if (!json || !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+
+    if (disk_open(NULL, DISK_BLOCKS, DISK_BLOCK_SIZE, 0) < 0 ||
+        FS_set_cache_size(CACHE_SIZE) < 0) {
+        fprintf(stderr, "cannot set up the disk\n");
+        return 1;
+    }
+
+    char *buff = new char[1 << 20];
+    for (int i = 0; i < (1 << 20); ++i) buff[i] = (char)i;
+
+    fprintf(json, "{\n  \"blocks\": %d, \"block_size\": %d, ",
+            DISK_BLOCKS, DISK_BLOCK_SIZE);
+    fprintf(json, "\"cache_blocks\": %d,\n  \"results\": [", CACHE_SIZE);
+    for (int files : file_counts) bench_files(files);
+    bench_small_files(buff);
+    for (int size : io_sizes) bench_io(size, buff);
+    bench_prealloc(buff);
+    bench_clone(buff);
+    bench_compress();
+    bench_dedup();
+    bench_mmap(buff);
+    bench_tenants(buff);
+    bench_checksum(buff);
+    bench_seek(buff);
+    bench_directory();
+    fprintf(json, "\n  ]\n}\n");
+
+    FS_close();
+    disk_close();
+    delete[] buff;
+    fclose(json);
+    return 0;
+}
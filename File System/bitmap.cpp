@@ -0,0 +1,156 @@
+#include "bitmap.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "the bitmap is shared with byte-wise on-disk bitmaps");
+
+// Word i, read atomically as other threads may be updating it. A plain
+// load on every target we build for.
+static inline uint64_t word(const uint64_t *words, int i) {
+    return __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+}
+
+// Index of the first word in [i, end_word) that is not all ones, or
+// end_word. Whole vectors of full words are skipped at once.
+static int skip_full_words(const uint64_t *words, int i, int end_word) {
+#if defined(__AVX2__)
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    for (; i + 4 <= end_word; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+        if (!_mm256_testc_si256(v, ones)) break;
+    }
+#elif defined(__SSE4_1__)
+    for (; i + 2 <= end_word; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+        if (!_mm_test_all_ones(v)) break;
+    }
+#endif
+    while (i < end_word && word(words, i) == ~0ULL) ++i;
+    return i;
+}
+
+// Index of the first word in [i, end_word) that is not zero, or end_word.
+static int skip_empty_words(const uint64_t *words, int i, int end_word) {
+#if defined(__AVX2__)
+    for (; i + 4 <= end_word; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+        if (!_mm256_testz_si256(v, v)) break;
+    }
+#elif defined(__SSE4_1__)
+    for (; i + 2 <= end_word; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+        if (!_mm_testz_si128(v, v)) break;
+    }
+#endif
+    while (i < end_word && word(words, i) == 0) ++i;
+    return i;
+}
+
+// Mask of the bits [first, first + n) of a word, 0 <= first < 64.
+static inline uint64_t range_mask(int first, int n) {
+    uint64_t m = n >= 64 ? ~0ULL : ((1ULL << n) - 1);
+    return m << first;
+}
+
+int bitmap_find_zero(const uint64_t *words, int begin, int end) {
+    if (begin >= end) return -1;
+    int i = begin / 64;
+    uint64_t x = ~word(words, i) & (~0ULL << (begin % 64));
+    const int end_word = (end + 63) / 64;
+    while (!x) {
+        i = skip_full_words(words, i + 1, end_word);
+        if (i >= end_word) return -1;
+        x = ~word(words, i);
+    }
+    int b = i * 64 + __builtin_ctzll(x);
+    return b < end ? b : -1;
+}
+
+int bitmap_find_one(const uint64_t *words, int begin, int end) {
+    if (begin >= end) return -1;
+    int i = begin / 64;
+    uint64_t x = word(words, i) & (~0ULL << (begin % 64));
+    const int end_word = (end + 63) / 64;
+    while (!x) {
+        i = skip_empty_words(words, i + 1, end_word);
+        if (i >= end_word) return -1;
+        x = word(words, i);
+    }
+    int b = i * 64 + __builtin_ctzll(x);
+    return b < end ? b : -1;
+}
+
+int bitmap_find_run(const uint64_t *words, int begin, int end, int n) {
+    if (n <= 0) return -1;
+    for (int b = begin;;) {
+        b = bitmap_find_zero(words, b, end);
+        if (b < 0 || b + n > end) return -1;
+        // Only the next n bits matter
+        int e = bitmap_find_one(words, b, b + n);
+        if (e < 0) return b;
+        b = e;
+    }
+}
+
+void bitmap_set_range(uint64_t *words, int first, int n) {
+    while (n > 0) {
+        int off = first % 64, len = 64 - off < n ? 64 - off : n;
+        __atomic_fetch_or(&words[first / 64], range_mask(off, len),
+                          __ATOMIC_ACQ_REL);
+        first += len;
+        n -= len;
+    }
+}
+
+void bitmap_clear_range(uint64_t *words, int first, int n) {
+    while (n > 0) {
+        int off = first % 64, len = 64 - off < n ? 64 - off : n;
+        __atomic_fetch_and(&words[first / 64], ~range_mask(off, len),
+                           __ATOMIC_ACQ_REL);
+        first += len;
+        n -= len;
+    }
+}
+
+int bitmap_test(const uint64_t *words, int b) {
+    return (word(words, b / 64) >> (b % 64)) & 1;
+}
+
+int bitmap_test_and_set(uint64_t *words, int b) {
+    uint64_t bit = 1ULL << (b % 64);
+    return (__atomic_fetch_or(&words[b / 64], bit, __ATOMIC_ACQ_REL) & bit) !=
+           0;
+}
+
+int bitmap_claim_range(uint64_t *words, int first, int n) {
+    for (int b = first, left = n; left > 0;) {
+        int off = b % 64, len = 64 - off < left ? 64 - off : left;
+        uint64_t m = range_mask(off, len);
+        uint64_t old = __atomic_load_n(&words[b / 64], __ATOMIC_RELAXED);
+        do {
+            if (old & m) {
+                // Lost a race, give back the words claimed so far
+                bitmap_clear_range(words, first, b - first);
+                return 0;
+            }
+        } while (!__atomic_compare_exchange_n(&words[b / 64], &old, old | m,
+                                              true, __ATOMIC_ACQ_REL,
+                                              __ATOMIC_RELAXED));
+        b += len;
+        left -= len;
+    }
+    return 1;
+}
+
+int bitmap_count(const uint64_t *words, int nbits) {
+    int count = 0;
+    for (int i = 0; i < nbits / 64; ++i) {
+        count += __builtin_popcountll(words[i]);
+    }
+    return count;
+}
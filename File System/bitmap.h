@@ -0,0 +1,33 @@
+#pragma once
+
+#ifndef _BITMAP_H_
+#define _BITMAP_H_
+
+#include <cstdint>
+
+// Bitmaps of nbits bits stored in 64-bit words, bit i is bit i % 64 of
+// word i / 64. nbits must be a multiple of 64. A set bit means occupied.
+// The searches return -1 if nothing is found.
+
+// First clear bit in [begin, end).
+int bitmap_find_zero(const uint64_t *words, int begin, int end);
+// First set bit in [begin, end).
+int bitmap_find_one(const uint64_t *words, int begin, int end);
+// First run of n clear bits starting in [begin, end) and ending before end.
+int bitmap_find_run(const uint64_t *words, int begin, int end, int n);
+
+// The updates are atomic per word, so threads may change different bits of
+// the same word at once. The searches may see a word mid-update, a found bit
+// is only a candidate until it is claimed.
+void bitmap_set_range(uint64_t *words, int first, int n);
+void bitmap_clear_range(uint64_t *words, int first, int n);
+int bitmap_test(const uint64_t *words, int b);
+// Set bit b and return its old value.
+int bitmap_test_and_set(uint64_t *words, int b);
+// Set the bits [first, first + n) if all of them are clear and return 1,
+// otherwise change nothing and return 0.
+int bitmap_claim_range(uint64_t *words, int first, int n);
+// Number of set bits in [0, nbits).
+int bitmap_count(const uint64_t *words, int nbits);
+
+#endif  //_BITMAP_H_
@@ -0,0 +1,435 @@
+#include "cache.h"
+#include <algorithm>
+#include <cstring>
+
+#include "instance.h"
+#include "lock.h"
+#include "stats.h"
+
+#if (THREAD_SAFE)
+#include <condition_variable>
+#include <thread>
+#endif
+
+#define NO_ENTRY -1
+
+#define CACHE_SHARDS 16          // most shards
+#define CACHE_SHARD_BLOCKS 64    // fewest blocks in a shard
+#define PREFETCH_RUNS 64         // runs waiting to be prefetched
+
+struct CACHE_ENTRY_T {
+    int block;  // -1 if the entry is unused
+    int pins;
+    int holds;  // cache_hold() calls not released yet
+    int owner;  // who dirtied the block
+    int next;   // next entry in the same hash bucket
+    bool dirty, referenced;
+};
+
+// Block b lives in shard b % shards, each shard is a CLOCK cache of its own
+// with its own lock, so threads working on different blocks rarely meet.
+struct SHARD_T {
+    MUTEX_T lock;
+    CACHE_ENTRY_T *entry;
+    byte *data;  // capacity buffers of block_size bytes
+    int *bucket;
+    int capacity;
+    unsigned int buckets;  // a power of two
+    int hand;              // CLOCK hand
+};
+
+#if (THREAD_SAFE)
+// Runs of blocks waiting to be read into the cache by a background thread.
+// New runs are dropped while the queue is full, readahead is only a hint.
+struct PREFETCHER_T {
+    MUTEX_T lock;
+    std::condition_variable wake;
+    std::thread thread;
+    int first[PREFETCH_RUNS], count[PREFETCH_RUNS];
+    int head, size;  // a ring of size runs from head
+    bool stop;
+
+    ~PREFETCHER_T();
+};
+#endif
+
+// The cache of an instance.
+struct CACHE_T {
+#if (THREAD_SAFE)
+    PREFETCHER_T prefetcher;
+#endif
+    SHARD_T *SHARD;
+    int shards;  // a power of two
+    int capacity;
+    int block_size;
+};
+
+static inline SHARD_T *shard_of(int b) {
+    CACHE_T *cache = instance->cache;
+    return &cache->SHARD[(unsigned int)b & (cache->shards - 1)];
+}
+
+static inline byte *entry_data(SHARD_T *s, int e) {
+    CACHE_T *cache = instance->cache;
+    return s->data + (size_t)e * cache->block_size;
+}
+
+static inline unsigned int bucket_of(SHARD_T *s, int b) {
+    return ((unsigned int)b * 2654435761u) & (s->buckets - 1);
+}
+
+static int find(SHARD_T *s, int b) {
+    for (int e = s->bucket[bucket_of(s, b)]; e != NO_ENTRY;
+         e = s->entry[e].next) {
+        if (s->entry[e].block == b) return e;
+    }
+    return NO_ENTRY;
+}
+
+// Make the unused entry e hold block b.
+static void link(SHARD_T *s, int e, int b) {
+    s->entry[e].block = b;
+    s->entry[e].next = s->bucket[bucket_of(s, b)];
+    s->bucket[bucket_of(s, b)] = e;
+}
+
+static void unlink(SHARD_T *s, int e) {
+    int *p = &s->bucket[bucket_of(s, s->entry[e].block)];
+    while (*p != e) p = &s->entry[*p].next;
+    *p = s->entry[e].next;
+    s->entry[e].block = -1;
+    s->entry[e].holds = 0;
+    s->entry[e].dirty = false;
+}
+
+// Find an unpinned entry to reuse, writing it back if it is dirty.
+static int evict(SHARD_T *s) {
+    // Two sweeps clear every reference bit
+    for (int i = 0; i < 2 * s->capacity + 1; ++i) {
+        int e = s->hand;
+        s->hand = (s->hand + 1) % s->capacity;
+
+        CACHE_ENTRY_T *entry = &s->entry[e];
+        if (entry->pins || entry->holds) continue;
+        if (entry->block < 0) return e;
+        if (entry->referenced) {
+            entry->referenced = false;
+            continue;
+        }
+
+        if (entry->dirty) write_block(entry->block, entry_data(s, e));
+        unlink(s, e);
+        return e;
+    }
+    return NO_ENTRY;
+}
+
+#if (THREAD_SAFE)
+// Read block b into the cache unless it is there, without pinning it.
+static void prefetch(int b) {
+    SHARD_T *s = shard_of(b);
+    LOCK_T guard(s->lock);
+    if (find(s, b) != NO_ENTRY) return;
+    int e = evict(s);
+    if (e == NO_ENTRY || read_block(b, entry_data(s, e)) < 0) return;
+    link(s, e, b);
+    s->entry[e].referenced = true;
+}
+
+// The prefetch thread of the cache of instance i.
+static void prefetch_loop(INSTANCE_T *i) {
+    instance = i;
+    PREFETCHER_T &prefetcher = i->cache->prefetcher;
+    UNIQUE_LOCK_T lock(prefetcher.lock);
+    for (;;) {
+        prefetcher.wake.wait(
+            lock, [&] { return prefetcher.stop || prefetcher.size > 0; });
+        if (prefetcher.stop) return;
+        int b = prefetcher.first[prefetcher.head];
+        int n = prefetcher.count[prefetcher.head];
+        prefetcher.head = (prefetcher.head + 1) % PREFETCH_RUNS;
+        --prefetcher.size;
+
+        lock.unlock();
+        for (int i = 0; i < n; ++i) prefetch(b + i);
+        lock.lock();
+    }
+}
+
+// Stop the prefetch thread, dropping the runs not read yet.
+static void stop_prefetcher(PREFETCHER_T *prefetcher) {
+    if (!prefetcher->thread.joinable()) return;
+    {
+        LOCK_T guard(prefetcher->lock);
+        prefetcher->stop = true;
+    }
+    prefetcher->wake.notify_one();
+    prefetcher->thread.join();
+    prefetcher->stop = false;
+    prefetcher->head = prefetcher->size = 0;
+}
+
+PREFETCHER_T::~PREFETCHER_T() { stop_prefetcher(this); }
+#endif
+
+static void free_shards(CACHE_T *cache) {
+#if (THREAD_SAFE)
+    stop_prefetcher(&cache->prefetcher);
+#endif
+    for (int i = 0; i < cache->shards; ++i) {
+        delete[] cache->SHARD[i].entry;
+        delete[] cache->SHARD[i].data;
+        delete[] cache->SHARD[i].bucket;
+    }
+    delete[] cache->SHARD;
+    cache->SHARD = NULL;
+    cache->shards = 0;
+}
+
+CACHE_T *cache_new() { return new CACHE_T(); }
+
+void cache_delete(CACHE_T *cache) {
+    free_shards(cache);
+    delete cache;
+}
+
+int cache_init(int n) {
+    CACHE_T *cache = instance->cache;
+    if (n < 1 || disk_block_size() == 0) return -1;
+
+    free_shards(cache);
+
+    cache->capacity = n;
+    cache->block_size = disk_block_size();
+    cache->shards = 1;
+    while (cache->shards < CACHE_SHARDS &&
+           n / (cache->shards * 2) >= CACHE_SHARD_BLOCKS) {
+        cache->shards *= 2;
+    }
+
+    cache->SHARD = new SHARD_T[cache->shards];
+    for (int i = 0; i < cache->shards; ++i) {
+        SHARD_T *s = &cache->SHARD[i];
+        // Spread the remainder over the first shards
+        s->capacity = n / cache->shards + (i < n % cache->shards);
+        s->buckets = 1;
+        while (s->buckets < 2u * s->capacity) s->buckets *= 2;
+        s->entry = new CACHE_ENTRY_T[s->capacity];
+        s->data = new byte[(size_t)s->capacity * cache->block_size];
+        s->bucket = new int[s->buckets];
+        for (int e = 0; e < s->capacity; ++e) {
+            s->entry[e].block = -1;
+            s->entry[e].pins = s->entry[e].holds = 0;
+            s->entry[e].owner = CACHE_NO_OWNER;
+            s->entry[e].next = NO_ENTRY;
+            s->entry[e].dirty = s->entry[e].referenced = false;
+        }
+        for (unsigned int j = 0; j < s->buckets; ++j) s->bucket[j] = NO_ENTRY;
+        s->hand = 0;
+    }
+    return 0;
+}
+
+int cache_close() {
+    CACHE_T *cache = instance->cache;
+    if (!cache->SHARD) return -1;
+    cache_flush();
+    free_shards(cache);
+    cache->capacity = 0;
+    return 0;
+}
+
+byte *cache_get(int b, int flags) {
+    if (b < 0 || (unsigned int)b >= disk_blocks()) return NULL;
+
+    SHARD_T *s = shard_of(b);
+    LOCK_T guard(s->lock);
+    int e = find(s, b);
+    if (e == NO_ENTRY) {
+        STAT_COUNT(STAT_CACHE_MISS);
+        if ((e = evict(s)) == NO_ENTRY) return NULL;
+        // A block failing its checksum is not cached, the entry stays free
+        if (!(flags & CACHE_NOREAD) && read_block(b, entry_data(s, e)) < 0) {
+            return NULL;
+        }
+        link(s, e, b);
+    } else {
+        STAT_COUNT(STAT_CACHE_HIT);
+    }
+    ++s->entry[e].pins;
+    s->entry[e].referenced = true;
+    return entry_data(s, e);
+}
+
+void cache_prefetch(int b, int n) {
+#if (THREAD_SAFE)
+    CACHE_T *cache = instance->cache;
+    if (!cache->SHARD || b < 0 || n <= 0 ||
+        (unsigned int)(b + n) > disk_blocks()) {
+        return;
+    }
+    PREFETCHER_T &prefetcher = cache->prefetcher;
+    {
+        LOCK_T guard(prefetcher.lock);
+        if (!prefetcher.thread.joinable()) {
+            prefetcher.thread = std::thread(prefetch_loop, instance);
+        }
+        if (prefetcher.size == PREFETCH_RUNS) return;
+        int i = (prefetcher.head + prefetcher.size++) % PREFETCH_RUNS;
+        prefetcher.first[i] = b;
+        prefetcher.count[i] = n;
+    }
+    prefetcher.wake.notify_one();
+#else
+    (void)b;
+    (void)n;
+#endif
+}
+
+void cache_put(int b, int dirty, int owner) {
+    SHARD_T *s = shard_of(b);
+    LOCK_T guard(s->lock);
+    int e = find(s, b);
+    if (e == NO_ENTRY) return;
+    if (s->entry[e].pins > 0) --s->entry[e].pins;
+    if (dirty) {
+        s->entry[e].dirty = true;
+        s->entry[e].owner = owner;
+    }
+}
+
+int cache_read_direct(int b, int n, byte *buff) {
+    CACHE_T *cache = instance->cache;
+    if (b < 0 || n < 0 || (unsigned int)(b + n) > disk_blocks()) return -1;
+
+    int result = 0;
+    for (int i = 0; i < n; ++i, buff += cache->block_size) {
+        SHARD_T *s = shard_of(b + i);
+        LOCK_T guard(s->lock);
+        int e = find(s, b + i);
+        if (e != NO_ENTRY) {
+            STAT_COUNT(STAT_CACHE_HIT);
+            memcpy(buff, entry_data(s, e), cache->block_size);
+        } else {
+            STAT_COUNT(STAT_CACHE_MISS);
+            if (read_block(b + i, buff) < 0) result = DISK_BAD_CHECKSUM;
+        }
+    }
+    return result;
+}
+
+int cache_write_direct(int b, int n, const byte *buff) {
+    CACHE_T *cache = instance->cache;
+    if (b < 0 || n < 0 || (unsigned int)(b + n) > disk_blocks()) return -1;
+
+    for (int i = 0; i < n; ++i, buff += cache->block_size) {
+        SHARD_T *s = shard_of(b + i);
+        LOCK_T guard(s->lock);
+        int e = find(s, b + i);
+        if (e != NO_ENTRY) {
+            // The cached copy matches the disk again
+            memcpy(entry_data(s, e), buff, cache->block_size);
+            s->entry[e].dirty = false;
+        }
+        write_block(b + i, buff);
+    }
+    return 0;
+}
+
+int cache_write_home(int b, const byte *buff) {
+    CACHE_T *cache = instance->cache;
+    if (!cache->SHARD) return write_block(b, buff);
+    SHARD_T *s = shard_of(b);
+    LOCK_T guard(s->lock);
+    return write_block(b, buff);
+}
+
+int cache_hold(int b) {
+    SHARD_T *s = shard_of(b);
+    LOCK_T guard(s->lock);
+    int e = find(s, b);
+    if (e == NO_ENTRY) return -1;
+    ++s->entry[e].holds;
+    return 0;
+}
+
+void cache_release(int b) {
+    SHARD_T *s = shard_of(b);
+    LOCK_T guard(s->lock);
+    int e = find(s, b);
+    if (e != NO_ENTRY && s->entry[e].holds > 0) --s->entry[e].holds;
+}
+
+int cache_copy(int b, byte *buff) {
+    CACHE_T *cache = instance->cache;
+    SHARD_T *s = shard_of(b);
+    LOCK_T guard(s->lock);
+    int e = find(s, b);
+    if (e == NO_ENTRY) return -1;
+    memcpy(buff, entry_data(s, e), cache->block_size);
+    return 0;
+}
+
+void cache_invalidate(int b) {
+    SHARD_T *s = shard_of(b);
+    LOCK_T guard(s->lock);
+    int e = find(s, b);
+    if (e != NO_ENTRY && s->entry[e].pins == 0 && s->entry[e].holds == 0) {
+        unlink(s, e);
+    }
+}
+
+int cache_evict(int b) {
+    SHARD_T *s = shard_of(b);
+    LOCK_T guard(s->lock);
+    int e = find(s, b);
+    if (e == NO_ENTRY) return 0;
+    CACHE_ENTRY_T *entry = &s->entry[e];
+    if (entry->pins || entry->holds) return -1;
+    if (entry->dirty) write_block(b, entry_data(s, e));
+    unlink(s, e);
+    return 0;
+}
+
+// Write back the dirty blocks of owner, or all if owner is NO_ENTRY. Held
+// blocks are left alone, the journal writes them.
+static int flush(int owner) {
+    CACHE_T *cache = instance->cache;
+    // Hold every shard, in shard order, so the dirty blocks of all of them
+    // are written in one pass
+    for (int i = 0; i < cache->shards; ++i) cache->SHARD[i].lock.lock();
+
+    std::pair<int, CACHE_ENTRY_T *> *dirty =
+        new std::pair<int, CACHE_ENTRY_T *>[cache->capacity];
+    int n = 0;
+    for (int i = 0; i < cache->shards; ++i) {
+        SHARD_T *s = &cache->SHARD[i];
+        for (int e = 0; e < s->capacity; ++e) {
+            if (s->entry[e].block >= 0 && s->entry[e].dirty &&
+                s->entry[e].holds == 0 &&
+                (owner == NO_ENTRY || s->entry[e].owner == owner)) {
+                dirty[n++] = std::make_pair(s->entry[e].block, &s->entry[e]);
+            }
+        }
+    }
+    // Write in block order so the disk sees one sequential pass
+    std::sort(dirty, dirty + n);
+    for (int i = 0; i < n; ++i) {
+        SHARD_T *s = shard_of(dirty[i].first);
+        write_block(dirty[i].first, entry_data(s, dirty[i].second - s->entry));
+        dirty[i].second->dirty = false;
+    }
+    delete[] dirty;
+
+    for (int i = cache->shards - 1; i >= 0; --i) {
+        cache->SHARD[i].lock.unlock();
+    }
+    return n;
+}
+
+int cache_flush() { return flush(NO_ENTRY); }
+
+int cache_flush_owner(int owner) {
+    if (owner == NO_ENTRY) return 0;
+    return flush(owner);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "disk.h"
+
+#define CACHE_BLOCKS 256  // default capacity in blocks
+
+// cache_get() flags
+#define CACHE_NOREAD 0x1  // the caller overwrites the whole block
+
+#define CACHE_NO_OWNER -1
+
+// Write-back cache of disk blocks shared by all open files. Blocks are
+// pinned while in use and evicted with the CLOCK algorithm; dirty blocks
+// reach the disk on eviction or on cache_flush(). The cache is split into
+// shards with a lock each, every function may be called from any thread.
+// A pinned buffer is not locked: writers of the same block must serialize
+// themselves.
+
+// Drop the current cache (without writing it back) and create an empty one
+// of capacity blocks for the opened disk.
+int cache_init(int capacity);
+// Write back dirty blocks and free the cache.
+int cache_close();
+
+// Pin block b and return its buffer, or NULL if b is not on the disk, fails
+// its checksum (disk.h) or every buffer is pinned.
+byte *cache_get(int b, int flags);
+// Ask a background thread to read the blocks [b, b + n) into the cache.
+// Returns at once; the request may be dropped when too many are queued.
+// Does nothing when built without THREAD_SAFE.
+void cache_prefetch(int b, int n);
+// Unpin block b. If it was modified it is marked dirty and tagged with
+// owner (e.g. a descriptor) for cache_flush_owner().
+void cache_put(int b, int dirty, int owner);
+// Copy the blocks [b, b + n) to buff, from the cache where they are cached
+// and straight from the disk otherwise, without caching them. Return
+// DISK_BAD_CHECKSUM if a block read from the disk failed its checksum.
+int cache_read_direct(int b, int n, byte *buff);
+// Write the blocks [b, b + n) straight to the disk, updating cached copies.
+int cache_write_direct(int b, int n, const byte *buff);
+// Write buff to block b on the disk, leaving a cached copy as it is. No
+// read or write-back of b by the cache runs at the same time.
+int cache_write_home(int b, const byte *buff);
+// Keep block b, which the caller has pinned, in the cache and out of
+// cache_flush() until as many cache_release(b) calls. Return -1 if b is not
+// cached.
+int cache_hold(int b);
+void cache_release(int b);
+// Copy block b to buff if it is cached, return -1 if it is not.
+int cache_copy(int b, byte *buff);
+// Forget block b without writing it back, e.g. after it was freed.
+void cache_invalidate(int b);
+// Write block b back if it is dirty and forget it. Return -1 if it is
+// pinned or held and stays.
+int cache_evict(int b);
+// Write all dirty blocks back in block order, return how many.
+int cache_flush();
+// Write the dirty blocks tagged with owner back in block order.
+int cache_flush_owner(int owner);
+
+#endif  //_CACHE_H_
@@ -0,0 +1,273 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "FS.h"
+#include "disk.h"
+
+// Regression tests of the ways a disk can go wrong: crashes in the middle
+// of journaling and blocks damaged behind the file system's back. Each test
+// works on an image file of its own, FS-check-<name>.img, prints "ok <name>"
+// or "FAIL <name>: <what>", and the exit status is the number of failed
+// tests. A test crashing a file system runs its first half in another
+// FS-check, given the test's name, which dies without closing.
+//
+// FS-check [<test>]
+
+#define DISK_BLOCKS 4096
+#define DISK_BLOCK_SIZE 512
+#define DIRS 4
+#define FILES_PER_DIR 32
+#define FILE_BYTES 1500  // a few blocks, so every fsync logs a bitmap block
+
+static int failed;
+
+static void fail(const char *test, const char *what) {
+    printf("FAIL %s: %s\n", test, what);
+    ++failed;
+}
+
+// The image file of test.
+static void image_path(char *path, const char *test) {
+    sprintf(path, "FS-check-%s.img", test);
+}
+
+// The byte at pos of file k, different in every file.
+static inline char pattern(int k, int pos) { return (char)(k * 31 + pos); }
+
+static void file_path(char *path, int k) {
+    sprintf(path, "d%d/f%d", k % DIRS, k / DIRS);
+}
+
+// Write file k of the pattern and fsync it, return 0 on success.
+static int write_file(int k) {
+    char path[32], buff[FILE_BYTES];
+    file_path(path, k);
+    for (int i = 0; i < FILE_BYTES; ++i) buff[i] = pattern(k, i);
+    if (create(path) < 0) return -1;
+    int fh = open(path);
+    if (fh < 0) return -1;
+    bool ok = write(fh, buff, FILE_BYTES) == FILE_BYTES && FS_fsync(fh) == 0;
+    close(fh);
+    return ok ? 0 : -1;
+}
+
+// Whether file k is there with the pattern.
+static bool file_ok(int k) {
+    char path[32], buff[FILE_BYTES];
+    file_path(path, k);
+    int fh = open(path);
+    if (fh < 0) return false;
+    bool ok = read(fh, buff, FILE_BYTES) == FILE_BYTES;
+    for (int i = 0; ok && i < FILE_BYTES; ++i) ok = buff[i] == pattern(k, i);
+    close(fh);
+    return ok;
+}
+
+// Format the image with checksums and write the files [0, files), return
+// 0 on success. The file system is unmounted and the disk closed.
+static int write_files(const char *image, int files) {
+    if (disk_open(image, DISK_BLOCKS, DISK_BLOCK_SIZE, DISK_CHECKSUMS) < 0) {
+        return -1;
+    }
+    int result = FS_init();
+    char dir[8];
+    for (int d = 0; result == 0 && d < DIRS; ++d) {
+        sprintf(dir, "d%d", d);
+        result = mkdir(dir);
+    }
+    for (int k = 0; result == 0 && k < files; ++k) result = write_file(k);
+    FS_close();
+    disk_close();
+    return result < 0 ? -1 : 0;
+}
+
+// Whether block holds the first block of file k.
+static bool is_data(const char *block, int k) {
+    for (int i = 0; i < DISK_BLOCK_SIZE; ++i) {
+        if (block[i] != pattern(k, i)) return false;
+    }
+    return true;
+}
+
+// Whether block holds the descriptor of a regular file of FILE_BYTES: its
+// size followed by its type, 0.
+static bool is_descriptor(const char *block) {
+    const int want[2] = {FILE_BYTES, 0};
+    for (int i = 0; i + 8 <= DISK_BLOCK_SIZE; i += 4) {
+        if (memcmp(block + i, want, 8) == 0) return true;
+    }
+    return false;
+}
+
+// Flip a bit of byte at of the first block of the image found() takes for
+// file k, through the image file so the checksum of the block stays as it
+// was. Return 0 on success.
+static int damage(const char *path, bool (*found)(const char *block, int k),
+                  int k, int at) {
+    FILE *image = fopen(path, "r+b");
+    if (!image) return -1;
+    char block[DISK_BLOCK_SIZE];
+    int result = -1;
+    for (long b = 0; b < DISK_BLOCKS; ++b) {
+        if (fread(block, DISK_BLOCK_SIZE, 1, image) != 1) break;
+        if (!found(block, k)) continue;
+        block[at] ^= 0x80;
+        if (fseek(image, b * DISK_BLOCK_SIZE + at, SEEK_SET) == 0 &&
+            fwrite(block + at, 1, 1, image) == 1) {
+            result = 0;
+        }
+        break;
+    }
+    fclose(image);
+    return result;
+}
+
+static bool any_descriptor(const char *block, int) {
+    return is_descriptor(block);
+}
+
+// Run the first half of test in another FS-check, return whether it
+// got through.
+static bool run_crash(const char *self, const char *test) {
+    char command[256];
+    snprintf(command, sizeof(command), "%s %s", self, test);
+    return system(command) == 0;
+}
+
+// Fsync one file after another, many more transactions than the log
+// holds, and die without closing.
+static void journal_wrap_crash() {
+    char image[64];
+    image_path(image, "journal_wrap");
+    if (disk_open(image, DISK_BLOCKS, DISK_BLOCK_SIZE, 0) < 0 ||
+        FS_init() < 0) {
+        _Exit(1);
+    }
+    char dir[8];
+    for (int d = 0; d < DIRS; ++d) {
+        sprintf(dir, "d%d", d);
+        if (mkdir(dir) < 0) _Exit(1);
+    }
+    for (int k = 0; k < DIRS * FILES_PER_DIR; ++k) {
+        if (write_file(k) < 0) _Exit(1);
+    }
+    _Exit(0);
+}
+
+// Every file fsynced before the crash is there after the log is replayed.
+static void test_journal_wrap(const char *self) {
+    const char *test = "journal_wrap";
+    char image[64];
+    image_path(image, test);
+    remove(image);
+    if (!run_crash(self, test)) {
+        fail(test, "could not write the files");
+        return;
+    }
+
+    if (disk_open(image, DISK_BLOCKS, DISK_BLOCK_SIZE, 0) < 0 ||
+        FS_mount() < 0) {
+        fail(test, "could not mount");
+        disk_close();
+        return;
+    }
+    int lost = 0;
+    char path[32], what[64];
+    for (int k = 0; k < DIRS * FILES_PER_DIR; ++k) {
+        if (file_ok(k)) continue;
+        file_path(path, k);
+        snprintf(what, sizeof(what), "lost fsynced file %s", path);
+        if (lost++ == 0) fail(test, what);
+    }
+    FS_close();
+    disk_close();
+    remove(image);
+    if (!lost) printf("ok %s\n", test);
+}
+
+// A read of a data block failing its checksum fails.
+static void test_bad_block() {
+    const char *test = "bad_block";
+    char image[64];
+    image_path(image, test);
+    remove(image);
+    if (write_files(image, 1) < 0 || damage(image, is_data, 0, 100) < 0) {
+        fail(test, "could not write and damage the file");
+        return;
+    }
+
+    if (disk_open(image, DISK_BLOCKS, DISK_BLOCK_SIZE, DISK_CHECKSUMS) < 0 ||
+        FS_mount() < 0) {
+        fail(test, "could not mount");
+        disk_close();
+        return;
+    }
+    char path[32], buff[FILE_BYTES];
+    file_path(path, 0);
+    int fh = open(path);
+    int n = fh < 0 ? 0 : read(fh, buff, FILE_BYTES);
+    if (fh >= 0) close(fh);
+    FS_close();
+    disk_close();
+    remove(image);
+    if (fh < 0) {
+        fail(test, "could not open the file");
+    } else if (n != ERR_BAD_BLOCK) {
+        fail(test, "read the damaged block");
+    } else {
+        printf("ok %s\n", test);
+    }
+}
+
+// A descriptor block failing its checksum is checked but not repaired, and
+// no file loses its blocks.
+static void test_fsck_damaged() {
+    const char *test = "fsck_damaged";
+    char image[64];
+    image_path(image, test);
+    const int files = DIRS * FILES_PER_DIR;
+    remove(image);
+    if (write_files(image, files) < 0 ||
+        damage(image, any_descriptor, 0, DISK_BLOCK_SIZE - 1) < 0) {
+        fail(test, "could not write and damage the files");
+        return;
+    }
+
+    if (disk_open(image, DISK_BLOCKS, DISK_BLOCK_SIZE, DISK_CHECKSUMS) < 0) {
+        fail(test, "could not open the disk");
+        return;
+    }
+    FS_FSCK_T r;
+    const int before = failed;
+    int lost = 0;
+    if (FS_fsck(1, 0, &r) < 0) {
+        fail(test, "no file system");
+    } else if (r.bad_metadata == 0) {
+        fail(test, "the damaged descriptor block was not reported");
+    } else if (r.repaired) {
+        fail(test, "repaired around damaged metadata");
+    } else if (FS_mount() < 0) {
+        fail(test, "could not mount");
+    } else {
+        for (int k = 0; k < files; ++k) lost += !file_ok(k);
+        FS_close();
+        if (lost) fail(test, "lost files");
+    }
+    disk_close();
+    remove(image);
+    if (failed == before) printf("ok %s\n", test);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 2 && strcmp(argv[1], "journal_wrap") == 0) {
+        journal_wrap_crash();
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: %s [<test>]\n", argv[0]);
+        return 1;
+    }
+    test_journal_wrap(argv[0]);
+    test_bad_block();
+    test_fsck_damaged();
+    return failed;
+}
@@ -0,0 +1,159 @@
+#include "crc32c.h"
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "the tables take 8 bytes as a little-endian word");
+
+#define POLY 0x82f63b78u  // the Castagnoli polynomial, bit-reversed
+#define LONG_LANE 1344    // bytes of each of three streams, 4032 at once
+#define SHORT_LANE 168    // 504 at once
+#define COPY_CHUNK (3 * LONG_LANE)  // crc32c_copy() bytes at a time
+
+// The CRCs are kept bit-reversed, without the inversions before and after
+// which crc32c() adds: bit 31 is the coefficient of x^0.
+
+// table[k][i] is the CRC of byte i followed by k zero bytes.
+static uint32_t table[8][256];
+
+static inline uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// a * b modulo POLY.
+static uint32_t multiply(uint32_t a, uint32_t b) {
+    uint32_t p = 0;
+    for (uint32_t m = 1u << 31; m; m >>= 1) {
+        if (a & m) p ^= b;
+        b = b & 1 ? b >> 1 ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^n modulo POLY.
+static uint32_t x_power(long long n) {
+    uint32_t p = 1u << 31, x = 1u << 30;  // x^0 and x^1
+    for (; n; n >>= 1) {
+        if (n & 1) p = multiply(p, x);
+        x = multiply(x, x);
+    }
+    return p;
+}
+
+static uint32_t crc_table(uint32_t c, const unsigned char *p, size_t n) {
+    for (; n >= 8; p += 8, n -= 8) {
+        const uint64_t w = load64(p) ^ c;
+        c = table[7][w & 0xff] ^ table[6][w >> 8 & 0xff] ^
+            table[5][w >> 16 & 0xff] ^ table[4][w >> 24 & 0xff] ^
+            table[3][w >> 32 & 0xff] ^ table[2][w >> 40 & 0xff] ^
+            table[1][w >> 48 & 0xff] ^ table[0][w >> 56];
+    }
+    for (; n; --n) c = table[0][(c ^ *p++) & 0xff] ^ c >> 8;
+    return c;
+}
+
+#if defined(__x86_64__)
+// Multipliers which move the CRC of a stream past the streams after it:
+// x^(8 * 2 * lane - 33) and x^(8 * lane - 33), as the product of two CRCs
+// carries one x and the crc32 instruction 32 more.
+static uint32_t long_shift[2], short_shift[2];
+
+// c0 * x^(16 * lane) + c1 * x^(8 * lane) + c2.
+__attribute__((target("sse4.2,pclmul"))) static inline uint32_t combine(
+    uint64_t c0, uint64_t c1, uint64_t c2, const uint32_t *shift) {
+    const __m128i a = _mm_clmulepi64_si128(
+        _mm_cvtsi64_si128(c0), _mm_cvtsi32_si128(shift[0]), 0);
+    const __m128i b = _mm_clmulepi64_si128(
+        _mm_cvtsi64_si128(c1), _mm_cvtsi32_si128(shift[1]), 0);
+    return c2 ^ _mm_crc32_u64(0, _mm_cvtsi128_si64(_mm_xor_si128(a, b)));
+}
+
+// The CRC of the n bytes at p. Three lanes hide the latency of the crc32
+// instruction.
+__attribute__((target("sse4.2,pclmul"))) static uint32_t crc_sse(
+    uint32_t c, const unsigned char *p, size_t n) {
+    uint64_t c0 = c;
+    for (int long_lanes = 1; long_lanes >= 0; --long_lanes) {
+        const size_t lane = long_lanes ? LONG_LANE : SHORT_LANE;
+        const uint32_t *shift = long_lanes ? long_shift : short_shift;
+        for (; n >= 3 * lane; p += 3 * lane, n -= 3 * lane) {
+            uint64_t c1 = 0, c2 = 0;
+            for (size_t i = 0; i < lane; i += 8) {
+                const uint64_t w0 = load64(p + i);
+                const uint64_t w1 = load64(p + lane + i);
+                const uint64_t w2 = load64(p + 2 * lane + i);
+                c0 = _mm_crc32_u64(c0, w0);
+                c1 = _mm_crc32_u64(c1, w1);
+                c2 = _mm_crc32_u64(c2, w2);
+            }
+            c0 = combine(c0, c1, c2, shift);
+        }
+    }
+    for (; n >= 8; p += 8, n -= 8) c0 = _mm_crc32_u64(c0, load64(p));
+    c = c0;
+    for (; n; --n) c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+// Fill the tables and choose the implementation.
+static bool init() {
+    for (int i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? c >> 1 ^ POLY : c >> 1;
+        table[0][i] = c;
+    }
+    for (int k = 1; k < 8; ++k) {
+        for (int i = 0; i < 256; ++i) {
+            const uint32_t c = table[k - 1][i];
+            table[k][i] = table[0][c & 0xff] ^ c >> 8;
+        }
+    }
+#if defined(__x86_64__)
+    long_shift[0] = x_power(8 * 2 * LONG_LANE - 33);
+    long_shift[1] = x_power(8 * LONG_LANE - 33);
+    short_shift[0] = x_power(8 * 2 * SHORT_LANE - 33);
+    short_shift[1] = x_power(8 * SHORT_LANE - 33);
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+#else
+    return false;
+#endif
+}
+
+static const bool sse = init();
+
+uint32_t crc32c(uint32_t crc, const void *p, size_t n) {
+    const unsigned char *in = (const unsigned char *)p;
+#if defined(__x86_64__)
+    if (sse) return ~crc_sse(~crc, in, n);
+#endif
+    return ~crc_table(~crc, in, n);
+}
+
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, size_t n) {
+    // Copying and summing in one pass, 8 bytes a store, runs at half the
+    // speed of memcpy() into uncached memory. Chunks which stay in the L1
+    // cache are copied by memcpy() instead and summed from the copy while
+    // it is there, at nearly the speed of memcpy() alone. The sum is of the
+    // bytes copied even if the source changes meanwhile.
+    unsigned char *out = (unsigned char *)dst;
+    const unsigned char *in = (const unsigned char *)src;
+    for (size_t k; n; out += k, in += k, n -= k) {
+        k = n < COPY_CHUNK ? n : COPY_CHUNK;
+        memcpy(out, in, k);
+        crc = crc32c(crc, out, k);
+    }
+    return crc;
+}
+
+uint32_t crc32c_table(uint32_t crc, const void *p, size_t n) {
+    return ~crc_table(~crc, (const unsigned char *)p, n);
+}
+
+const char *crc32c_impl() { return sse ? "sse4.2+pclmul" : "table"; }
@@ -0,0 +1,25 @@
+#pragma once
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli), the checksum of iSCSI and ext4. On x86-64 CPUs
+// with SSE4.2 it is computed with the crc32 instruction, three streams at
+// once joined with carry-less multiplies (PCLMUL); elsewhere with tables,
+// eight bytes a step. Which one is chosen when the program starts.
+
+// The CRC of the n bytes at p, going on from the CRC crc of the bytes
+// before them; crc is 0 for the first bytes.
+uint32_t crc32c(uint32_t crc, const void *p, size_t n);
+// Copy the n bytes at src to dst and return their CRC, as memcpy() and
+// crc32c(), a chunk at a time, summing the copy while it is in the L1 cache.
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, size_t n);
+// crc32c() with the tables, whatever the CPU.
+uint32_t crc32c_table(uint32_t crc, const void *p, size_t n);
+// The implementation crc32c() uses: "sse4.2+pclmul" or "table".
+const char *crc32c_impl();
+
+#endif  //_CRC32C_H_
@@ -0,0 +1,265 @@
+#include "dcache.h"
+#include <cstring>
+#include <unordered_map>
+
+#include "instance.h"
+#include "lock.h"
+#include "stats.h"
+
+#define NO_ENTRY -1
+
+#define DCACHE_SHARDS 16         // most shards
+#define DCACHE_SHARD_ENTRIES 64  // fewest entries in a shard
+#define DCACHE_NEGATIVE_SHARE 4  // negative entries take 1/4 of a shard
+#define DCACHE_SHORT_NAME 24     // longer names are allocated
+
+struct DCACHE_ENTRY_T {
+    unsigned int hash;  // of parent and name
+    int parent;         // -1 if the entry is unused
+    DENTRY_T dentry;
+    int next;  // next entry in the same hash bucket
+    bool referenced;
+    unsigned char len;  // of the name
+    union {
+        char short_name[DCACHE_SHORT_NAME];  // if len < DCACHE_SHORT_NAME
+        char *long_name;
+    };
+};
+
+// (parent, name) lives in the shard of its hash, each shard is a CLOCK cache
+// of its own with its own lock. A negative entry starts unreferenced, so it
+// is the first to go, and negative entries hold at most a share of a shard:
+// looking up many missing names does not push out the names which exist.
+struct DCACHE_SHARD_T {
+    MUTEX_T lock;
+    DCACHE_ENTRY_T *entry;
+    int *bucket;
+    int capacity;
+    int used;              // entries [0, used) were handed out
+    unsigned int buckets;  // a power of two
+    int hand;              // CLOCK hand
+    int negatives, max_negatives;
+};
+
+// What is known of a directory as a whole.
+struct DCACHE_DIR_T {
+    bool complete;
+    unsigned int evictions;  // of its positive entries, for the tickets
+};
+
+// The dentry cache of an instance.
+struct DCACHE_T {
+    DCACHE_SHARD_T *SHARD;
+    int shards;  // a power of two
+    int capacity;
+    std::unordered_map<int, DCACHE_DIR_T> DIRS;
+    MUTEX_T dirs_lock;  // guards DIRS, taken inside a shard's lock
+};
+
+// FNV-1a of parent and the len bytes of name
+static unsigned int hash_of(int parent, const char *name, int len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < 4; ++i) {
+        h = (h ^ (((unsigned int)parent >> (8 * i)) & 0xff)) * 16777619u;
+    }
+    for (int i = 0; i < len; ++i) h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+static inline const char *name_of(const DCACHE_ENTRY_T *e) {
+    return e->len < DCACHE_SHORT_NAME ? e->short_name : e->long_name;
+}
+
+static inline DCACHE_SHARD_T *shard_of(unsigned int h) {
+    DCACHE_T *dcache = instance->dcache;
+    return &dcache->SHARD[h & (dcache->shards - 1)];
+}
+
+static inline int *bucket_of(DCACHE_SHARD_T *s, unsigned int h) {
+    return &s->bucket[(h / DCACHE_SHARDS) & (s->buckets - 1)];
+}
+
+static int find(DCACHE_SHARD_T *s, unsigned int h, int parent,
+                const char *name, int len) {
+    for (int e = *bucket_of(s, h); e != NO_ENTRY; e = s->entry[e].next) {
+        DCACHE_ENTRY_T *entry = &s->entry[e];
+        if (entry->hash == h && entry->parent == parent && entry->len == len &&
+            memcmp(name_of(entry), name, len) == 0) {
+            return e;
+        }
+    }
+    return NO_ENTRY;
+}
+
+static void link(DCACHE_SHARD_T *s, int e) {
+    int *b = bucket_of(s, s->entry[e].hash);
+    s->entry[e].next = *b;
+    *b = e;
+}
+
+static void unlink(DCACHE_SHARD_T *s, int e) {
+    DCACHE_T *dcache = instance->dcache;
+    DCACHE_ENTRY_T *entry = &s->entry[e];
+    int *p = bucket_of(s, entry->hash);
+    while (*p != e) p = &s->entry[*p].next;
+    *p = entry->next;
+
+    if (entry->dentry.descriptor < 0) {
+        --s->negatives;
+    } else {
+        // The directory of an evicted name is no longer complete
+        LOCK_T lock(dcache->dirs_lock);
+        auto dir = dcache->DIRS.find(entry->parent);
+        if (dir != dcache->DIRS.end()) {
+            dir->second.complete = false;
+            ++dir->second.evictions;
+        }
+    }
+    if (entry->len >= DCACHE_SHORT_NAME) delete[] entry->long_name;
+    entry->parent = -1;
+}
+
+// Take an entry that was never used or evict one, a negative one if
+// negative_only.
+static int evict(DCACHE_SHARD_T *s, bool negative_only) {
+    if (!negative_only && s->used < s->capacity) return s->used++;
+    // Two sweeps clear every reference bit
+    for (int i = 0; i < 2 * s->used + 1; ++i) {
+        int e = s->hand;
+        s->hand = (s->hand + 1) % s->used;
+
+        DCACHE_ENTRY_T *entry = &s->entry[e];
+        if (negative_only && entry->dentry.descriptor >= 0) continue;
+        if (entry->referenced) {
+            entry->referenced = false;
+            continue;
+        }
+        unlink(s, e);
+        return e;
+    }
+    return NO_ENTRY;
+}
+
+static void free_shards(DCACHE_T *dcache) {
+    for (int i = 0; i < dcache->shards; ++i) {
+        DCACHE_SHARD_T *s = &dcache->SHARD[i];
+        for (int e = 0; e < s->used; ++e) {
+            if (s->entry[e].parent != -1 &&
+                s->entry[e].len >= DCACHE_SHORT_NAME) {
+                delete[] s->entry[e].long_name;
+            }
+        }
+        delete[] s->entry;
+        delete[] s->bucket;
+    }
+    delete[] dcache->SHARD;
+    dcache->SHARD = NULL;
+    dcache->shards = 0;
+}
+
+DCACHE_T *dcache_new() { return new DCACHE_T(); }
+
+void dcache_delete(DCACHE_T *dcache) {
+    free_shards(dcache);
+    delete dcache;
+}
+
+void dcache_init(int n) {
+    DCACHE_T *dcache = instance->dcache;
+    free_shards(dcache);
+
+    dcache->capacity = n;
+    dcache->shards = 1;
+    while (dcache->shards < DCACHE_SHARDS &&
+           n / (dcache->shards * 2) >= DCACHE_SHARD_ENTRIES) {
+        dcache->shards *= 2;
+    }
+    dcache->SHARD = new DCACHE_SHARD_T[dcache->shards];
+    for (int i = 0; i < dcache->shards; ++i) {
+        DCACHE_SHARD_T *s = &dcache->SHARD[i];
+        s->capacity = n / dcache->shards > 0 ? n / dcache->shards : 1;
+        s->buckets = 1;
+        while (s->buckets < 2u * s->capacity) s->buckets *= 2;
+        s->entry = new DCACHE_ENTRY_T[s->capacity];
+        s->bucket = new int[s->buckets];
+        for (unsigned int b = 0; b < s->buckets; ++b) s->bucket[b] = NO_ENTRY;
+        s->used = s->hand = 0;
+        s->negatives = 0;
+        s->max_negatives = s->capacity / DCACHE_NEGATIVE_SHARE + 1;
+    }
+
+    LOCK_T lock(dcache->dirs_lock);
+    dcache->DIRS.clear();
+}
+
+int dcache_capacity() { return instance->dcache->capacity; }
+
+int dcache_lookup(int parent, const char *name, DENTRY_T *e) {
+    const int len = strlen(name);
+    unsigned int h = hash_of(parent, name, len);
+    DCACHE_SHARD_T *s = shard_of(h);
+    LOCK_T lock(s->lock);
+    int i = find(s, h, parent, name, len);
+    if (i == NO_ENTRY) {
+        STAT_COUNT(STAT_DCACHE_MISS);
+        return 0;
+    }
+    STAT_COUNT(STAT_DCACHE_HIT);
+    s->entry[i].referenced = true;
+    *e = s->entry[i].dentry;
+    return 1;
+}
+
+void dcache_insert(int parent, const char *name, int descriptor, int slot) {
+    const int len = strlen(name);
+    unsigned int h = hash_of(parent, name, len);
+    DCACHE_SHARD_T *s = shard_of(h);
+    LOCK_T lock(s->lock);
+    int i = find(s, h, parent, name, len);
+    if (i == NO_ENTRY) {
+        i = evict(s, descriptor < 0 && s->negatives >= s->max_negatives);
+        if (i == NO_ENTRY) return;
+        DCACHE_ENTRY_T *entry = &s->entry[i];
+        entry->hash = h;
+        entry->parent = parent;
+        entry->dentry.descriptor = -1;
+        entry->len = len;
+        char *copy = entry->short_name;
+        if (len >= DCACHE_SHORT_NAME) copy = entry->long_name = new char[len];
+        memcpy(copy, name, len);
+        link(s, i);
+        ++s->negatives;
+    }
+
+    DCACHE_ENTRY_T *entry = &s->entry[i];
+    s->negatives += (descriptor < 0) - (entry->dentry.descriptor < 0);
+    entry->dentry.descriptor = descriptor;
+    entry->dentry.slot = slot;
+    entry->referenced = descriptor >= 0;
+}
+
+unsigned int dcache_fill_begin(int parent) {
+    DCACHE_T *dcache = instance->dcache;
+    LOCK_T lock(dcache->dirs_lock);
+    return dcache->DIRS[parent].evictions;
+}
+
+void dcache_set_complete(int parent, unsigned int ticket) {
+    DCACHE_T *dcache = instance->dcache;
+    LOCK_T lock(dcache->dirs_lock);
+    DCACHE_DIR_T &dir = dcache->DIRS[parent];
+    if (dir.evictions == ticket) dir.complete = true;
+}
+
+int dcache_complete(int parent) {
+    DCACHE_T *dcache = instance->dcache;
+    LOCK_T lock(dcache->dirs_lock);
+    auto dir = dcache->DIRS.find(parent);
+    return dir != dcache->DIRS.end() && dir->second.complete;
+}
+
+void dcache_drop_dir(int parent) {
+    DCACHE_T *dcache = instance->dcache;
+    LOCK_T lock(dcache->dirs_lock);
+    dcache->DIRS.erase(parent);
+}
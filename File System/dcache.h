@@ -0,0 +1,44 @@
+#pragma once
+
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+#define DCACHE_ENTRIES 65536  // least capacity in entries
+
+// Cache of directory entries: (parent directory, name) -> (descriptor, slot
+// of the entry in the parent), names are shorter than 256 bytes. A negative
+// entry, with descriptor -1, records that the name does not exist, so
+// looking it up again reads no directory block either. Once the cache is
+// full entries are dropped by CLOCK, negative ones first; negative entries
+// take at most a quarter of it. The cache is split into shards with a lock
+// each, every function may be called from any thread.
+//
+// A directory whose entries were all read into the cache is complete: until
+// one of its entries is evicted, a name missing from the cache is a name
+// missing from the directory.
+
+struct DENTRY_T {
+    int descriptor;  // -1 for a negative entry
+    int slot;        // offset of the entry in the parent, -1 if negative
+};
+
+// Drop every entry and every complete mark, and set the capacity.
+void dcache_init(int capacity);
+int dcache_capacity();
+// Look (parent, name) up, return 1 and store it in e if it is cached.
+int dcache_lookup(int parent, const char *name, DENTRY_T *e);
+// Add or replace (parent, name), a negative entry if descriptor is -1.
+void dcache_insert(int parent, const char *name, int descriptor, int slot);
+
+// Filling a directory: take a ticket before reading its first entry, then
+// pass it to dcache_set_complete() after inserting the last one. The
+// directory is marked complete unless one of its entries was evicted in
+// between.
+unsigned int dcache_fill_begin(int parent);
+void dcache_set_complete(int parent, unsigned int ticket);
+int dcache_complete(int parent);
+// Forget what is known of directory parent as a whole, when it is removed.
+// Its negative entries stay, they hold for any new empty directory.
+void dcache_drop_dir(int parent);
+
+#endif  //_DCACHE_H_
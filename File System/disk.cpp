@@ -1,25 +1,381 @@
 #include "disk.h"
+#include <atomic>
+#include <cstdint>
 #include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static byte D[BLOCKS][BLOCK_SIZE];
+#include "crc32c.h"
+#include "instance.h"
+#include "stats.h"
+
+#define CHECKSUM_MAGIC "BLKCRC32"
+
+// The first block of the checksum area, the checksums follow it.
+struct CHECKSUM_HEADER_T {
+    char magic[8];
+    unsigned int blocks;
+    unsigned int block_size;
+    int clean;  // the checksums match the blocks, set by disk_close()
+};
+
+// The disk of an instance.
+struct DISK_T {
+    byte *D;  // the mapped disk, D + b * block_size is block b
+    size_t disk_size;
+    unsigned int blocks;
+    unsigned int block_size;
+    int fd = -1;
+
+    // With checksums, the area past the blocks and the views of disk_map()
+    // over each block, whose checksums are not verified
+    CHECKSUM_HEADER_T *header;
+    uint32_t *sums;  // NULL without checksums
+    std::atomic<unsigned short> *mapped;
+    // A bit for each block read intact or written since disk_open(), for
+    // DISK_VERIFY_FIRST
+    std::atomic<uint64_t> *known;
+    std::atomic<int> mapped_blocks;
+    uint32_t zeros_sum, ones_sum;  // of the blocks init_block() writes
+    int verify;
+    std::atomic<long long> bad_sums;
+};
 
 static_assert(sizeof(byte) == 1);
-static_assert(BLOCKS <= BLOCK_SIZE * 8);
+
+// Blocks of the checksum area of n blocks of size bytes.
+static inline unsigned int area_blocks(unsigned int n, unsigned int size) {
+    return 1 + ((size_t)n * sizeof(uint32_t) + size - 1) / size;
+}
+
+// Whether the image fd of file_size bytes holds the checksums of n blocks
+// of size bytes.
+static bool has_checksums(int fd, off_t file_size, unsigned int n,
+                          unsigned int size) {
+    CHECKSUM_HEADER_T h;
+    return (off_t)(n + area_blocks(n, size)) * size <= file_size &&
+           pread(fd, &h, sizeof(h), (off_t)n * size) == sizeof(h) &&
+           memcmp(h.magic, CHECKSUM_MAGIC, sizeof(h.magic)) == 0 &&
+           h.blocks == n && h.block_size == size;
+}
+
+// Blocks of an image of total blocks if it holds checksums, otherwise 0.
+static unsigned int checksummed_blocks(int fd, off_t file_size,
+                                       unsigned int total,
+                                       unsigned int size) {
+    if (total < 2) return 0;
+    // The largest n whose area fits, n + area_blocks(n) grows with n
+    unsigned int n = (unsigned long long)(total - 1) * size / (size + 4);
+    while (n + 1 + area_blocks(n + 1, size) <= total) ++n;
+    while (n > 0 && n + area_blocks(n, size) > total) --n;
+    return has_checksums(fd, file_size, n, size) ? n : 0;
+}
+
+// Write the header of the checksum area back to the image.
+static void sync_header(DISK_T *disk) {
+    if (disk->fd < 0) return;
+    size_t page = sysconf(_SC_PAGESIZE);
+    byte *begin = (byte *)((uintptr_t)disk->header / page * page);
+    msync(begin, (byte *)(disk->header + 1) - begin, MS_SYNC);
+}
+
+// Set up the checksums of the disk mapped, computing them unless they are
+// those of the blocks.
+static void open_checksums(DISK_T *disk) {
+    const unsigned int n = disk->blocks, size = disk->block_size;
+    disk->header = (CHECKSUM_HEADER_T *)(disk->D + (size_t)n * size);
+    disk->sums = (uint32_t *)(disk->D + (size_t)(n + 1) * size);
+    disk->mapped = new std::atomic<unsigned short>[n]();
+    disk->mapped_blocks = 0;
+    disk->known = new std::atomic<uint64_t>[(n + 63) / 64]();
+    disk->verify = DISK_VERIFY_FIRST;
+    disk->bad_sums = 0;
+
+    byte *block = new byte[size];
+    memset(block, 0, size);
+    disk->zeros_sum = crc32c(0, block, size);
+    memset(block, -1, size);
+    disk->ones_sum = crc32c(0, block, size);
+    delete[] block;
+
+    CHECKSUM_HEADER_T *h = disk->header;
+    if (memcmp(h->magic, CHECKSUM_MAGIC, sizeof(h->magic)) != 0 ||
+        h->blocks != n || h->block_size != size || !h->clean) {
+        if (disk->fd < 0) {
+            // A new in-memory disk is all zeros
+            for (unsigned int b = 0; b < n; ++b) {
+                disk->sums[b] = disk->zeros_sum;
+            }
+        } else {
+            for (unsigned int b = 0; b < n; ++b) {
+                disk->sums[b] = crc32c(0, disk->D + (size_t)b * size, size);
+            }
+        }
+        memcpy(h->magic, CHECKSUM_MAGIC, sizeof(h->magic));
+        h->blocks = n;
+        h->block_size = size;
+    }
+    // Until disk_close() the blocks may be written before their checksums
+    h->clean = 0;
+    disk_sync();
+    sync_header(disk);
+}
+
+// Recompute the checksums of the blocks of [b, b + n) under a view.
+static void rehash_mapped(DISK_T *disk, unsigned int b, unsigned int n) {
+    if (!disk->sums || disk->mapped_blocks.load() == 0) return;
+    for (unsigned int i = b; i < b + n; ++i) {
+        if (disk->mapped[i].load(std::memory_order_relaxed) == 0) continue;
+        const uint32_t sum = crc32c(
+            0, disk->D + (size_t)i * disk->block_size, disk->block_size);
+        __atomic_store_n(&disk->sums[i], sum, __ATOMIC_RELAXED);
+    }
+}
+
+// Whether block b was read intact or written since disk_open().
+static inline bool known(DISK_T *disk, unsigned int b) {
+    return disk->known[b / 64].load(std::memory_order_relaxed) >> b % 64 & 1;
+}
+
+static inline void set_known(DISK_T *disk, unsigned int b) {
+    if (!known(disk, b)) {
+        disk->known[b / 64].fetch_or(1ULL << b % 64,
+                                     std::memory_order_relaxed);
+    }
+}
+
+// Whether read_block() verifies block b.
+static inline bool verified(DISK_T *disk, unsigned int b) {
+    static thread_local unsigned int reads;
+    if (disk->verify == DISK_VERIFY_OFF ||
+        disk->mapped[b].load(std::memory_order_relaxed) > 0) {
+        return false;
+    }
+    return disk->verify == DISK_VERIFY_ALWAYS ||
+           (disk->verify == DISK_VERIFY_FIRST && !known(disk, b)) ||
+           ++reads % DISK_VERIFY_SAMPLE == 0;
+}
+
+DISK_T *disk_new() { return new DISK_T(); }
+
+void disk_delete(DISK_T *disk) {
+    if (disk->D) munmap(disk->D, disk->disk_size);
+    if (disk->fd >= 0) ::close(disk->fd);
+    delete[] disk->mapped;
+    delete[] disk->known;
+    delete disk;
+}
+
+int disk_open(const char *path, unsigned int n, unsigned int size,
+              int flags) {
+    DISK_T *disk = instance->disk;
+    if (size < MIN_BLOCK_SIZE || (size & (size - 1))) return -1;
+    if (disk->D) disk_close();
+
+    int mflags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (flags & DISK_POPULATE) mflags |= MAP_POPULATE;
+#endif
+
+    bool sums = flags & DISK_CHECKSUMS;
+    if (path) {
+        disk->fd = ::open(path, O_RDWR | O_CREAT, 0644);
+        if (disk->fd < 0) return -1;
+        struct stat st;
+        if (fstat(disk->fd, &st) < 0) goto fail;
+        if (n == 0) {
+            n = checksummed_blocks(disk->fd, st.st_size, st.st_size / size,
+                                   size);
+            if (n > 0) {
+                sums = true;
+            } else {
+                n = st.st_size / size;
+            }
+        } else if (has_checksums(disk->fd, st.st_size, n, size)) {
+            sums = true;
+        }
+        if (n == 0) goto fail;
+        const size_t image = (size_t)(n + (sums ? area_blocks(n, size) : 0)) *
+                             size;
+        if ((size_t)st.st_size < image &&
+            ftruncate(disk->fd, (off_t)image) < 0) {
+            goto fail;
+        }
+    } else {
+        if (n == 0) return -1;
+        mflags |= MAP_ANONYMOUS;
+    }
+
+    disk->disk_size = (size_t)(n + (sums ? area_blocks(n, size) : 0)) * size;
+    disk->D = (byte *)mmap(NULL, disk->disk_size, PROT_READ | PROT_WRITE,
+                           mflags, disk->fd, 0);
+    if (disk->D == MAP_FAILED) {
+        disk->D = NULL;
+        goto fail;
+    }
+#ifdef MADV_HUGEPAGE
+    if (flags & DISK_HUGEPAGES) {
+        madvise(disk->D, disk->disk_size, MADV_HUGEPAGE);
+    }
+#endif
+
+    disk->blocks = n;
+    disk->block_size = size;
+    if (sums) open_checksums(disk);
+    return 0;
+
+fail:
+    if (disk->fd >= 0) ::close(disk->fd);
+    disk->fd = -1;
+    return -1;
+}
+
+int disk_close() {
+    DISK_T *disk = instance->disk;
+    if (!disk->D) return -1;
+    disk_sync();
+    if (disk->sums) {
+        // The checksums are on the image with the blocks
+        disk->header->clean = 1;
+        sync_header(disk);
+        delete[] disk->mapped;
+        delete[] disk->known;
+        disk->mapped = NULL;
+        disk->known = NULL;
+        disk->header = NULL;
+        disk->sums = NULL;
+    }
+    munmap(disk->D, disk->disk_size);
+    if (disk->fd >= 0) ::close(disk->fd);
+    disk->D = NULL;
+    disk->fd = -1;
+    disk->disk_size = 0;
+    disk->blocks = disk->block_size = 0;
+    return 0;
+}
+
+int disk_sync() {
+    DISK_T *disk = instance->disk;
+    if (!disk->D) return -1;
+    rehash_mapped(disk, 0, disk->blocks);
+    if (disk->fd >= 0) return msync(disk->D, disk->disk_size, MS_SYNC);
+    return 0;
+}
+
+int disk_sync_blocks(unsigned int b, unsigned int n) {
+    DISK_T *disk = instance->disk;
+    if (!disk->D || b + n > disk->blocks) return -1;
+    rehash_mapped(disk, b, n);
+    if (disk->fd < 0 || n == 0) return 0;
+    // msync() takes whole pages
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = (size_t)b * disk->block_size / page * page;
+    size_t end = (size_t)(b + n) * disk->block_size;
+    if (msync(disk->D + begin, end - begin, MS_SYNC) < 0) return -1;
+    if (!disk->sums) return 0;
+    begin = ((byte *)&disk->sums[b] - disk->D) / page * page;
+    end = (byte *)&disk->sums[b + n] - disk->D;
+    return msync(disk->D + begin, end - begin, MS_SYNC);
+}
+
+unsigned int disk_blocks() { return instance->disk->blocks; }
+
+unsigned int disk_block_size() { return instance->disk->block_size; }
+
+byte *disk_map(unsigned int b, unsigned int n) {
+    DISK_T *disk = instance->disk;
+    if (!disk->D || b + n > disk->blocks || b + n < b) return NULL;
+    if (disk->sums) {
+        for (unsigned int i = b; i < b + n; ++i) ++disk->mapped[i];
+        disk->mapped_blocks += n;
+    }
+    return disk->D + (size_t)b * disk->block_size;
+}
+
+int disk_unmap(unsigned int b, unsigned int n) {
+    DISK_T *disk = instance->disk;
+    if (!disk->D || b + n > disk->blocks || b + n < b) return -1;
+    if (!disk->sums) return 0;
+    rehash_mapped(disk, b, n);
+    for (unsigned int i = b; i < b + n; ++i) --disk->mapped[i];
+    disk->mapped_blocks -= n;
+    return 0;
+}
+
+int disk_checksums() { return instance->disk->sums != NULL; }
+
+int disk_set_verify(int policy) {
+    DISK_T *disk = instance->disk;
+    if (policy < DISK_VERIFY_OFF || policy > DISK_VERIFY_FIRST) return -1;
+    if (!disk->sums) return -1;
+    disk->verify = policy;
+    return 0;
+}
+
+int disk_check(unsigned int b, unsigned int n) {
+    DISK_T *disk = instance->disk;
+    if (!disk->sums || b + n > disk->blocks || b + n < b) return 0;
+    int bad = 0;
+    for (unsigned int i = b; i < b + n; ++i) {
+        if (disk->mapped[i].load(std::memory_order_relaxed) > 0) continue;
+        const uint32_t sum = crc32c(
+            0, disk->D + (size_t)i * disk->block_size, disk->block_size);
+        bad += sum != __atomic_load_n(&disk->sums[i], __ATOMIC_RELAXED);
+    }
+    disk->bad_sums += bad;
+    return bad;
+}
+
+long long disk_bad_checksums() { return instance->disk->bad_sums.load(); }
 
 int init_block(unsigned int b, int val) {
-    if (b >= BLOCKS) return -1;
-    memset(D[b], val ? -1 : 0, sizeof(byte) * BLOCK_SIZE);
+    DISK_T *disk = instance->disk;
+    if (b >= disk->blocks) return -1;
+    memset(disk->D + (size_t)b * disk->block_size, val ? -1 : 0,
+           disk->block_size);
+    if (disk->sums) {
+        __atomic_store_n(&disk->sums[b],
+                         val ? disk->ones_sum : disk->zeros_sum,
+                         __ATOMIC_RELAXED);
+        set_known(disk, b);
+    }
     return 0;
 }
 
 int read_block(unsigned int b, byte* I) {
-    if (b >= BLOCKS) return -1;
-    memcpy(I, D[b], sizeof(byte) * BLOCK_SIZE);
+    DISK_T *disk = instance->disk;
+    STAT_TIMER_T timer(STAT_BLOCK_READ);
+    if (b >= disk->blocks) return -1;
+    timer.bytes = disk->block_size;
+    const byte *block = disk->D + (size_t)b * disk->block_size;
+    if (!disk->sums || !verified(disk, b)) {
+        memcpy(I, block, disk->block_size);
+        return 0;
+    }
+    // Checked on the way, the copy holds what was compared
+    if (crc32c_copy(0, I, block, disk->block_size) !=
+        __atomic_load_n(&disk->sums[b], __ATOMIC_RELAXED)) {
+        ++disk->bad_sums;
+        return DISK_BAD_CHECKSUM;
+    }
+    set_known(disk, b);
     return 0;
 }
 
 int write_block(unsigned int b, const byte* O) {
-    if (b >= BLOCKS) return -1;
-    memcpy(D[b], O, sizeof(byte) * BLOCK_SIZE);
+    DISK_T *disk = instance->disk;
+    STAT_TIMER_T timer(STAT_BLOCK_WRITE);
+    if (b >= disk->blocks) return -1;
+    timer.bytes = disk->block_size;
+    byte *block = disk->D + (size_t)b * disk->block_size;
+    if (!disk->sums) {
+        memcpy(block, O, disk->block_size);
+        return 0;
+    }
+    const uint32_t sum = crc32c_copy(0, block, O, disk->block_size);
+    __atomic_store_n(&disk->sums[b], sum, __ATOMIC_RELAXED);
+    set_known(disk, b);
     return 0;
 }
@@ -3,12 +3,72 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
-#define BLOCKS 64       // number of blocks
-#define BLOCK_SIZE 512  // block size
+#define BLOCKS 64       // default number of blocks
+#define BLOCK_SIZE 512  // default block size
+
+#define MIN_BLOCK_SIZE 512
+
+// disk_open() flags
+#define DISK_POPULATE 0x1   // prefault the whole mapping (MAP_POPULATE)
+#define DISK_HUGEPAGES 0x2  // ask for transparent huge pages
+#define DISK_CHECKSUMS 0x4  // keep a checksum of every block, see below
+
+// Checksum verification policies of disk_set_verify()
+#define DISK_VERIFY_OFF 0
+#define DISK_VERIFY_SAMPLED 1  // one read_block() in DISK_VERIFY_SAMPLE
+#define DISK_VERIFY_ALWAYS 2
+// The first read_block() of each block since disk_open(), unless the block
+// was written since, then as DISK_VERIFY_SAMPLED
+#define DISK_VERIFY_FIRST 3
+#define DISK_VERIFY_SAMPLE 16
+
+// read_block(): the block read does not match its checksum
+#define DISK_BAD_CHECKSUM -2
 
 typedef unsigned char byte;
 
+// Map the disk image at path, or an anonymous in-memory disk if path is NULL.
+// The image is created or grown to blocks * block_size bytes; if blocks is 0
+// the number of blocks is taken from the size of an existing image.
+// block_size must be a power of two and at least MIN_BLOCK_SIZE. An image
+// which holds checksums is opened with them, DISK_CHECKSUMS or not.
+int disk_open(const char *path, unsigned int blocks, unsigned int block_size,
+              int flags);
+// Unmap the disk, writing a file backed image back first.
+int disk_close();
+// Write dirty pages of a file backed image back to the file.
+int disk_sync();
+// Write the dirty pages of the blocks [b, b + n) back to the file.
+int disk_sync_blocks(unsigned int b, unsigned int n);
+
+unsigned int disk_blocks();      // 0 if no disk is opened
+unsigned int disk_block_size();  // 0 if no disk is opened
+
+// The memory of the blocks [b, b + n), valid until disk_close(), or NULL if
+// they are not on the disk. Changes to it are changes to the blocks, whose
+// checksums are brought up to date by disk_sync() and disk_sync_blocks()
+// and not verified until disk_unmap().
+byte *disk_map(unsigned int b, unsigned int n);
+// The blocks of a disk_map() are not changed through it any more.
+int disk_unmap(unsigned int b, unsigned int n);
+
+// Checksums: a disk opened with DISK_CHECKSUMS keeps the CRC32C of each
+// block in an area past its blocks, a header block and 4 bytes a block.
+// write_block() and init_block() update the checksum of the block and
+// read_block() verifies it as the policy says, DISK_VERIFY_FIRST at start. After a
+// crash the checksums are computed again from the blocks when the disk is
+// opened.
+int disk_checksums();  // whether the disk keeps checksums
+// Set the verification policy, DISK_VERIFY_*.
+int disk_set_verify(int policy);
+// Verify the blocks [b, b + n) whatever the policy and return the number
+// of them which do not match their checksums.
+int disk_check(unsigned int b, unsigned int n);
+// Blocks found not to match their checksums since the disk was opened.
+long long disk_bad_checksums();
+
 int init_block(unsigned int b, int val);
+// The block is read even if it does not match its checksum.
 int read_block(unsigned int b, byte* I);
 int write_block(unsigned int b, const byte* O);
 
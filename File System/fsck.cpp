@@ -0,0 +1,72 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "FS.h"
+#include "disk.h"
+
+// Check the file system on a disk image and, with -y, repair it. The exit
+// status is 0 if the file system is clean, 1 if problems were found (and
+// repaired with -y), 2 if the image holds no file system.
+//
+// FS-fsck [-y] [-j <threads>] <image> [<block size>]
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-y] [-j <threads>] <image> [<block size>]\n",
+            name);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    int repair = 0, threads = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "-y") == 0) {
+            repair = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (i != argc - 1 && i != argc - 2) usage(argv[0]);
+    const char *image = argv[i];
+    int block_size = i + 1 < argc ? atoi(argv[i + 1]) : BLOCK_SIZE;
+
+    if (disk_open(image, 0, block_size, 0) < 0) {
+        fprintf(stderr, "cannot open %s\n", image);
+        return 2;
+    }
+
+    FS_FSCK_T r;
+    auto start = std::chrono::steady_clock::now();
+    int problems = FS_fsck(repair, threads, &r);
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    disk_close();
+    if (problems < 0) {
+        fprintf(stderr, "%s: no file system of block size %d\n", image,
+                block_size);
+        return 2;
+    }
+
+    printf("%s: %s, %lld files, %lld blocks used\n", image,
+           r.unclean ? "not cleanly unmounted" : "clean", r.files, r.blocks);
+    printf("double allocated blocks  %lld\n", r.double_allocated);
+    printf("bad block pointers       %lld\n", r.bad_pointers);
+    printf("orphaned blocks          %lld\n", r.orphaned_blocks);
+    printf("unmarked blocks          %lld\n", r.unmarked_blocks);
+    printf("bad directory entries    %lld\n", r.bad_entries);
+    printf("orphaned files           %lld\n", r.orphaned_files);
+    printf("bad reference counts     %lld\n", r.bad_refcounts);
+    printf("bad block checksums      %lld\n", r.bad_checksums);
+    printf("  of metadata blocks     %lld\n", r.bad_metadata);
+    printf("%d problems%s, %.3f s\n", problems,
+           r.repaired               ? " repaired"
+           : repair && r.bad_metadata ? " left, metadata is damaged"
+                                      : "",
+           seconds);
+    return problems > 0;
+}
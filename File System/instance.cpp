@@ -0,0 +1,33 @@
+#include "instance.h"
+
+INSTANCE_T default_instance;
+
+thread_local INSTANCE_T *instance = &default_instance;
+
+// Sets the default instance up before main() and stops its threads after.
+static struct DEFAULT_INSTANCE_T {
+    DEFAULT_INSTANCE_T() {
+        INSTANCE_T *i = instance_new();
+        default_instance = *i;
+        delete i;
+    }
+    ~DEFAULT_INSTANCE_T() {
+        INSTANCE_T *i = new INSTANCE_T(default_instance);
+        instance_delete(i);
+    }
+} default_setup;
+
+INSTANCE_T *instance_new() {
+    return new INSTANCE_T{disk_new(), cache_new(), dcache_new(),
+                          journal_new(), fs_new()};
+}
+
+void instance_delete(INSTANCE_T *i) {
+    // The journal commits from a thread of its own, which goes first
+    journal_delete(i->journal);
+    cache_delete(i->cache);
+    dcache_delete(i->dcache);
+    fs_delete(i->fs);
+    disk_delete(i->disk);
+    delete i;
+}
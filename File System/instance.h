@@ -0,0 +1,50 @@
+#pragma once
+
+#ifndef _INSTANCE_H_
+#define _INSTANCE_H_
+
+// An instance of the file system: a disk, its block cache, dentry cache and
+// journal, and the file system on it. Each module keeps the state of an
+// instance in a struct of its own, so a process may run many instances
+// which share nothing, no lock either. A thread works on the instance it
+// bound last with FS_use(), the default instance until then; the threads
+// of an instance (commits, prefetching, FS_fsck()) are bound to it.
+// Statistics (stats.h) are of the whole process.
+
+struct DISK_T;
+struct CACHE_T;
+struct DCACHE_T;
+struct JOURNAL_T;
+struct FS_T;
+
+struct INSTANCE_T {
+    DISK_T *disk;
+    CACHE_T *cache;
+    DCACHE_T *dcache;
+    JOURNAL_T *journal;
+    FS_T *fs;
+};
+
+// The instance of the calling thread.
+extern thread_local INSTANCE_T *instance;
+// The instance of the threads which did not bind one.
+extern INSTANCE_T default_instance;
+
+// Create an instance with no disk opened, or free one: its threads are
+// stopped and its disk is unmapped, with nothing written back first.
+INSTANCE_T *instance_new();
+void instance_delete(INSTANCE_T *i);
+
+// The part of each module, created and freed by the two above.
+DISK_T *disk_new();
+void disk_delete(DISK_T *disk);
+CACHE_T *cache_new();
+void cache_delete(CACHE_T *cache);
+DCACHE_T *dcache_new();
+void dcache_delete(DCACHE_T *dcache);
+JOURNAL_T *journal_new();
+void journal_delete(JOURNAL_T *journal);
+FS_T *fs_new();
+void fs_delete(FS_T *fs);
+
+#endif  //_INSTANCE_H_
@@ -0,0 +1,647 @@
+#include "journal.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "cache.h"
+#include "instance.h"
+#include "lock.h"
+#include "stats.h"
+
+#if (THREAD_SAFE)
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#endif
+
+#define JOURNAL_MAGIC "FSJRNL01"
+#define JOURNAL_IDLE_MS 100  // checkpoint after this long without commits
+
+// Log records start with a type, the sequence number of their transaction
+// and a count of block numbers which follow.
+#define RECORD_DESCRIPTOR 0x4a445343  // followed by count block images
+#define RECORD_REVOKE 0x4a52564b      // blocks freed, skip older images
+#define RECORD_COMMIT 0x4a434d54
+#define RECORD_HEADER 3  // ints before the block numbers
+
+struct HEADER_T {
+    char magic[8];
+    int total_blocks, block_size, blocks;
+    int head;               // log block of the oldest transaction
+    unsigned int head_seq;  // its sequence number
+};
+
+// A transaction committed to the log and waiting for its checkpoint.
+struct TXN_T {
+    unsigned int seq;
+    std::vector<int> homes;  // image i belongs at block homes[i]
+    size_t meta_count;       // buffered blocks come first, then cached ones
+    std::vector<byte> images;
+    std::vector<int> revoked, freed;
+};
+
+#if (THREAD_SAFE)
+struct COMMITTER_T {
+    MUTEX_T lock;
+    std::condition_variable wake;
+    std::thread thread;
+    bool stop;
+
+    ~COMMITTER_T();
+};
+#endif
+
+// The journal of an instance.
+struct JOURNAL_T {
+    bool opened;
+    int start, ring;  // the log is the blocks (start, start + ring]
+    int block_size;
+    int max_blocks;
+    byte *meta;
+    std::atomic<bool> *meta_dirty;
+    void (*release)(int first, int n);
+
+    // Handles share journal_lock, a commit takes it alone to copy the blocks
+    // of the running transaction. commit_lock serializes commits and
+    // checkpoints and guards the log.
+    RW_LOCK_T journal_lock;
+    MUTEX_T commit_lock;
+
+    // The running transaction, guarded by txn_lock.
+    MUTEX_T txn_lock;
+    std::vector<int> running_meta;  // buffered blocks changed
+    std::vector<int> running_cached;
+    std::unordered_set<int> held;  // running_cached, held in the cache
+    std::vector<int> running_revoked, running_freed;
+    std::atomic<int> running_blocks;
+    std::atomic<int> pending_frees;  // running_freed and in commit
+
+    // The log, guarded by commit_lock.
+    int head, used;
+    unsigned int next_seq;
+    std::deque<TXN_T *> committed;
+
+    // Sequence number of the last transaction logging or revoking each
+    // block still in the log. Checkpoints write a block from that
+    // transaction only.
+    MUTEX_T latest_lock;
+    std::unordered_map<int, unsigned int> latest;
+
+#if (THREAD_SAFE)
+    COMMITTER_T committer;
+#endif
+};
+
+static inline int per_record() {
+    JOURNAL_T *journal = instance->journal;
+    return journal->block_size / (int)sizeof(int) - RECORD_HEADER;
+}
+
+static inline int log_block(int pos) {
+    JOURNAL_T *journal = instance->journal;
+    return journal->start + 1 + pos % journal->ring;
+}
+
+static int read_header(HEADER_T *h) {
+    JOURNAL_T *journal = instance->journal;
+    std::vector<byte> buff(journal->block_size);
+    if (read_block(journal->start, buff.data()) < 0) return -1;
+    memcpy(h, buff.data(), sizeof(*h));
+    return 0;
+}
+
+// Write the header, the log starting at head with transaction head_seq.
+static void write_header(unsigned int head_seq) {
+    JOURNAL_T *journal = instance->journal;
+    std::vector<byte> buff(journal->block_size, 0);
+    HEADER_T h;
+    memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+    h.total_blocks = disk_blocks();
+    h.block_size = journal->block_size;
+    h.blocks = journal->ring + 1;
+    h.head = journal->head;
+    h.head_seq = head_seq;
+    memcpy(buff.data(), &h, sizeof(h));
+    write_block(journal->start, buff.data());
+    disk_sync_blocks(journal->start, 1);
+}
+
+// Write a record of type for transaction seq with count block numbers at
+// log position pos.
+static void write_record(int pos, int type, unsigned int seq,
+                         const int *blocks, int count) {
+    JOURNAL_T *journal = instance->journal;
+    std::vector<byte> buff(journal->block_size, 0);
+    int *r = (int *)buff.data();
+    r[0] = type;
+    r[1] = (int)seq;
+    r[2] = count;
+    if (count) memcpy(r + RECORD_HEADER, blocks, count * sizeof(int));
+    write_block(log_block(pos), buff.data());
+}
+
+// Log blocks taken by t.
+static int log_length(const TXN_T *t) {
+    const int per = per_record();
+    int n = t->homes.size(), r = t->revoked.size();
+    return (n + per - 1) / per + n + (r + per - 1) / per + 1;
+}
+
+// Release the blocks t freed, coalesced into runs.
+static void release_freed(TXN_T *t) {
+    JOURNAL_T *journal = instance->journal;
+    std::vector<int> &f = t->freed;
+    std::sort(f.begin(), f.end());
+    for (size_t i = 0, j; i < f.size(); i = j) {
+        for (j = i + 1; j < f.size() && f[j] == f[j - 1] + 1; ++j) {
+        }
+        journal->release(f[i], j - i);
+    }
+    journal->pending_frees -= f.size();
+    f.clear();
+}
+
+// Write the images of t to their homes if no later transaction logged or
+// revoked them, and forget t's blocks.
+static void write_home(TXN_T *t) {
+    JOURNAL_T *journal = instance->journal;
+    LOCK_T guard(journal->latest_lock);
+    for (size_t i = 0; i < t->homes.size(); ++i) {
+        auto it = journal->latest.find(t->homes[i]);
+        if (it != journal->latest.end() && it->second == t->seq) {
+            cache_write_home(t->homes[i],
+                             &t->images[i * journal->block_size]);
+            journal->latest.erase(it);
+        }
+    }
+    for (int b : t->revoked) {
+        auto it = journal->latest.find(b);
+        if (it != journal->latest.end() && it->second == t->seq) {
+            journal->latest.erase(it);
+        }
+    }
+}
+
+// Checkpoint every committed transaction, the next one in the log being
+// transaction seq. The caller holds commit_lock.
+static void checkpoint(unsigned int seq) {
+    JOURNAL_T *journal = instance->journal;
+    if (journal->committed.empty()) return;
+    for (TXN_T *t : journal->committed) {
+        write_home(t);
+        delete t;
+    }
+    journal->committed.clear();
+    // The homes must be on disk before the log is emptied
+    disk_sync();
+    journal->head = (journal->head + journal->used) % journal->ring;
+    journal->used = 0;
+    write_header(seq);
+}
+
+// Copy the running transaction into a new one, or return NULL if nothing
+// changed. The caller holds commit_lock.
+static TXN_T *take_running() {
+    JOURNAL_T *journal = instance->journal;
+    WRITE_LOCK_T all(journal->journal_lock);
+    LOCK_T guard(journal->txn_lock);
+    if (journal->running_meta.empty() && journal->running_cached.empty() &&
+        journal->running_revoked.empty() && journal->running_freed.empty()) {
+        return NULL;
+    }
+
+    TXN_T *t = new TXN_T;
+    t->seq = journal->next_seq++;
+    t->images.resize(
+        (journal->running_meta.size() + journal->running_cached.size()) *
+        journal->block_size);
+    for (int b : journal->running_meta) {
+        journal->meta_dirty[b].store(false, std::memory_order_relaxed);
+        memcpy(&t->images[t->homes.size() * journal->block_size],
+               journal->meta + (size_t)b * journal->block_size,
+               journal->block_size);
+        t->homes.push_back(b);
+    }
+    t->meta_count = t->homes.size();
+    for (int b : journal->running_cached) {
+        byte *image = &t->images[t->homes.size() * journal->block_size];
+        if (cache_copy(b, image) == 0) {
+            t->homes.push_back(b);
+        }
+    }
+    t->images.resize(t->homes.size() * journal->block_size);
+    t->revoked.swap(journal->running_revoked);
+    t->freed.swap(journal->running_freed);
+
+    // Before any handle may free one of these blocks and look for it here
+    {
+        LOCK_T l(journal->latest_lock);
+        for (int b : t->homes) journal->latest[b] = t->seq;
+        for (int b : t->revoked) journal->latest[b] = t->seq;
+    }
+
+    journal->running_meta.clear();
+    journal->running_cached.clear();
+    journal->held.clear();
+    journal->running_blocks = 0;
+    return t;
+}
+
+// Write t to the log, or straight home if it is larger than the log, and
+// return whether it went to the log. The caller holds commit_lock.
+static bool write_txn(TXN_T *t) {
+    JOURNAL_T *journal = instance->journal;
+    const int per = per_record();
+    const int length = log_length(t);
+    if (length > journal->ring) {
+        // Not atomic, only a single handle changing more blocks than the
+        // log holds gets here
+        checkpoint(journal->next_seq);
+        for (size_t i = 0; i < t->homes.size(); ++i) {
+            cache_write_home(t->homes[i],
+                             &t->images[i * journal->block_size]);
+        }
+        disk_sync();
+        LOCK_T l(journal->latest_lock);
+        for (int b : t->homes) journal->latest.erase(b);
+        for (int b : t->revoked) journal->latest.erase(b);
+        return false;
+    }
+    // t has its sequence number already and goes to the emptied log first
+    if (journal->ring - journal->used < length) checkpoint(t->seq);
+
+    int pos = journal->head + journal->used;
+    const int n = t->homes.size();
+    for (int i = 0; i < n; i += per) {
+        int count = n - i < per ? n - i : per;
+        write_record(pos++, RECORD_DESCRIPTOR, t->seq, &t->homes[i], count);
+        for (int j = i; j < i + count; ++j) {
+            write_block(log_block(pos++), &t->images[j * journal->block_size]);
+        }
+    }
+    const int r = t->revoked.size();
+    for (int i = 0; i < r; i += per) {
+        int count = r - i < per ? r - i : per;
+        write_record(pos++, RECORD_REVOKE, t->seq, &t->revoked[i], count);
+    }
+    // The commit block goes last, once the rest is on disk
+    disk_sync_blocks(journal->start + 1, journal->ring);
+    write_record(pos++, RECORD_COMMIT, t->seq, NULL, 0);
+    disk_sync_blocks(journal->start + 1, journal->ring);
+    journal->used += length;
+    return true;
+}
+
+// Commit the running transaction, return the number of blocks logged.
+static int commit() {
+    JOURNAL_T *journal = instance->journal;
+    STAT_TIMER_T timer(STAT_COMMIT);
+    LOCK_T guard(journal->commit_lock);
+    if (!journal->opened) return 0;
+    TXN_T *t = take_running();
+    if (!t) return 0;
+
+    bool logged = write_txn(t);
+    // t is durable: its cached blocks may be written back, its freed blocks
+    // reused
+    for (size_t i = t->meta_count; i < t->homes.size(); ++i) {
+        cache_release(t->homes[i]);
+    }
+    release_freed(t);
+
+    int n = t->homes.size();
+    timer.bytes = (long long)n * journal->block_size;
+    if (logged) {
+        journal->committed.push_back(t);
+    } else {
+        delete t;
+    }
+    return n;
+}
+
+#if (THREAD_SAFE)
+// The commit thread of the journal of instance i.
+static void commit_loop(INSTANCE_T *i) {
+    instance = i;
+    JOURNAL_T *journal = i->journal;
+    COMMITTER_T &committer = journal->committer;
+    auto last_commit = std::chrono::steady_clock::now();
+    UNIQUE_LOCK_T lock(committer.lock);
+    while (!committer.stop) {
+        committer.wake.wait_for(lock,
+                                std::chrono::milliseconds(JOURNAL_COMMIT_MS));
+        if (committer.stop) break;
+        lock.unlock();
+
+        auto now = std::chrono::steady_clock::now();
+        if (commit() > 0) last_commit = now;
+        {
+            // Checkpoint before the log fills up and stalls a commit, or
+            // while nothing happens
+            LOCK_T guard(journal->commit_lock);
+            if (journal->used > journal->ring / 2 ||
+                now - last_commit >
+                    std::chrono::milliseconds(JOURNAL_IDLE_MS)) {
+                checkpoint(journal->next_seq);
+            }
+        }
+        lock.lock();
+    }
+}
+
+static void stop_committer(COMMITTER_T *committer) {
+    if (!committer->thread.joinable()) return;
+    {
+        LOCK_T guard(committer->lock);
+        committer->stop = true;
+    }
+    committer->wake.notify_one();
+    committer->thread.join();
+    committer->stop = false;
+}
+
+COMMITTER_T::~COMMITTER_T() { stop_committer(this); }
+#endif
+
+JOURNAL_T *journal_new() { return new JOURNAL_T(); }
+
+void journal_delete(JOURNAL_T *journal) {
+#if (THREAD_SAFE)
+    stop_committer(&journal->committer);
+#endif
+    for (TXN_T *t : journal->committed) delete t;
+    delete[] journal->meta_dirty;
+    delete journal;
+}
+
+int journal_format(int first, int blocks) {
+    JOURNAL_T *journal = instance->journal;
+    if (blocks < JOURNAL_MIN_BLOCKS || disk_block_size() == 0) return -1;
+    for (int i = 1; i < blocks; ++i) init_block(first + i, 0);
+    journal->start = first;
+    journal->ring = blocks - 1;
+    journal->block_size = disk_block_size();
+    journal->head = 0;
+    journal->next_seq = 1;
+    write_header(journal->next_seq);
+    return 0;
+}
+
+int journal_replay(int first, int blocks) {
+    JOURNAL_T *journal = instance->journal;
+    journal->start = first;
+    journal->ring = blocks - 1;
+    journal->block_size = disk_block_size();
+    HEADER_T h;
+    if (blocks < JOURNAL_MIN_BLOCKS || read_header(&h) < 0 ||
+        memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0 ||
+        h.total_blocks != (int)disk_blocks() ||
+        h.block_size != journal->block_size || h.blocks != blocks ||
+        h.head < 0 || h.head >= journal->ring) {
+        return -1;
+    }
+
+    // Find the committed transactions: records of consecutive sequence
+    // numbers from the head, each transaction closed by a commit record. A
+    // log block failing its checksum ends the log like a torn write, so its
+    // transaction and the later ones are not replayed
+    struct IMAGE_T {
+        int home, pos;
+        unsigned int seq;
+    };
+    std::vector<IMAGE_T> images;
+    std::unordered_map<int, unsigned int> revoked;
+    std::vector<byte> buff(journal->block_size);
+    const int *r = (const int *)buff.data();
+    const int per = per_record();
+    int pos = h.head, length = 0, replayed = 0;
+    unsigned int seq = h.head_seq;
+    for (;;) {
+        std::vector<IMAGE_T> txn;
+        std::vector<int> txn_revoked;
+        int p = pos, n = length;
+        bool done = false;
+        while (!done && n < journal->ring) {
+            if (disk_check(log_block(p), 1) != 0 ||
+                read_block(log_block(p), buff.data()) < 0 ||
+                (unsigned int)r[1] != seq || r[2] < 0 || r[2] > per) {
+                break;
+            }
+            int count = r[2];
+            if (r[0] == RECORD_DESCRIPTOR) {
+                if (n + 1 + count > journal->ring) break;
+                int bad = 0;
+                for (int i = 0; i < count; ++i) {
+                    bad += disk_check(log_block(p + 1 + i), 1);
+                }
+                if (bad) break;
+                for (int i = 0; i < count; ++i) {
+                    txn.push_back({r[RECORD_HEADER + i], p + 1 + i, seq});
+                }
+                p += 1 + count;
+                n += 1 + count;
+            } else if (r[0] == RECORD_REVOKE) {
+                txn_revoked.insert(txn_revoked.end(), r + RECORD_HEADER,
+                                   r + RECORD_HEADER + count);
+                ++p;
+                ++n;
+            } else if (r[0] == RECORD_COMMIT) {
+                ++p;
+                ++n;
+                done = true;
+            } else {
+                break;
+            }
+        }
+        if (!done) break;
+
+        images.insert(images.end(), txn.begin(), txn.end());
+        for (int b : txn_revoked) revoked[b] = seq;
+        pos = p % journal->ring;
+        length = n;
+        ++seq;
+        ++replayed;
+    }
+
+    // An image of a block revoked by a later transaction is stale
+    for (const IMAGE_T &image : images) {
+        auto it = revoked.find(image.home);
+        if (it != revoked.end() && it->second > image.seq) continue;
+        if (image.home < 0 || image.home >= (int)disk_blocks() ||
+            read_block(log_block(image.pos), buff.data()) < 0) {
+            continue;
+        }
+        write_block(image.home, buff.data());
+    }
+    disk_sync();
+
+    // Start the next log after a gap in the sequence numbers, so the records
+    // of a transaction cut short by the crash are never taken for new ones
+    journal->head = pos;
+    journal->next_seq = seq + 1;
+    write_header(journal->next_seq);
+    return replayed;
+}
+
+int journal_open(int first, int blocks, byte *buffered, int meta_blocks,
+                 int max_txn_blocks,
+                 void (*release_blocks)(int first, int n)) {
+    JOURNAL_T *journal = instance->journal;
+    journal_close();
+    HEADER_T h;
+    journal->start = first;
+    journal->ring = blocks - 1;
+    journal->block_size = disk_block_size();
+    if (blocks < JOURNAL_MIN_BLOCKS || read_header(&h) < 0 ||
+        memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0 ||
+        h.blocks != blocks) {
+        return -1;
+    }
+    journal->head = h.head;
+    journal->next_seq = h.head_seq;
+    journal->used = 0;
+    journal->meta = buffered;
+    journal->meta_dirty = new std::atomic<bool>[meta_blocks];
+    for (int i = 0; i < meta_blocks; ++i) journal->meta_dirty[i] = false;
+    journal->max_blocks = max_txn_blocks;
+    journal->release = release_blocks;
+    journal->running_blocks = 0;
+    journal->pending_frees = 0;
+    journal->opened = true;
+#if (THREAD_SAFE)
+    journal->committer.thread = std::thread(commit_loop, instance);
+#endif
+    return 0;
+}
+
+void journal_close() {
+    JOURNAL_T *journal = instance->journal;
+    if (!journal->opened) return;
+#if (THREAD_SAFE)
+    stop_committer(&journal->committer);
+#endif
+    commit();
+    // Releasing the blocks it freed changed the bitmap again
+    commit();
+    {
+        LOCK_T guard(journal->commit_lock);
+        checkpoint(journal->next_seq);
+        journal->opened = false;
+    }
+    delete[] journal->meta_dirty;
+    journal->meta_dirty = NULL;
+    LOCK_T l(journal->latest_lock);
+    journal->latest.clear();
+}
+
+void journal_begin() {
+    JOURNAL_T *journal = instance->journal;
+    // Keep transactions small enough for the log and the cache
+    if (journal->opened &&
+        journal->running_blocks.load(std::memory_order_relaxed) >=
+            journal->max_blocks) {
+        commit();
+    }
+    journal->journal_lock.lock_shared();
+}
+
+void journal_end() { instance->journal->journal_lock.unlock_shared(); }
+
+void journal_dirty_meta(int b) {
+    JOURNAL_T *journal = instance->journal;
+    if (!journal->opened ||
+        journal->meta_dirty[b].exchange(true, std::memory_order_relaxed)) {
+        return;
+    }
+    LOCK_T guard(journal->txn_lock);
+    journal->running_meta.push_back(b);
+    ++journal->running_blocks;
+}
+
+void journal_dirty_cached(int b) {
+    JOURNAL_T *journal = instance->journal;
+    if (!journal->opened) return;
+    LOCK_T guard(journal->txn_lock);
+    if (!journal->held.insert(b).second) return;
+    cache_hold(b);
+    journal->running_cached.push_back(b);
+    ++journal->running_blocks;
+}
+
+void journal_free(int b) {
+    JOURNAL_T *journal = instance->journal;
+    if (!journal->opened) {
+        if (journal->release) journal->release(b, 1);
+        return;
+    }
+    bool logged;
+    {
+        LOCK_T l(journal->latest_lock);
+        logged = journal->latest.count(b) > 0;
+    }
+    LOCK_T guard(journal->txn_lock);
+    // A block changed and freed by the running transaction is not logged
+    std::vector<int> &cached = journal->running_cached;
+    if (journal->held.erase(b)) {
+        cached.erase(std::find(cached.begin(), cached.end(), b));
+        cache_release(b);
+        --journal->running_blocks;
+    }
+    // Older images of it in the log must not be replayed over its next use
+    if (logged) journal->running_revoked.push_back(b);
+    journal->running_freed.push_back(b);
+    ++journal->pending_frees;
+}
+
+void journal_free_run(int first, int n) {
+    JOURNAL_T *journal = instance->journal;
+    if (!journal->opened) {
+        if (journal->release) journal->release(first, n);
+        return;
+    }
+    std::vector<int> logged;
+    {
+        LOCK_T l(journal->latest_lock);
+        if (!journal->latest.empty()) {
+            for (int b = first; b < first + n; ++b) {
+                if (journal->latest.count(b)) logged.push_back(b);
+            }
+        }
+    }
+    LOCK_T guard(journal->txn_lock);
+    if (!journal->held.empty()) {
+        std::vector<int> &cached = journal->running_cached;
+        for (int b = first; b < first + n; ++b) {
+            if (journal->held.erase(b)) {
+                cached.erase(std::find(cached.begin(), cached.end(), b));
+                cache_release(b);
+                --journal->running_blocks;
+            }
+        }
+    }
+    journal->running_revoked.insert(journal->running_revoked.end(),
+                                    logged.begin(), logged.end());
+    for (int b = first; b < first + n; ++b) journal->running_freed.push_back(b);
+    journal->pending_frees += n;
+}
+
+int journal_pending_frees() { return instance->journal->pending_frees; }
+
+int journal_commit() {
+    JOURNAL_T *journal = instance->journal;
+    if (!journal->opened) return -1;
+    commit();
+    return 0;
+}
+
+int journal_checkpoint() {
+    JOURNAL_T *journal = instance->journal;
+    LOCK_T guard(journal->commit_lock);
+    if (!journal->opened) return -1;
+    checkpoint(journal->next_seq);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "disk.h"
+
+#define JOURNAL_MIN_BLOCKS 16  // fewest blocks of a journal
+#define JOURNAL_COMMIT_MS 5    // longest wait of a change for its commit
+
+// Write-ahead journal of metadata blocks. Changes are grouped into
+// transactions: every operation runs inside a handle, and one commit writes
+// the blocks changed by all the operations since the last commit to the log
+// as a single sequential write, followed by a commit block. Committed blocks
+// are written to their home locations later (checkpointing), and the log
+// is replayed when the disk is mounted after a crash.
+//
+// The journal lives in the blocks [start, start + blocks) of the disk:
+// a header block, then the log as a ring. A transaction in the log is a
+// run of descriptor blocks, each followed by the images of the blocks it
+// lists, and revoke blocks, closed by a commit block.
+//
+// With THREAD_SAFE a background thread commits every JOURNAL_COMMIT_MS and
+// checkpoints while the log fills up or the file system is idle; otherwise
+// commits happen when a transaction grows large and on journal_commit().
+
+// Erase the journal in [start, start + blocks).
+int journal_format(int start, int blocks);
+// Write the committed transactions in the log to their home blocks and
+// empty the log. Return how many were replayed, or -1 if there is no
+// journal of this geometry at start.
+int journal_replay(int start, int blocks);
+
+// Start journaling. meta holds the buffered metadata blocks
+// [0, meta_blocks), changes to which are reported with journal_dirty_meta();
+// other metadata blocks live in the cache. A transaction is committed once
+// it has max_blocks blocks. release(first, n) makes freed blocks
+// allocatable again once the transaction freeing them is on disk.
+int journal_open(int start, int blocks, byte *meta, int meta_blocks,
+                 int max_blocks, void (*release)(int first, int n));
+// Commit, checkpoint and stop journaling.
+void journal_close();
+
+// Every change to metadata happens inside a handle; a commit waits for the
+// handles in progress. Take handles after every other lock of the file
+// system, and do not wait for one while holding a handle.
+void journal_begin();
+void journal_end();
+
+struct JOURNAL_HANDLE_T {
+    JOURNAL_HANDLE_T() { journal_begin(); }
+    ~JOURNAL_HANDLE_T() { journal_end(); }
+    JOURNAL_HANDLE_T(const JOURNAL_HANDLE_T &) = delete;
+    JOURNAL_HANDLE_T &operator=(const JOURNAL_HANDLE_T &) = delete;
+};
+
+// Buffered block b was changed by the current handle.
+void journal_dirty_meta(int b);
+// Cached block b, pinned by the caller, was changed by the current handle.
+// It stays in the cache until its transaction is committed.
+void journal_dirty_cached(int b);
+// Block b was freed by the current handle. It is released once the
+// transaction is on disk, so no committed metadata points to it before.
+void journal_free(int b);
+// journal_free() of each block of [first, first + n), taking the locks once.
+void journal_free_run(int first, int n);
+// Number of freed blocks waiting for their transaction.
+int journal_pending_frees();
+
+// Make every finished handle durable, return 0 or -1 if the journal is not
+// open.
+int journal_commit();
+// Write the committed transactions to their home blocks and empty the log.
+int journal_checkpoint();
+
+#endif  //_JOURNAL_H_
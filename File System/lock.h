@@ -0,0 +1,36 @@
+#pragma once
+
+#ifndef _LOCK_H_
+#define _LOCK_H_
+
+#include <mutex>
+#include <shared_mutex>
+
+// Build with -DTHREAD_SAFE=0 for a single threaded file system, the locks
+// then compile to nothing.
+#ifndef THREAD_SAFE
+#define THREAD_SAFE 1
+#endif
+
+#if (THREAD_SAFE)
+typedef std::mutex MUTEX_T;
+typedef std::shared_mutex RW_LOCK_T;
+#else
+struct MUTEX_T {
+    void lock() {}
+    void unlock() {}
+    bool try_lock() { return true; }
+};
+struct RW_LOCK_T : MUTEX_T {
+    void lock_shared() {}
+    void unlock_shared() {}
+    bool try_lock_shared() { return true; }
+};
+#endif
+
+typedef std::lock_guard<MUTEX_T> LOCK_T;
+typedef std::unique_lock<MUTEX_T> UNIQUE_LOCK_T;
+typedef std::unique_lock<RW_LOCK_T> WRITE_LOCK_T;
+typedef std::shared_lock<RW_LOCK_T> READ_LOCK_T;
+
+#endif  //_LOCK_H_
@@ -0,0 +1,144 @@
+#include "lz.h"
+#include <cstdint>
+#include <cstring>
+
+#define LZ_SKIP_SHIFT 5  // the scan speeds up after 2^LZ_SKIP_SHIFT misses
+
+static inline uint32_t load32(const byte *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load64(const byte *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline int hash_of(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write a length past its nibble, in bytes of 255 and the remainder.
+static byte *put_length(byte *op, int len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+// Append the sequence of literals [lit, lit + n) and a match of len bytes
+// offset back, none if len is 0. Return the new end, or NULL past end.
+static byte *put_sequence(byte *op, byte *end, const byte *lit, int n,
+                          int offset, int len) {
+    // The worst case: token, lengths, literals and offset
+    if (end - op < 1 + n / 255 + 1 + n + 2 + len / 255 + 1) return NULL;
+    const int m = len ? len - LZ_MIN_MATCH : 0;
+    byte *token = op++;
+    *token = (n < 15 ? n : 15) << 4 | (m < 15 ? m : 15);
+    if (n >= 15) op = put_length(op, n - 15);
+    memcpy(op, lit, n);
+    op += n;
+    if (len == 0) return op;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (m >= 15) op = put_length(op, m - 15);
+    return op;
+}
+
+int lz_compress(const byte *in, int n, byte *out, int max) {
+    int table[1 << LZ_HASH_BITS];
+    for (int &e : table) e = -1;
+
+    byte *op = out, *end = out + max;
+    int anchor = 0, i = 0, misses = 0;
+    // A match may not start in the last LZ_MIN_MATCH bytes
+    while (i + LZ_MIN_MATCH <= n) {
+        const uint32_t v = load32(in + i);
+        const int h = hash_of(v);
+        const int candidate = table[h];
+        table[h] = i;
+        if (candidate < 0 || i - candidate > LZ_MAX_OFFSET ||
+            load32(in + candidate) != v) {
+            i += 1 + (misses++ >> LZ_SKIP_SHIFT);
+            continue;
+        }
+        // Extend the match 8 bytes at a time, the first byte to differ
+        // is the lowest set byte of the xor
+        int len = LZ_MIN_MATCH;
+        while (i + len + 8 <= n) {
+            const uint64_t x =
+                load64(in + candidate + len) ^ load64(in + i + len);
+            if (x) {
+                len += __builtin_ctzll(x) / 8;
+                goto extended;
+            }
+            len += 8;
+        }
+        while (i + len < n && in[candidate + len] == in[i + len]) ++len;
+    extended:
+        op = put_sequence(op, end, in + anchor, i - anchor, i - candidate,
+                          len);
+        if (!op) return -1;
+        i += len;
+        anchor = i;
+        misses = 0;
+        // The end of a match often starts the next one
+        if (i + LZ_MIN_MATCH <= n) {
+            table[hash_of(load32(in + i - 2))] = i - 2;
+        }
+    }
+    op = put_sequence(op, end, in + anchor, n - anchor, 0, 0);
+    return op ? op - out : -1;
+}
+
+// Read a length past its nibble, or -1 past the end of the input.
+static int get_length(const byte *in, int n, int *ip, int len) {
+    byte b;
+    do {
+        if (*ip >= n) return -1;
+        b = in[(*ip)++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lz_decompress(const byte *in, int n, byte *out, int max) {
+    int ip = 0, op = 0;
+    while (ip < n) {
+        const byte token = in[ip++];
+        int lit = token >> 4;
+        if (lit == 15 && (lit = get_length(in, n, &ip, lit)) < 0) return -1;
+        if (lit > n - ip || lit > max - op) return -1;
+        // Short runs are copied 16 bytes at once where there is room
+        if (lit <= 16 && n - ip >= 16 && max - op >= 16) {
+            memcpy(out + op, in + ip, 16);
+        } else {
+            memcpy(out + op, in + ip, lit);
+        }
+        ip += lit;
+        op += lit;
+        if (ip == n) break;  // the last sequence
+
+        if (n - ip < 2) return -1;
+        const int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        int len = token & 15;
+        if (len == 15 && (len = get_length(in, n, &ip, len)) < 0) return -1;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || len > max - op) return -1;
+        // An overlapping match repeats the bytes it copies, 8 bytes at a
+        // time if they are 8 bytes back or more, past its end if there is
+        // room
+        const byte *from = out + op - offset;
+        if (offset >= 8 && max - op >= len + 8) {
+            for (int k = 0; k < len; k += 8) memcpy(out + op + k, from + k, 8);
+        } else if (offset >= len) {
+            memcpy(out + op, from, len);
+        } else {
+            for (int k = 0; k < len; ++k) out[op + k] = from[k];
+        }
+        op += len;
+    }
+    return op;
+}
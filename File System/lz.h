@@ -0,0 +1,25 @@
+#pragma once
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include "disk.h"
+
+#define LZ_MIN_MATCH 4        // shortest match encoded
+#define LZ_MAX_OFFSET 65535   // farthest match back
+#define LZ_HASH_BITS 12       // entries of the match finder, 2^LZ_HASH_BITS
+
+// A fast LZ77 codec in the manner of LZ4. The output is a run of
+// sequences, each a token byte (literal count in the high nibble, match
+// length - LZ_MIN_MATCH in the low one, 15 meaning more bytes of 255 or
+// less follow), the literals, and a 2-byte little-endian offset back to
+// the match. The last sequence has literals only.
+
+// Compress the n bytes at in into out, return the compressed length or -1
+// if it would take more than max bytes.
+int lz_compress(const byte *in, int n, byte *out, int max);
+// Decompress the n bytes at in into out, return the decompressed length or
+// -1 if in is not a valid stream or would take more than max bytes.
+int lz_decompress(const byte *in, int n, byte *out, int max);
+
+#endif  //_LZ_H_
@@ -1,7 +1,10 @@
 #include <cstring>
 #include <iostream>
+#include <vector>
 
 #include "FS.h"
+#include "disk.h"
+#include "stats.h"
 
 #ifndef DEBUG
 #define DEBUG 0
@@ -33,6 +36,16 @@ void simple_test() {
 ●de <name>
  destroy the named file <name>
  Output: <name> destroyed
+●md <name>
+ make a directory with the name <name>
+ Output: <name> created
+●dd <name>
+ remove the empty directory <name>
+ Output: <name> removed
+●cp <name> <copy>
+ clone the file <name> as <copy>, sharing its blocks until either is written
+ Output: <copy> cloned
+ Names are paths: directory names and a file name separated by /
  
 ●op <name>
  open the named file <name> for reading and writing; display an index value
@@ -55,16 +68,41 @@ at location M[<mem>]) to open file <index> (starting from current position)
 where n is the number of characters actually written (less or equal <count>)
  
 ●sk <index> <pos>
- seek: set the current position of the specified file <index> to <pos>
+ seek: set the current position of the specified file <index> to <pos>, which
+may be past the end of the file
  Output: position is <pos>
+
+●tr <index> <len>
+ truncate: set the size of the specified file <index> to <len>
+ Output: <index> truncated to <len>
+
+●fa <index> <pos> <len>
+ allocate the blocks of <len> bytes at <pos> of the specified file <index> up
+front, keeping its size
+ Output: <len> bytes allocated to <index>
+
+●cz <on> [<index>]
+ turn compression of the specified file <index> on (1) or off (0), or without
+<index> of the files created from now on
+ Output: [<index>] compression <on|off>
+
+●dp [<on>]
+ turn deduplication of the whole blocks written on (1) or off (0), or
+without <on> show what it saved
+ Output: dedup <on|off>, or dedup ratio <ratio>: <n> blocks written, <m>
+reused, <k> indexed
  
-●dr
- directory: list the names and lengths of all files
+●dr [<name>]
+ directory: list the names and lengths of all files in the root directory or
+in directory <name>, the names of directories end with /
  Output: <file0> <len1> <file1> <len2> ... <fileN> <lenN>
  
 ●in
  initialize the system to the original starting configuration
  Output: system initialized
+●mo
+ mount the file system already on the disk image, keeping its files
+ Output: system mounted
 ●rm <mem> <count>
  copy <count> bytes from memory M staring with position <mem> to output device
 (terminal or file) oOutput: <xx...x> where each x is a character
@@ -74,12 +112,24 @@ where n is the number of characters actually written (less or equal <count>)
 (terminal or file) oOutput: <n> bytes written to M where n is the length of
 <str>
 
+●st [on|off|reset]
+ statistics: print the calls, bytes and latencies of each operation and the
+cache hits and misses, or turn collecting them on or off, or zero them
+ Output: one line per operation, or stats <on|off|reset>
+
 ●If any command fails, output: error
 */
 
 /* Tokenize the cmd into words, return number of words. */
 int tokenize(char* line, char** words);
 
+/* The commands show the index of a handle, this maps it back. */
+static std::vector<int> handles;
+
+int handle_of(int index) {
+    return index > 0 && index < (int)handles.size() ? handles[index] : -1;
+}
+
 void solve(FILE* in, FILE* out) {
     // FS_init();
     int init = 0;
@@ -88,6 +138,7 @@ void solve(FILE* in, FILE* out) {
     char M[BUFSIZ];
     char line[BUFSIZ], *cmd, *args[MAX_CMD_ARGS];
     memset(M, 0, sizeof(M));
+    FS_stats_enable(1);
     while (fgets(line, BUFSIZ, in)) {
         memset(args, 0, sizeof(args));
         int words = tokenize(line, args);
@@ -118,12 +169,39 @@ void solve(FILE* in, FILE* out) {
             } else {
                 fprintf(out, "error\n");
             }
+        } else if (strcmp(cmd, "md") == 0) {
+            // make a directory with the name <name>
+            // Output: <name> created
+            if (mkdir(args[1]) == 0) {
+                fprintf(out, "%s created\n", args[1]);
+            } else {
+                fprintf(out, "error\n");
+            }
+        } else if (strcmp(cmd, "dd") == 0) {
+            // remove the empty directory <name>
+            // Output: <name> removed
+            if (rmdir(args[1]) == 0) {
+                fprintf(out, "%s removed\n", args[1]);
+            } else {
+                fprintf(out, "error\n");
+            }
+        } else if (strcmp(cmd, "cp") == 0) {
+            // clone the file <name> as <copy>
+            // Output: <copy> cloned
+            if (args[2] && FS_clone(args[1], args[2]) == 0) {
+                fprintf(out, "%s cloned\n", args[2]);
+            } else {
+                fprintf(out, "error\n");
+            }
         } else if (strcmp(cmd, "op") == 0) {
             // open the named file <name> for reading and writing;
             // display an index value
             // Output: <name> opened <index>
             if ((fh = open(args[1])) > 0) {
-                fprintf(out, "%s opened %d\n", args[1], fh);
+                int index = FH_INDEX(fh);
+                if (index >= (int)handles.size()) handles.resize(index + 1);
+                handles[index] = fh;
+                fprintf(out, "%s opened %d\n", args[1], index);
             } else {
                 fprintf(out, "error\n");
             }
@@ -131,7 +209,7 @@ void solve(FILE* in, FILE* out) {
             // close the specified file <index>
             // Output: <index> closed
             int index = atoi(args[1]);
-            if (index > 0 && close(index) == 0) {
+            if (index > 0 && close(handle_of(index)) == 0) {
                 fprintf(out, "%d closed\n", index);
             } else {
                 fprintf(out, "error\n");
@@ -147,7 +225,7 @@ void solve(FILE* in, FILE* out) {
             int count = atoi(args[3]);
             int n;
             if (index > 0 && mem >= 0 && count >= 0 &&
-                (n = read(index, M + mem, count)) >= 0) {
+                (n = read(handle_of(index), M + mem, count)) >= 0) {
                 fprintf(out, "%d bytes read from %d\n", n, index);
             } else {
                 fprintf(out, "error\n");
@@ -163,7 +241,7 @@ void solve(FILE* in, FILE* out) {
             int count = atoi(args[3]);
             int n;
             if (index > 0 && mem >= 0 && count >= 0 &&
-                (n = write(index, M + mem, count)) >= 0) {
+                (n = write(handle_of(index), M + mem, count)) >= 0) {
                 fprintf(out, "%d bytes written to %d\n", n, index);
             } else {
                 fprintf(out, "error\n");
@@ -174,15 +252,69 @@ void solve(FILE* in, FILE* out) {
             // Output: position is <pos>
             int index = atoi(args[1]);
             int pos = atoi(args[2]);
-            if (index > 0 && pos >= 0 && seek(index, pos) == 0) {
+            if (index > 0 && pos >= 0 && seek(handle_of(index), pos) == 0) {
                 fprintf(out, "position is %d\n", pos);
             } else {
                 fprintf(out, "error\n");
             }
+        } else if (strcmp(cmd, "tr") == 0) {
+            // truncate: set the size of the specified file <index> to <len>
+            // Output: <index> truncated to <len>
+            int index = atoi(args[1]);
+            int len = atoi(args[2]);
+            if (index > 0 && len >= 0 && truncate(handle_of(index), len) == 0) {
+                fprintf(out, "%d truncated to %d\n", index, len);
+            } else {
+                fprintf(out, "error\n");
+            }
+        } else if (strcmp(cmd, "fa") == 0) {
+            // allocate the blocks of <len> bytes at <pos> of the specified
+            // file <index>
+            // Output: <len> bytes allocated to <index>
+            int index = atoi(args[1]);
+            int pos = atoi(args[2]);
+            int len = atoi(args[3]);
+            if (index > 0 && pos >= 0 && len >= 0 &&
+                fallocate(handle_of(index), pos, len) == 0) {
+                fprintf(out, "%d bytes allocated to %d\n", len, index);
+            } else {
+                fprintf(out, "error\n");
+            }
+        } else if (strcmp(cmd, "cz") == 0) {
+            // turn compression of file <index>, or of new files, on or off
+            // Output: [<index>] compression <on|off>
+            int on = atoi(args[1]);
+            int index = args[2] ? atoi(args[2]) : 0;
+            if (args[2] ? index > 0 && FS_compress(handle_of(index), on) == 0
+                        : FS_set_compression(on) == 0) {
+                if (index > 0) fprintf(out, "%d ", index);
+                fprintf(out, "compression %s\n", on ? "on" : "off");
+            } else {
+                fprintf(out, "error\n");
+            }
+        } else if (strcmp(cmd, "dp") == 0) {
+            // turn deduplication on or off, or show what it saved
+            // Output: dedup <on|off>, or dedup ratio <ratio>: <n> blocks
+            // written, <m> reused, <k> indexed
+            FS_DEDUP_T stats;
+            if (args[1]) {
+                int on = atoi(args[1]);
+                FS_set_dedup(on);
+                fprintf(out, "dedup %s\n", on ? "on" : "off");
+            } else if (FS_dedup_stats(&stats) == 0) {
+                fprintf(out,
+                        "dedup ratio %.2f: %lld blocks written, %lld reused, "
+                        "%lld indexed\n",
+                        stats.ratio, stats.blocks_written,
+                        stats.blocks_reused, stats.indexed);
+            } else {
+                fprintf(out, "error\n");
+            }
         } else if (strcmp(cmd, "dr") == 0) {
-            // directory: list the names and lengths of all files
+            // directory: list the names and lengths of all files in the root
+            // directory or in directory <name>
             // Output: <file0> <len1> <file1> <len2> ... <fileN> <lenN>
-            if (directory() >= 0) {
+            if ((args[1] ? FS_directory(args[1]) : directory()) >= 0) {
             } else {
                 fprintf(out, "error\n");
             }
@@ -195,11 +327,25 @@ void solve(FILE* in, FILE* out) {
                 fprintf(out, "\n");
             }
 
+            handles.clear();
             if (FS_init() == 0) {
                 fprintf(out, "system initialized\n");
             } else {
                 fprintf(out, "error\n");
             }
+        } else if (strcmp(cmd, "mo") == 0) {
+            // mount the file system already on the disk image
+            // Output: system mounted
+            if (++init > 1) {
+                fprintf(out, "\n");
+            }
+
+            handles.clear();
+            if (FS_mount() == 0) {
+                fprintf(out, "system mounted\n");
+            } else {
+                fprintf(out, "error\n");
+            }
         } else if (strcmp(cmd, "rm") == 0) {
             // copy <count> bytes from memory M staring with position <mem> to
             // output device (terminal or file)
@@ -219,6 +365,22 @@ void solve(FILE* in, FILE* out) {
             unsigned int n = strlen(args[2]);
             memcpy(M + mem, args[2], n);
             fprintf(out, "%u bytes written to M\n", n);
+        } else if (strcmp(cmd, "st") == 0) {
+            // statistics: print the metrics, or turn them on or off, or
+            // zero them
+            // Output: one line per operation, or stats <on|off|reset>
+            if (args[1] == NULL) {
+                FS_stats_print(out);
+            } else if (strcmp(args[1], "on") == 0 ||
+                       strcmp(args[1], "off") == 0) {
+                FS_stats_enable(strcmp(args[1], "on") == 0);
+                fprintf(out, "stats %s\n", args[1]);
+            } else if (strcmp(args[1], "reset") == 0) {
+                FS_stats_reset();
+                fprintf(out, "stats reset\n");
+            } else {
+                fprintf(out, "error\n");
+            }
         } else {
 #if (DEBUG)
             printf("Unkown cmd\n");
@@ -230,9 +392,46 @@ void solve(FILE* in, FILE* out) {
     FS_close();
 }
 
-int main(/* int argc, char** argv */) {
+/*
+Usage: FS [-p] [-H] [-s] [-c <blocks>] [<image> [<blocks> [<block size>]]]
+ Run the commands on a disk image file, which is created or grown to
+<blocks> * <block size> bytes, instead of the in-memory disk.
+ -p  prefault the whole image
+ -H  use huge pages for the image
+ -s  keep a checksum of every block of the image
+ -c  capacity of the block cache in blocks
+*/
+int main(int argc, char** argv) {
+    int flags = 0, i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "-p") == 0) {
+            flags |= DISK_POPULATE;
+        } else if (strcmp(argv[i], "-H") == 0) {
+            flags |= DISK_HUGEPAGES;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            flags |= DISK_CHECKSUMS;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            FS_set_cache_size(atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (i < argc) {
+        const char* image = argv[i];
+        unsigned int blocks = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+        unsigned int block_size = i + 2 < argc ? atoi(argv[i + 2]) : BLOCK_SIZE;
+        // A new image without the number of blocks gets the default geometry
+        if (disk_open(image, blocks, block_size, flags) < 0 &&
+            (blocks != 0 || disk_open(image, BLOCKS, block_size, flags) < 0)) {
+            fprintf(stderr, "cannot open disk image %s\n", image);
+            return 1;
+        }
+    }
+
     solve(stdin, stdout);
 
+    disk_close();
     return 0;
 }
 
@@ -0,0 +1,124 @@
+#include "stats.h"
+#include <chrono>
+
+static const char *const NAMES[STAT_OPS] = {
+    "create", "destroy", "open", "close",      "read",
+    "write",  "seek",    "alloc", "block_read", "block_write",
+    "commit", "compress", "decompress"};
+
+#if (FS_STATS)
+// Lock-free: every field is bumped with a relaxed atomic add, so the
+// metrics are exact but a snapshot may mix calls in flight.
+struct alignas(64) OP_STATS_T {
+    std::atomic<unsigned long long> calls, bytes, latency[STAT_BUCKETS];
+};
+
+std::atomic<bool> stats_on;
+static OP_STATS_T OPS[STAT_OPS];
+static std::atomic<unsigned long long> COUNTERS[STAT_COUNTERS];
+
+long long stats_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void stats_record(int op, long long ns, long long bytes) {
+    int bucket = ns > 0 ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= STAT_BUCKETS) bucket = STAT_BUCKETS - 1;
+    OP_STATS_T *s = &OPS[op];
+    s->calls.fetch_add(1, std::memory_order_relaxed);
+    if (bytes > 0) s->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    s->latency[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void stats_count(int counter) {
+    COUNTERS[counter].fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+void FS_stats_enable(int on) {
+#if (FS_STATS)
+    stats_on.store(on != 0, std::memory_order_relaxed);
+#else
+    (void)on;
+#endif
+}
+
+int FS_stats_enabled() {
+#if (FS_STATS)
+    return stats_enabled();
+#else
+    return 0;
+#endif
+}
+
+void FS_stats_reset() {
+#if (FS_STATS)
+    for (int op = 0; op < STAT_OPS; ++op) {
+        OPS[op].calls = 0;
+        OPS[op].bytes = 0;
+        for (int i = 0; i < STAT_BUCKETS; ++i) OPS[op].latency[i] = 0;
+    }
+    for (int i = 0; i < STAT_COUNTERS; ++i) COUNTERS[i] = 0;
+#endif
+}
+
+const char *FS_stats_name(int op) {
+    return op >= 0 && op < STAT_OPS ? NAMES[op] : NULL;
+}
+
+int FS_stats_get(int op, FS_STATS_T *stats) {
+    if (op < 0 || op >= STAT_OPS) return -1;
+#if (FS_STATS)
+    stats->calls = OPS[op].calls.load(std::memory_order_relaxed);
+    stats->bytes = OPS[op].bytes.load(std::memory_order_relaxed);
+    for (int i = 0; i < STAT_BUCKETS; ++i) {
+        stats->latency[i] = OPS[op].latency[i].load(std::memory_order_relaxed);
+    }
+#else
+    *stats = FS_STATS_T();
+#endif
+    return 0;
+}
+
+unsigned long long FS_stats_counter(int counter) {
+    if (counter < 0 || counter >= STAT_COUNTERS) return 0;
+#if (FS_STATS)
+    return COUNTERS[counter].load(std::memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
+
+unsigned long long FS_stats_percentile(int op, double percent) {
+    FS_STATS_T s;
+    if (FS_stats_get(op, &s) < 0) return 0;
+
+    unsigned long long total = 0, seen = 0;
+    for (int i = 0; i < STAT_BUCKETS; ++i) total += s.latency[i];
+    if (total == 0) return 0;
+    for (int i = 0; i < STAT_BUCKETS; ++i) {
+        seen += s.latency[i];
+        if (seen * 100.0 >= total * percent) return 1ULL << i;
+    }
+    return 1ULL << (STAT_BUCKETS - 1);
+}
+
+void FS_stats_print(FILE *out) {
+    fprintf(out, "%-12s %10s %12s %10s %10s\n", "op", "calls", "bytes",
+            "p50(ns)", "p99(ns)");
+    for (int op = 0; op < STAT_OPS; ++op) {
+        FS_STATS_T s;
+        FS_stats_get(op, &s);
+        fprintf(out, "%-12s %10llu %12llu %10llu %10llu\n", NAMES[op],
+                s.calls, s.bytes, FS_stats_percentile(op, 50),
+                FS_stats_percentile(op, 99));
+    }
+    fprintf(out, "cache hits %llu misses %llu\n",
+            FS_stats_counter(STAT_CACHE_HIT),
+            FS_stats_counter(STAT_CACHE_MISS));
+    fprintf(out, "dcache hits %llu misses %llu\n",
+            FS_stats_counter(STAT_DCACHE_HIT),
+            FS_stats_counter(STAT_DCACHE_MISS));
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <atomic>
+#include <cstdio>
+
+// Build with -DFS_STATS=0 to compile the instrumentation out. Compiled in,
+// it costs one relaxed load per call until FS_stats_enable() turns it on.
+#ifndef FS_STATS
+#define FS_STATS 1
+#endif
+
+// Instrumented operations
+#define STAT_CREATE 0
+#define STAT_DESTROY 1
+#define STAT_OPEN 2
+#define STAT_CLOSE 3
+#define STAT_READ 4
+#define STAT_WRITE 5
+#define STAT_SEEK 6
+#define STAT_ALLOC 7        // block allocation
+#define STAT_BLOCK_READ 8   // read_block()
+#define STAT_BLOCK_WRITE 9  // write_block()
+#define STAT_COMMIT 10      // journal commit
+#define STAT_COMPRESS 11    // compressing a cluster
+#define STAT_DECOMPRESS 12  // decompressing a cluster
+#define STAT_OPS 13
+
+// Event counters
+#define STAT_CACHE_HIT 0
+#define STAT_CACHE_MISS 1
+#define STAT_DCACHE_HIT 2  // dentry cache
+#define STAT_DCACHE_MISS 3
+#define STAT_COUNTERS 4
+
+// Latency histogram: bucket 0 counts calls under 1ns, bucket i > 0 the
+// calls of [2^(i-1), 2^i) ns, the last bucket everything slower.
+#define STAT_BUCKETS 40
+
+struct FS_STATS_T {
+    unsigned long long calls;
+    unsigned long long bytes;  // data moved by the calls
+    unsigned long long latency[STAT_BUCKETS];
+};
+
+// Metrics are collected only while enabled, they are off at start.
+void FS_stats_enable(int on);
+int FS_stats_enabled();
+void FS_stats_reset();
+const char *FS_stats_name(int op);
+// Copy the metrics of op, return -1 if there is no such operation.
+int FS_stats_get(int op, FS_STATS_T *stats);
+unsigned long long FS_stats_counter(int counter);
+// Upper bound in ns of the latency of percent % of the calls of op.
+unsigned long long FS_stats_percentile(int op, double percent);
+// Print every operation and counter, one per line.
+void FS_stats_print(FILE *out);
+
+// Instrumentation
+
+#if (FS_STATS)
+extern std::atomic<bool> stats_on;
+
+static inline bool stats_enabled() {
+    return stats_on.load(std::memory_order_relaxed);
+}
+long long stats_now();  // ns
+void stats_record(int op, long long ns, long long bytes);
+void stats_count(int counter);
+
+// Times an operation from its construction to its destruction. Set bytes
+// to the amount of data the operation moved.
+struct STAT_TIMER_T {
+    int op;
+    long long start, bytes;
+    explicit STAT_TIMER_T(int op)
+        : op(op), start(stats_enabled() ? stats_now() : -1), bytes(0) {}
+    ~STAT_TIMER_T() {
+        if (start >= 0) stats_record(op, stats_now() - start, bytes);
+    }
+};
+
+#define STAT_COUNT(counter)                        \
+    do {                                           \
+        if (stats_enabled()) stats_count(counter); \
+    } while (0)
+#else
+struct STAT_TIMER_T {
+    long long bytes;
+    explicit STAT_TIMER_T(int) {}
+};
+
+#define STAT_COUNT(counter) ((void)0)
+#endif
+
+#endif  //_STATS_H_
@@ -0,0 +1,139 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "FS.h"
+#include "disk.h"
+
+// Multi-threaded stress test: every thread works on files of its own,
+// writing and reading back blocks at random offsets and now and then
+// recreating a file. Reports the throughput for 1, 2, 4, ... threads and
+// fails if any read returns data that was never written.
+//
+// stress [<seconds per run> [<most threads>]]
+
+#define DISK_BLOCKS 16384
+#define DISK_BLOCK_SIZE 4096
+#define FILES_PER_THREAD 2
+#define FILE_SPAN (256 * 1024)  // offsets written in each file
+#define IO_SIZE 4096
+#define RECREATE_EVERY 256  // ops between recreating a file
+
+static std::atomic<bool> running;
+static std::atomic<long> errors;
+
+// The byte written at pos of any file, so every read can be checked.
+static inline char pattern(int pos) { return (char)(pos * 7 + pos / 251); }
+
+static void file_name(char *name, int thread, int k) {
+    name[0] = 'a' + k;
+    name[1] = '0' + thread / 10;
+    name[2] = '0' + thread % 10;
+    name[3] = '\0';
+}
+
+// Write the pattern to [begin, end) of the file, return 0 on success.
+static int fill(int fh, int begin, int end) {
+    char buff[IO_SIZE];
+    if (seek(fh, begin) < 0) return -1;
+    while (begin < end) {
+        int n = end - begin < IO_SIZE ? end - begin : IO_SIZE;
+        for (int i = 0; i < n; ++i) buff[i] = pattern(begin + i);
+        if (write(fh, buff, n) != n) return -1;
+        begin += n;
+    }
+    return 0;
+}
+
+static void worker(int thread, long *ops) {
+    char name[FILES_PER_THREAD][4];
+    int fh[FILES_PER_THREAD], size[FILES_PER_THREAD];
+    for (int k = 0; k < FILES_PER_THREAD; ++k) {
+        file_name(name[k], thread, k);
+        create(name[k]);
+        fh[k] = open(name[k]);
+        size[k] = 0;
+    }
+
+    unsigned int seed = thread * 2654435761u + 1;
+    char buff[IO_SIZE];
+    long n = 0;
+    while (running.load(std::memory_order_relaxed)) {
+        int k = rand_r(&seed) % FILES_PER_THREAD;
+        int pos = rand_r(&seed) % (FILE_SPAN / IO_SIZE) * IO_SIZE;
+
+        if (n % RECREATE_EVERY == RECREATE_EVERY - 1) {
+            close(fh[k]);
+            destroy(name[k]);
+            create(name[k]);
+            fh[k] = open(name[k]);
+            size[k] = 0;
+        } else if (rand_r(&seed) % 2) {
+            // Extend the file up to pos first, so there are no holes
+            int begin = pos < size[k] ? pos : size[k];
+            if (fill(fh[k], begin, pos + IO_SIZE) < 0) ++errors;
+            if (size[k] < pos + IO_SIZE) size[k] = pos + IO_SIZE;
+        } else if (seek(fh[k], pos < size[k] ? pos : 0) == 0) {
+            int from = pos < size[k] ? pos : 0;
+            int got = read(fh[k], buff, IO_SIZE);
+            for (int i = 0; i < got; ++i) {
+                if (buff[i] != pattern(from + i)) {
+                    ++errors;
+                    break;
+                }
+            }
+        }
+        ++n;
+    }
+
+    for (int k = 0; k < FILES_PER_THREAD; ++k) {
+        close(fh[k]);
+        destroy(name[k]);
+    }
+    *ops = n;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    int max_threads = argc > 2 ? atoi(argv[2])
+                               : 2 * (int)std::thread::hardware_concurrency();
+    if (max_threads < 1 || max_threads > 99) max_threads = 8;
+
+    if (disk_open(NULL, DISK_BLOCKS, DISK_BLOCK_SIZE, 0) < 0 ||
+        FS_set_cache_size(1024) < 0 || FS_init() < 0) {
+        fprintf(stderr, "cannot set up the file system\n");
+        return 1;
+    }
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        std::vector<long> ops(threads);
+        std::vector<std::thread> pool;
+        running = true;
+        auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back(worker, t, &ops[t]);
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        running = false;
+        for (auto &t : pool) t.join();
+        double elapsed = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+        long total = 0;
+        for (long n : ops) total += n;
+        printf("threads %2d: %10.0f ops/s\n", threads, total / elapsed);
+    }
+
+    FS_close();
+    disk_close();
+    if (errors) {
+        printf("%ld bad reads\n", errors.load());
+        return 1;
+    }
+    return 0;
+}